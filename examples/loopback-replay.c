@@ -0,0 +1,167 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+/*
+ * Loopback function driven by scripted host traffic from loopback.replay,
+ * so that it runs without UDC, e.g. under make check. Vendor requests
+ * store and read back four bytes of state, OUT transfers are echoed on IN
+ * endpoint until zero length one comes.
+ */
+
+#include <libusbf.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define VENDOR_OUT	0x41
+#define VENDOR_IN	0xc1
+#define REQ_SET		0x01
+#define REQ_GET		0x02
+
+static unsigned char state[4];
+static struct usbf_endpoint *ep_in, *ep_out;
+static volatile int done;
+
+static int setup_handler(const struct usbf_setup_request *setup)
+{
+	if (setup->bRequestType == VENDOR_OUT && setup->bRequest == REQ_SET &&
+	    setup->wLength == sizeof(state))
+		return usbf_setup_response(setup, state, sizeof(state));
+	if (setup->bRequestType == VENDOR_IN && setup->bRequest == REQ_GET)
+		return usbf_setup_response(setup, state,
+			setup->wLength < sizeof(state) ?
+			setup->wLength : sizeof(state));
+
+	return usbf_setup_stall(setup);
+}
+
+static void *events_thread(void *arg)
+{
+	struct usbf_function *func = arg;
+
+	while (!done)
+		if (usbf_wait_events(func, 100) > 0)
+			usbf_handle_events(func);
+
+	return NULL;
+}
+
+static void *loopback_thread(void *arg)
+{
+	unsigned char buf[512];
+	int ret;
+
+	for (;;) {
+		ret = usbf_transfer(ep_out, buf, sizeof(buf));
+		if (ret <= 0)
+			break;
+		if (usbf_transfer(ep_in, buf, ret) != ret) {
+			printf("can't send data\n");
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct usbf_function *my_func;
+	struct usbf_replay_stats stats;
+	struct usbf_replay *rp;
+	pthread_t events, loopback;
+	char script[4096];
+	const char *srcdir;
+	int ret;
+
+	struct usbf_function_descriptor f_desc = {
+		.speed = USBF_SPEED_FS | USBF_SPEED_HS,
+		.interface_class = USBF_CLASS_VENDOR_SPEC,
+		.string = "LOOPBACK",
+		.setup_handler = setup_handler,
+	};
+
+	struct usbf_endpoint_descriptor ep_desc = {
+		.type = USBF_BULK,
+		.fs_maxpacketsize = 64,
+		.hs_maxpacketsize = 512,
+	};
+
+	/* make check runs us from build tree */
+	srcdir = getenv("srcdir");
+	snprintf(script, sizeof(script), "%s", argc > 1 ? argv[1] :
+		srcdir ? srcdir : ".");
+	if (argc < 2)
+		strncat(script, "/loopback.replay",
+			sizeof(script) - strlen(script) - 1);
+
+	my_func = usbf_create_function(&f_desc, "replay");
+	if (!my_func) {
+		printf("function registration failed\n");
+		return 1;
+	}
+
+	ep_desc.direction = USBF_IN;
+	ep_in = usbf_add_endpoint(my_func, &ep_desc);
+	ep_desc.direction = USBF_OUT;
+	ep_out = usbf_add_endpoint(my_func, &ep_desc);
+	if (!ep_in || !ep_out) {
+		printf("can't add endpoints\n");
+		return 1;
+	}
+
+	rp = usbf_replay_start(my_func, script, 0);
+	if (!rp) {
+		perror(script);
+		return 1;
+	}
+
+	pthread_create(&events, NULL, events_thread, my_func);
+	pthread_create(&loopback, NULL, loopback_thread, NULL);
+
+	ret = usbf_replay_wait(rp, &stats);
+	done = 1;
+	pthread_join(events, NULL);
+	pthread_join(loopback, NULL);
+
+	printf("setups %u, stalls %u, in %u (%llu bytes), out %u "
+		"(%llu bytes), failures %u\n", stats.setups, stats.stalls,
+		stats.in_transfers, (unsigned long long)stats.in_bytes,
+		stats.out_transfers, (unsigned long long)stats.out_bytes,
+		stats.failures);
+
+	/* Script expects exactly one request to be stalled */
+	if (!ret && stats.stalls != 1)
+		ret = -1;
+
+	usbf_stop(my_func);
+	usbf_replay_delete(rp);
+	usbf_delete_function(my_func);
+
+	return ret ? 1 : 0;
+}
@@ -58,6 +58,29 @@ enum usbf_endpoint_direction {
 	USBF_IN = 0x80,
 };
 
+/* Isochronous endpoint synchronization type and usage */
+enum usbf_iso_attributes {
+	USBF_ISO_SYNC_NONE = 0x00,
+	USBF_ISO_SYNC_ASYNC = 0x04,
+	USBF_ISO_SYNC_ADAPTIVE = 0x08,
+	USBF_ISO_SYNC_SYNC = 0x0c,
+	USBF_ISO_USAGE_DATA = 0x00,
+	USBF_ISO_USAGE_FEEDBACK = 0x10,
+	USBF_ISO_USAGE_IMPLICIT = 0x20,
+};
+
+enum usbf_recovery {
+	USBF_RECOVERY_NONE = 0x00,
+	USBF_RECOVERY_FLUSH = 0x01,
+	USBF_RECOVERY_CLEAR_HALT = 0x02,
+};
+
+enum usbf_integrity {
+	USBF_INTEGRITY_NONE,
+	/* CRC32C of payload appended as 4 byte little endian trailer */
+	USBF_INTEGRITY_CRC32C,
+};
+
 enum usbf_event_type {
 	USBF_EVENT_BIND,
 	USBF_EVENT_UNBIND,
@@ -71,6 +94,15 @@ enum usbf_event_type {
 	USBF_EVENT_RESUME,
 };
 
+enum usbf_state {
+	USBF_STATE_STOPPED,
+	/* Descriptors written, waiting for gadget to be bound */
+	USBF_STATE_UNBOUND,
+	USBF_STATE_BOUND,
+	USBF_STATE_ENABLED,
+	USBF_STATE_SUSPENDED,
+};
+
 struct usbf_setup_request {
 	uint8_t bRequestType;
 	uint8_t bRequest;
@@ -93,13 +125,193 @@ struct usbf_endpoint_descriptor {
 	enum usbf_endpoint_type type;
 
 	enum usbf_endpoint_direction direction;
+
+	/* USBF_ISO_* flags, isochronous endpoints only */
+	uint8_t iso_attributes;
+	/* Audio class descriptor, with bRefresh and bSynchAddress */
+	int audio;
+	uint8_t refresh;
+
+	/* SuperSpeed companion, Mult is for isochronous endpoints only */
+	uint8_t ss_maxburst;
+	uint8_t ss_mult;
+	/* Reserved per service interval, 0 for whole burst */
+	uint16_t ss_bytes_per_interval;
+};
+
+/*
+ * Endpoint described by what it has to do. Periodic endpoints move
+ * bytes_per_second without data waiting longer than max_latency_us
+ * (0 for any latency), transfer_size bytes have to fit in one service
+ * interval (0 when data can be split freely). Bulk endpoints have no
+ * latency guarantee.
+ */
+struct usbf_endpoint_intent {
+	enum usbf_endpoint_type type;
+	enum usbf_endpoint_direction direction;
+	uint32_t bytes_per_second;
+	uint32_t max_latency_us;
+	uint32_t transfer_size;
 };
 
 struct usbf_endpoint;
 
+struct usbf_feedback_params {
+	/* Nominal rate of data endpoint, in frames per second */
+	uint32_t rate;
+	/* Stream on data endpoint, its measured rate is reported */
+	struct usbf_iso *iso;
+};
+
+struct usbf_capture_params {
+	/* Payload bytes recorded per transfer, 0 for default */
+	uint32_t snaplen;
+	/* Record every n-th transfer, ep0 traffic is always recorded */
+	uint32_t sample;
+	/* Per thread buffer, records are dropped when it's full */
+	size_t ring_size;
+};
+
+struct usbf_replay_stats {
+	uint64_t duration_us;
+	uint32_t setups;
+	uint32_t stalls;
+	uint32_t in_transfers;
+	uint32_t out_transfers;
+	uint64_t in_bytes;
+	uint64_t out_bytes;
+	/* How long host waited for function, in microseconds */
+	uint32_t setup_latency_avg;
+	uint32_t setup_latency_max;
+	uint32_t in_latency_avg;
+	uint32_t in_latency_max;
+	/* Timeouts and responses not matching script */
+	uint32_t failures;
+};
+
+/* Response latency histogram has 1 us buckets, last one takes the rest */
+#define USBF_RT_HISTOGRAM_SIZE 256
+
+struct usbf_rt_params {
+	/* SCHED_FIFO priority, 0 for default */
+	int priority;
+	/* CPU to pin thread to plus one, 0 leaves it unpinned */
+	int cpu;
+	/* Largest transfer */
+	size_t size;
+	/* Responses later than that count as misses, 0 for one microframe */
+	uint32_t deadline_us;
+	/* Run without real-time priority and locked memory if not allowed */
+	int best_effort;
+	/*
+	 * Also lock all current and future memory of whole process with
+	 * mlockall(), for handlers touching more than their buffer. Stays
+	 * in effect after usbf_rt_stop().
+	 */
+	int lock_all;
+	/*
+	 * Called on real-time thread, must not block. For IN endpoint fills
+	 * buffer and returns length to send, for OUT endpoint gets received
+	 * data. Negative return value stops the thread.
+	 */
+	int (*handler)(void *data, size_t length, void *arg);
+	void *arg;
+};
+
+struct usbf_rt_stats {
+	uint64_t transfers;
+	uint64_t errors;
+	uint64_t misses;
+	/* From transfer completion until next one is queued */
+	uint32_t latency_min_ns;
+	uint32_t latency_max_ns;
+	uint32_t latency_avg_ns;
+	uint64_t histogram[USBF_RT_HISTOGRAM_SIZE];
+};
+
+struct usbf_iso_packet {
+	void *data;
+	uint32_t length;
+	/* Filled on completion */
+	uint32_t actual_length;
+	int status;
+};
+
+struct usbf_iso_params {
+	/* Nominal frames per second, frame is one sample of all channels */
+	uint32_t rate;
+	uint32_t frame_size;
+	/* Transfers kept queued, 0 for default */
+	int depth;
+	/* Frames buffered between application and USB, 0 for default */
+	uint32_t fifo_frames;
+};
+
+struct usbf_iso_stats {
+	uint64_t packets;
+	uint64_t frames;
+	/* IN: packet short of data, OUT: application read more than buffered */
+	uint32_t underruns;
+	/* IN: application wrote more than fits, OUT: received data dropped */
+	uint32_t overruns;
+	uint32_t errors;
+	/* Why stream couldn't start on last ENABLE, 0 once it is running */
+	int32_t error;
+	/* Device clock against host frame clock, in parts per million */
+	int32_t drift_ppm;
+	/* Frames per service interval device runs at, 16.16 fixed point */
+	uint32_t interval_frames;
+	uint32_t fifo_level;
+};
+
+struct usbf_busy_poll_params {
+	/* Keep spinning this long after last activity, 0 never spins */
+	uint32_t window_us;
+	/* Most time spent spinning per second, 0 for no limit */
+	uint32_t budget_us;
+};
+
+struct usbf_busy_poll_stats {
+	uint64_t spin_ns;
+	/* Waits which found work while spinning and ones which had to sleep */
+	uint64_t spin_hits;
+	uint64_t sleeps;
+	/* Spin budget left in current second */
+	uint32_t budget_left_us;
+};
+
+/* Descriptor endpoint actually got for current connection */
+struct usbf_endpoint_info {
+	uint8_t address;
+	uint16_t maxpacketsize;
+	/* Additional transactions per microframe (HS periodic endpoints) */
+	uint8_t mult;
+	uint8_t interval;
+};
+
+struct usbf_autotune_params {
+	size_t min_size;
+	size_t max_size;
+	int min_depth;
+	int max_depth;
+	int window_ms;
+};
+
+struct usbf_autotune_stats {
+	/* Recommended transfer size and number of transfers in flight */
+	size_t size;
+	int depth;
+	/* Measured in last window */
+	uint64_t bytes_per_sec;
+	uint32_t latency_us;
+	int settled;
+};
+
 struct usbf_function_descriptor {
 	uint32_t speed;
 	uint8_t interface_class;
+	uint8_t interface_subclass;
+	uint8_t interface_protocol;
 	char *string; /* TODO - USB strings handling */
 	int (*event_handler)(enum usbf_event_type);
 	int (*setup_handler)(const struct usbf_setup_request *);
@@ -113,19 +325,183 @@ usbf_create_function(struct usbf_function_descriptor *func, char *path);
 void usbf_delete_function(struct usbf_function *func);
 
 
+/*
+ * Fails with errno set to EINVAL when descriptor values are not legal
+ * for some speed of function. High-speed and SuperSpeed endpoints
+ * without own interval keep service period of full-speed one.
+ */
 struct usbf_endpoint *usbf_add_endpoint(
 	struct usbf_function *func, struct usbf_endpoint_descriptor *desc);
 
+/*
+ * Fills descriptor with legal values meeting intent at every speed in
+ * speeds. Periodic endpoints get the longest service interval moving one
+ * packet, or transfer_size, which keeps packets well filled without big
+ * reservations in single (micro)frame. Returns -ERANGE when some speed
+ * can't meet intent, it has to be left out.
+ */
+int usbf_endpoint_derive(uint32_t speeds,
+	const struct usbf_endpoint_intent *intent,
+	struct usbf_endpoint_descriptor *desc);
+
+/* usbf_add_endpoint() with descriptor derived for speeds of function */
+struct usbf_endpoint *usbf_add_endpoint_intent(struct usbf_function *func,
+	const struct usbf_endpoint_intent *intent);
+
 
 int usbf_start(struct usbf_function *func);
 
 void usbf_stop(struct usbf_function *func);
 
 
+/*
+ * Function stays started across UNBIND/BIND and DISABLE/ENABLE. Transfers
+ * issued while function is not enabled wait for ENABLE, and transfers
+ * interrupted by DISABLE are restarted once function is enabled again.
+ */
 int usbf_transfer(struct usbf_endpoint *ep, void *data, size_t length);
 
+/*
+ * Transfer giving up after timeout_ms (0 means no timeout) with -ETIMEDOUT.
+ * Returns number of bytes transferred or negative errno, which is stored
+ * in errno as well. usbf_transfer() uses timeout set for endpoint.
+ * Request which can't be cancelled within 100 ms after timeout is left
+ * in flight and might still access data until usbf_stop().
+ */
+int usbf_transfer_timeout(struct usbf_endpoint *ep, void *data, size_t length,
+	int timeout_ms);
+
+void usbf_endpoint_set_timeout(struct usbf_endpoint *ep, int timeout_ms);
+
+/*
+ * Transfers count packets on isochronous endpoint, one per service
+ * interval, submitted all at once. Fills actual length and status
+ * (negative errno) of each, returns number of packets which succeeded.
+ * At most 32 packets per call. Packets timed out are left in flight the
+ * same way as in usbf_transfer_timeout().
+ */
+int usbf_transfer_iso(struct usbf_endpoint *ep,
+	struct usbf_iso_packet *packets, int count, int timeout_ms);
+
+/*
+ * Single transfer between endpoint and file descriptor, e.g. socket,
+ * without copying data through user space. IN endpoint sends up to length
+ * bytes read from fd and returns 0 on its EOF, OUT endpoint receives up
+ * to length bytes and writes all of them to fd. Data goes through pipe
+ * grown to length where pipe size limit allows, it bounds length then.
+ * Returns number of bytes moved or negative errno, -EINVAL before
+ * anything is moved when endpoint or fd can't be spliced, caller falls
+ * back to usbf_transfer() then. Blocks without timeout, signal makes it
+ * return -EINTR; IN data already taken from fd is sent by next call.
+ * IN transfer filling whole packets leaves its last byte to next call
+ * when fd has more data, otherwise it is ended with zero length packet.
+ */
+int usbf_splice(struct usbf_endpoint *ep, int fd, size_t length);
+
+/*
+ * Drops IN data usbf_splice() took from previous fd but didn't send, and
+ * ZLP it owes, e.g. when switching to other client. Nobody may splice on
+ * endpoint meanwhile.
+ */
+void usbf_splice_reset(struct usbf_endpoint *ep);
+
+/*
+ * Cancels all transfers in flight on endpoint, they fail with errno set
+ * to ECANCELED. Returns number of cancelled transfers.
+ */
+int usbf_endpoint_cancel(struct usbf_endpoint *ep);
+
 int usbf_handle_events(struct usbf_function *func);
 
+/*
+ * Waits until ep0 has events or non-blocking endpoint can make progress,
+ * up to timeout_ms (negative means forever). Returns 1 if there is work,
+ * 0 on timeout. OUT endpoints are reported while they have data to read,
+ * IN endpoints only once after their request completes or function gets
+ * enabled. While deferred setup is pending it returns 0 early every few
+ * ms, so that its completion is noticed. To be called from single event
+ * loop thread.
+ */
+int usbf_wait_events(struct usbf_function *func, int timeout_ms);
+
+/*
+ * Makes usbf_wait_events() spin for a while after activity before going
+ * to sleep, trading CPU time for wake-up latency under traffic.
+ */
+void usbf_set_busy_poll(struct usbf_function *func,
+	const struct usbf_busy_poll_params *params);
+
+void usbf_get_busy_poll_stats(struct usbf_function *func,
+	struct usbf_busy_poll_stats *stats);
+
+/*
+ * Has to be called before usbf_start(). In non-blocking mode
+ * usbf_transfer() returns -EAGAIN instead of blocking. IN data is copied
+ * and queued, OUT data is read ahead. Endpoint fd polls readable when
+ * usbf_transfer() can make progress, for idle IN endpoint that is all
+ * the time.
+ */
+int usbf_endpoint_set_nonblock(struct usbf_endpoint *ep, int nonblock);
+
+int usbf_endpoint_get_fd(struct usbf_endpoint *ep);
+
+/*
+ * Handler called by runtime thread of function whenever non-blocking
+ * endpoint can make progress, as usbf_wait_events() reports it. Has to be
+ * set before function is added to runtime.
+ */
+int usbf_endpoint_set_handler(struct usbf_endpoint *ep,
+	void (*handler)(struct usbf_endpoint *ep, void *arg), void *arg);
+
+/*
+ * Valid between ENABLE and DISABLE, returns -ENOTCONN otherwise. Speed is
+ * one of USBF_SPEED_* flags, or 0 if it couldn't be determined.
+ */
+int usbf_endpoint_get_info(struct usbf_endpoint *ep,
+	struct usbf_endpoint_info *info);
+
+uint32_t usbf_get_speed(struct usbf_function *func);
+
+/* Number of bytes left in endpoint FIFO */
+int usbf_endpoint_fifo_status(struct usbf_endpoint *ep);
+
+int usbf_endpoint_fifo_flush(struct usbf_endpoint *ep);
+
+int usbf_endpoint_halt(struct usbf_endpoint *ep);
+
+int usbf_endpoint_clear_halt(struct usbf_endpoint *ep);
+
+/*
+ * When transfer fails because endpoint stalled or hit protocol error,
+ * apply recovery policy (enum usbf_recovery flags) and retry transfer,
+ * up to retries times.
+ */
+int usbf_endpoint_set_recovery(struct usbf_endpoint *ep,
+	unsigned int policy, int retries);
+
+/*
+ * Integrity stage appends checksum trailer to each IN transfer and verifies
+ * and strips it from each OUT transfer, which fails with errno set to
+ * EBADMSG on mismatch. Returned length doesn't include trailer, so OUT
+ * transfer carries up to length + 4 bytes. Not available for isochronous
+ * endpoints.
+ */
+int usbf_endpoint_set_integrity(struct usbf_endpoint *ep,
+	enum usbf_integrity mode);
+
+/* Castagnoli CRC, hardware accelerated where CPU supports it */
+uint32_t usbf_crc32c(uint32_t crc, const void *data, size_t length);
+
+enum usbf_state usbf_get_state(struct usbf_function *func);
+
+/*
+ * Wait until function is enabled. Thread which calls usbf_handle_events()
+ * handles ep0 events meanwhile, any other thread just waits for it, so
+ * event handlers never run on data threads. Negative timeout means no
+ * timeout.
+ */
+int usbf_wait_enabled(struct usbf_function *func, int timeout_ms);
+
 int usbf_setup_ack(const struct usbf_setup_request *setup);
 
 int usbf_setup_response(const struct usbf_setup_request *setup,
@@ -133,4 +509,280 @@ int usbf_setup_response(const struct usbf_setup_request *setup,
 
 int usbf_setup_stall(const struct usbf_setup_request *setup);
 
+/*
+ * Called from setup handler to complete request later. Returned handle
+ * can be passed to usbf_setup_ack(), usbf_setup_response() or
+ * usbf_setup_stall() from any thread, exactly once. Until then ep0 events
+ * are not processed. Request not completed within timeout is stalled by
+ * usbf_handle_events() and completing it returns -ETIMEDOUT.
+ */
+const struct usbf_setup_request *
+usbf_setup_defer(const struct usbf_setup_request *setup);
+
+/* Milliseconds left before host gives up on deferred request */
+int usbf_setup_time_left(const struct usbf_setup_request *setup);
+
+void usbf_setup_set_timeout(struct usbf_function *func, int timeout_ms);
+
+/*
+ * Requests matching (bRequestType, bRequest, wValue, wIndex) exactly are
+ * dispatched to handler instead of setup_handler from function descriptor.
+ */
+int usbf_register_setup_handler(struct usbf_function *func,
+	uint8_t bRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	int (*handler)(const struct usbf_setup_request *));
+
+/*
+ * Constant response served by usbf_handle_events() without calling into
+ * application. Data is copied. For host-to-device requests data must be
+ * empty and request is simply acked.
+ */
+int usbf_register_setup_response(struct usbf_function *func,
+	uint8_t bRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	const void *data, size_t length);
+
+int usbf_unregister_setup(struct usbf_function *func,
+	uint8_t bRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex);
+
+/*
+ * Autotuner measures throughput and latency of usbf_transfer() on bulk
+ * endpoint over sliding windows and searches for the smallest transfer
+ * size and depth giving (almost) full throughput. Application is expected
+ * to follow recommendation returned by usbf_autotune_get(), only
+ * transfers of recommended size are measured. Default params are used
+ * if params is NULL.
+ */
+int usbf_autotune_enable(struct usbf_endpoint *ep,
+	const struct usbf_autotune_params *params);
+
+void usbf_autotune_disable(struct usbf_endpoint *ep);
+
+int usbf_autotune_get(struct usbf_endpoint *ep,
+	struct usbf_autotune_stats *stats);
+
+/*
+ * Length-delimited messages over bulk IN/OUT pair, either of them can be
+ * NULL. Outgoing messages are packed into transfers of up to batch_size
+ * bytes, sent when batch is full or on usbf_framer_flush(). Message can
+ * be up to batch_size - 8 bytes, 4 of them go to its header. Received
+ * message points into receive buffer and stays valid until next
+ * usbf_framer_recv() call.
+ */
+struct usbf_framer;
+
+struct usbf_framer *usbf_framer_create(struct usbf_endpoint *in,
+	struct usbf_endpoint *out, size_t batch_size);
+
+void usbf_framer_delete(struct usbf_framer *fr);
+
+int usbf_framer_send(struct usbf_framer *fr, const void *msg, size_t length);
+
+int usbf_framer_flush(struct usbf_framer *fr);
+
+int usbf_framer_recv(struct usbf_framer *fr, const void **msg, size_t *length);
+
+/* Most transfers stream, shm and iso rings can keep queued */
+#define USBF_MAX_DEPTH 32
+
+/*
+ * Zero-copy stream over ring of depth library owned buffers of size bytes
+ * each. For IN endpoint usbf_stream_acquire() returns empty buffer to be
+ * filled and queued with usbf_stream_commit(). For OUT endpoint all free
+ * buffers are kept queued, usbf_stream_acquire() returns oldest filled
+ * one and usbf_stream_commit() gives it back. One buffer can be acquired
+ * at a time. Errors of IN transfers are reported by usbf_stream_acquire()
+ * when their buffer is reused. Endpoint can't be in non-blocking mode.
+ */
+struct usbf_stream;
+
+struct usbf_stream *usbf_stream_create(struct usbf_endpoint *ep,
+	size_t size, int depth);
+
+void usbf_stream_delete(struct usbf_stream *st);
+
+void *usbf_stream_acquire(struct usbf_stream *st, size_t *length,
+	int timeout_ms);
+
+int usbf_stream_commit(struct usbf_stream *st, size_t length);
+
+/*
+ * Endpoint buffer ring in shared memory, for gadgets where other processes
+ * produce or consume data. Process owning endpoint creates it and drives
+ * transfers with usbf_shm_process(), typically from dedicated thread.
+ * Descriptors returned by usbf_shm_get_fds() (memfd and two eventfd
+ * doorbells) are passed to peer process, e.g. with SCM_RIGHTS, which
+ * maps the ring with usbf_shm_attach() and uses usbf_shm_acquire() and
+ * usbf_shm_commit() same way as stream API. Peer is not trusted by owner.
+ */
+struct usbf_shm;
+
+struct usbf_shm *usbf_shm_create(struct usbf_endpoint *ep,
+	size_t size, int depth);
+
+/* Takes ownership of descriptors */
+struct usbf_shm *usbf_shm_attach(const int fds[3]);
+
+void usbf_shm_delete(struct usbf_shm *shm);
+
+void usbf_shm_get_fds(struct usbf_shm *shm, int fds[3]);
+
+/* Doorbell of this side, polls readable when other side moved the ring */
+int usbf_shm_get_fd(struct usbf_shm *shm);
+
+/*
+ * Owner side. Queues buffers handed over by peer and returns completed
+ * ones to it. Waits up to timeout_ms (negative means forever) for
+ * something to happen, returns number of buffers returned to peer.
+ */
+int usbf_shm_process(struct usbf_shm *shm, int timeout_ms);
+
+void *usbf_shm_acquire(struct usbf_shm *shm, size_t *length, int timeout_ms);
+
+int usbf_shm_commit(struct usbf_shm *shm, size_t length);
+
+/*
+ * Records setup requests, other ep0 events and completed transfers of
+ * function into pcap file with usbmon link type, readable by Wireshark.
+ * Each thread records into its own buffer, flushed to file by background
+ * thread. Zero params fields mean defaults. Only one capture per function.
+ */
+struct usbf_capture;
+
+struct usbf_capture *usbf_capture_start(struct usbf_function *func,
+	const char *path, const struct usbf_capture_params *params);
+
+void usbf_capture_stop(struct usbf_capture *cap);
+
+/* Number of records lost because buffers were full */
+uint64_t usbf_capture_dropped(struct usbf_capture *cap);
+
+/*
+ * Replays scripted host traffic against function, for testing without
+ * UDC. Called instead of usbf_start(), function runs on socket pairs and
+ * replay thread plays host on the other ends. Script lines are
+ *
+ *   <time ms> bind|unbind|enable|disable|suspend|resume
+ *   <time ms> setup <bRequestType> <bRequest> <wValue> <wIndex> <wLength>
+ *   <time ms> in <ep> <length>
+ *   <time ms> out <ep> <length>
+ *   <time ms> timeout <ms>
+ *
+ * with setup fields in hex and endpoints numbered from 1 in order they
+ * were added. Commands take options data=<hex> (OUT data, expected IN
+ * data), count=<n> and period=<ms> to repeat them; repeats interleave
+ * with other commands by time, simultaneous ones keep script order.
+ * Host waits for each setup and IN transfer up to timeout, 1 s by
+ * default. Speed scales timeline, 0 runs it as fast as possible. IN
+ * transfers complete once queued to socket. Endpoint info is that of
+ * fastest speed function supports. Endpoints work without AIO under
+ * replay, so only plain blocking transfers without timeouts and
+ * usbf_splice() are supported. Has to be deleted after usbf_stop(). See
+ * examples/loopback-replay.c and its script.
+ */
+struct usbf_replay;
+
+struct usbf_replay *usbf_replay_start(struct usbf_function *func,
+	const char *script, double speed);
+
+/* Waits for end of script, returns -EPROTO if anything failed */
+int usbf_replay_wait(struct usbf_replay *rp, struct usbf_replay_stats *stats);
+
+void usbf_replay_delete(struct usbf_replay *rp);
+
+/*
+ * Isochronous stream at nominal rate, driven by its own thread which keeps
+ * depth transfers queued. Application writes frames (IN) or reads them
+ * (OUT) at pace of device clock, FIFO level tells how it drifts against
+ * host frame clock. IN packets are sized to keep FIFO half full, which
+ * is what asynchronous endpoint has to do. Both calls never block and
+ * return number of frames done, streaming starts once FIFO is half full.
+ * Creating fails with EINVAL if rate doesn't fit packets of any speed
+ * function supports.
+ */
+struct usbf_iso;
+
+struct usbf_iso *usbf_iso_create(struct usbf_endpoint *ep,
+	const struct usbf_iso_params *params);
+
+void usbf_iso_delete(struct usbf_iso *iso);
+
+int usbf_iso_write(struct usbf_iso *iso, const void *data, size_t frames);
+
+int usbf_iso_read(struct usbf_iso *iso, void *data, size_t frames);
+
+void usbf_iso_get_stats(struct usbf_iso *iso, struct usbf_iso_stats *stats);
+
+/*
+ * Associates data endpoint with its synchronization (feedback) endpoint,
+ * which goes to bSynchAddress of audio class descriptor. To be called
+ * before usbf_start().
+ */
+int usbf_endpoint_set_sync(struct usbf_endpoint *ep,
+	struct usbf_endpoint *sync_ep);
+
+/*
+ * Sends explicit feedback for asynchronous isochronous data endpoint on
+ * ep, isochronous IN endpoint with USBF_ISO_USAGE_FEEDBACK, each time host
+ * polls it. Reported rate is the one measured by iso stream if given,
+ * else last one passed to usbf_feedback_set_rate(), nominal until then.
+ * Encoded as 10.14 frames per frame at full speed and 16.16 frames per
+ * microframe at higher speeds, so device runs on its own clock without
+ * resampling. Has to be deleted before its iso stream.
+ */
+struct usbf_feedback;
+
+struct usbf_feedback *usbf_feedback_create(struct usbf_endpoint *ep,
+	const struct usbf_feedback_params *params);
+
+void usbf_feedback_delete(struct usbf_feedback *fb);
+
+/* Rate of local clock driving data endpoint, in frames per second */
+void usbf_feedback_set_rate(struct usbf_feedback *fb, double rate);
+
+/*
+ * Runs endpoint on dedicated SCHED_FIFO thread, for devices which have to
+ * respond within microframe. Transfer buffer and thread stack are locked
+ * and faulted in up front, steady state path makes no allocations and no
+ * syscalls other than submitting and reaping transfer. Endpoint must not
+ * be used otherwise meanwhile. Has to be stopped before usbf_stop().
+ */
+struct usbf_rt;
+
+struct usbf_rt *usbf_rt_start(struct usbf_endpoint *ep,
+	const struct usbf_rt_params *params);
+
+/* Returns error which stopped thread by itself, if any */
+int usbf_rt_stop(struct usbf_rt *rt);
+
+void usbf_rt_get_stats(struct usbf_rt *rt, struct usbf_rt_stats *stats);
+
+/*
+ * Runtime dispatching events of many functions on pool of event loop
+ * threads, one per CPU process may run on by default, pinned to these
+ * CPUs. Each function is assigned to single thread and all its events
+ * are handled there, ep0 ones as well as those of non-blocking endpoints
+ * with handler set. Blocking endpoints are left to their own threads.
+ */
+struct usbf_runtime;
+
+struct usbf_runtime *usbf_runtime_create(int threads);
+
+void usbf_runtime_delete(struct usbf_runtime *rt);
+
+/* Function has to be started before it's added */
+int usbf_runtime_add_function(struct usbf_runtime *rt,
+	struct usbf_function *func);
+
+/* Has to be called before usbf_stop() */
+int usbf_runtime_remove_function(struct usbf_runtime *rt,
+	struct usbf_function *func);
+
+/* Same as usbf_set_busy_poll(), for each runtime thread */
+void usbf_runtime_set_busy_poll(struct usbf_runtime *rt,
+	const struct usbf_busy_poll_params *params);
+
+int usbf_runtime_start(struct usbf_runtime *rt);
+
+void usbf_runtime_stop(struct usbf_runtime *rt);
+
 #endif /* __LIBUSBF_H__ */
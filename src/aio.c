@@ -0,0 +1,810 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+/*
+ * FunctionFS ep files don't implement poll() and plain read()/write()
+ * block until request is completed, so non-blocking I/O is built on
+ * kernel AIO with completions signalled on eventfd.
+ */
+
+static inline int io_setup(unsigned int nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static inline int io_cancel(aio_context_t ctx, struct iocb *iocb,
+	struct io_event *result)
+{
+	return syscall(__NR_io_cancel, ctx, iocb, result);
+}
+
+static inline int io_getevents(aio_context_t ctx, long min_nr, long nr,
+	struct io_event *events, struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+void __usbf_aio_init(struct usbf_endpoint *ep)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ep->aio_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&ep->aio_lock, NULL);
+	ep->event_fd = -1;
+	ep->aio_reqs = NULL;
+	ep->aio_reaping = 0;
+}
+
+void __usbf_aio_destroy(struct usbf_endpoint *ep)
+{
+	pthread_cond_destroy(&ep->aio_cond);
+	pthread_mutex_destroy(&ep->aio_lock);
+}
+
+int __usbf_aio_open(struct usbf_endpoint *ep, int nr)
+{
+	ep->aio_ctx = 0;
+	if (io_setup(nr, &ep->aio_ctx) < 0)
+		return -errno;
+
+	ep->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ep->event_fd < 0) {
+		io_destroy(ep->aio_ctx);
+		return -errno;
+	}
+
+	ep->nb.state = NB_IDLE;
+	ep->nb.offset = 0;
+	ep->aio_reqs = NULL;
+	ep->aio_reaping = 0;
+
+	return 0;
+}
+
+void __usbf_aio_prep(struct usbf_endpoint *ep, struct iocb *iocb,
+	void *buf, size_t length, void *data)
+{
+	memset(iocb, 0, sizeof(*iocb));
+	iocb->aio_fildes = ep->epfile;
+	iocb->aio_lio_opcode = ep->desc.direction == USBF_IN ?
+		IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+	iocb->aio_buf = (uintptr_t)buf;
+	iocb->aio_nbytes = length;
+	iocb->aio_flags = IOCB_FLAG_RESFD;
+	iocb->aio_resfd = ep->event_fd;
+	iocb->aio_data = (uintptr_t)data;
+}
+
+int __usbf_aio_submit(struct usbf_endpoint *ep, struct iocb **iocbs, int nr)
+{
+	int ret;
+
+	ret = io_submit(ep->aio_ctx, nr, iocbs);
+	return ret < 0 ? -errno : ret;
+}
+
+int __usbf_aio_reap(struct usbf_endpoint *ep, struct io_event *events,
+	int min_nr, int nr, struct timespec *timeout)
+{
+	int ret;
+
+	do {
+		ret = io_getevents(ep->aio_ctx, min_nr, nr, events, timeout);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : ret;
+}
+
+/* Keeps event_fd readable when usbf_transfer() can make progress */
+void __usbf_aio_signal(struct usbf_endpoint *ep, int ready)
+{
+	eventfd_t count;
+
+	if (ready)
+		eventfd_write(ep->event_fd, 1);
+	else
+		eventfd_read(ep->event_fd, &count);
+}
+
+void __usbf_aio_link(struct usbf_endpoint *ep,
+	struct __usbf_aio_req *req)
+{
+	req->done = 0;
+	req->cancel = 0;
+	req->cancelled = 0;
+	req->batch = NULL;
+	pthread_mutex_lock(&ep->aio_lock);
+	req->next = ep->aio_reqs;
+	ep->aio_reqs = req;
+	pthread_mutex_unlock(&ep->aio_lock);
+}
+
+/* Called with aio_lock held */
+void __usbf_aio_unlink(struct usbf_endpoint *ep,
+	struct __usbf_aio_req *req)
+{
+	struct __usbf_aio_req **pos;
+
+	for (pos = &ep->aio_reqs; *pos; pos = &(*pos)->next) {
+		if (*pos == req) {
+			*pos = req->next;
+			break;
+		}
+	}
+	pthread_cond_broadcast(&ep->aio_cond);
+}
+
+/* Called with aio_lock held */
+static void __usbf_aio_complete(struct io_event *events, int count)
+{
+	struct __usbf_aio_req *req;
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		req = (struct __usbf_aio_req *)(uintptr_t)events[i].data;
+		req->result = events[i].res;
+		req->done = 1;
+		/* Completed before cancel got to it, result is still valid */
+		if (req->cancel && (req->result == -ECONNRESET ||
+				    req->result == -ECANCELED))
+			req->cancelled = req->cancel;
+	}
+}
+
+/* Called with aio_lock held, reaps whatever is completed without blocking */
+void __usbf_aio_poll(struct usbf_endpoint *ep)
+{
+	struct io_event events[AIO_REAP_BATCH];
+	struct timespec zero = { 0, 0 };
+	int ret;
+
+	/* Current reaper hands completions over by itself */
+	if (ep->aio_reaping || ep->event_fd < 0)
+		return;
+
+	do {
+		ret = __usbf_aio_reap(ep, events, 0, AIO_REAP_BATCH, &zero);
+		if (ret > 0) {
+			__usbf_aio_complete(events, ret);
+			pthread_cond_broadcast(&ep->aio_cond);
+		}
+	} while (ret == AIO_REAP_BATCH);
+}
+
+static int __usbf_aio_cancel(struct usbf_endpoint *ep,
+	struct __usbf_aio_req *req, int reason)
+{
+	struct io_event event;
+	int ret;
+
+	req->cancel = reason;
+	ret = io_cancel(ep->aio_ctx, &req->iocb, &event);
+	if (!ret) {
+		/* Old kernels hand completion back right here */
+		__usbf_aio_complete(&event, 1);
+		return 0;
+	}
+
+	return errno == EINPROGRESS ? 0 : -errno;
+}
+
+int usbf_endpoint_cancel(struct usbf_endpoint *ep)
+{
+	struct __usbf_aio_req *req;
+	int count = 0;
+
+	if (ep->event_fd < 0)
+		return 0;
+
+	pthread_mutex_lock(&ep->aio_lock);
+	for (req = ep->aio_reqs; req; req = req->next)
+		if (!req->done && !__usbf_aio_cancel(ep, req, ECANCELED))
+			++count;
+	pthread_cond_broadcast(&ep->aio_cond);
+	pthread_mutex_unlock(&ep->aio_lock);
+
+	return count;
+}
+
+/* Joins thread doing transfers on ep, it might be submitting right now */
+void __usbf_aio_cancel_join(struct usbf_endpoint *ep, pthread_t thread)
+{
+	struct timespec ts;
+
+	do {
+		usbf_endpoint_cancel(ep);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += STATE_WAIT_SLICE * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_nsec -= 1000000000;
+			++ts.tv_sec;
+		}
+	} while (pthread_timedjoin_np(thread, NULL, &ts) == ETIMEDOUT);
+}
+
+/*
+ * Many threads can wait on one endpoint, whichever is first reaps
+ * completions for all of them, others sleep on aio_cond. Reaper asks for
+ * as many completions as its requests miss, so batch costs few wake-ups.
+ * Called with aio_lock held, returns -ETIMEDOUT if deadline passes first.
+ */
+int __usbf_aio_wait_all(struct usbf_endpoint *ep, struct __usbf_aio_req *reqs,
+	int count, const struct timespec *deadline)
+{
+	struct io_event events[AIO_REAP_BATCH];
+	struct timespec ts;
+	int i, ret, left, pending;
+
+	for (;;) {
+		pending = 0;
+		for (i = 0; i < count; ++i)
+			pending += !reqs[i].done;
+		if (!pending)
+			break;
+
+		left = -1;
+		if (deadline) {
+			left = __usbf_ms_left(deadline);
+			if (left <= 0)
+				return -ETIMEDOUT;
+		}
+
+		if (ep->aio_reaping) {
+			if (left < 0)
+				pthread_cond_wait(&ep->aio_cond, &ep->aio_lock);
+			else
+				pthread_cond_timedwait(&ep->aio_cond,
+					&ep->aio_lock, deadline);
+			continue;
+		}
+
+		ep->aio_reaping = 1;
+		pthread_mutex_unlock(&ep->aio_lock);
+		if (left >= 0) {
+			ts.tv_sec = left / 1000;
+			ts.tv_nsec = (left % 1000) * 1000000;
+		}
+		/* Back on first completion, rest is picked up by next round */
+		ret = __usbf_aio_reap(ep, events, 1, AIO_REAP_BATCH,
+			left >= 0 ? &ts : NULL);
+		pthread_mutex_lock(&ep->aio_lock);
+		ep->aio_reaping = 0;
+		if (ret > 0)
+			__usbf_aio_complete(events, ret);
+		pthread_cond_broadcast(&ep->aio_cond);
+	}
+
+	return 0;
+}
+
+int __usbf_aio_wait(struct usbf_endpoint *ep, struct __usbf_aio_req *req,
+	const struct timespec *deadline)
+{
+	return __usbf_aio_wait_all(ep, req, 1, deadline);
+}
+
+/*
+ * Called with aio_lock held, frees abandoned requests which completed,
+ * or all of them once AIO context is gone.
+ */
+static void __usbf_aio_drop_orphans(struct usbf_endpoint *ep, int all)
+{
+	struct __usbf_aio_req **pos, *req;
+
+	pos = &ep->aio_reqs;
+	while ((req = *pos)) {
+		if (!req->batch || (!req->done && !all)) {
+			pos = &req->next;
+			continue;
+		}
+		*pos = req->next;
+		if (!--req->batch->orphans)
+			free(req->batch);
+	}
+}
+
+/*
+ * Called with aio_lock held after deadline of timed transfer. Requests
+ * kernel doesn't give back within grace period are left in flight, owned
+ * by their batch, and nobody touches them again. Returns their count.
+ */
+static int __usbf_aio_abandon(struct usbf_endpoint *ep,
+	struct __usbf_aio_batch *batch, int count)
+{
+	struct __usbf_aio_req *req;
+	struct timespec grace;
+	int i;
+
+	for (i = 0; i < count; ++i)
+		if (!batch->reqs[i].done)
+			__usbf_aio_cancel(ep, &batch->reqs[i], ETIMEDOUT);
+	__usbf_ms_from_now(&grace, AIO_CANCEL_GRACE);
+	__usbf_aio_wait_all(ep, batch->reqs, count, &grace);
+
+	batch->orphans = 0;
+	for (i = 0; i < count; ++i) {
+		req = &batch->reqs[i];
+		if (req->done) {
+			__usbf_aio_unlink(ep, req);
+			continue;
+		}
+		req->detached = 1;
+		req->batch = batch;
+		++batch->orphans;
+	}
+
+	return batch->orphans;
+}
+
+/* Blocking transfer, returns like read()/write() */
+int __usbf_transfer_aio(struct usbf_endpoint *ep, const struct iovec *iov,
+	int iovcnt, int timeout_ms)
+{
+	struct __usbf_aio_req local, *req = &local;
+	struct __usbf_aio_batch *batch = NULL;
+	struct iocb *iocbp;
+	struct timespec deadline;
+	long result;
+	int ret;
+
+	/* No AIO context, nothing to time out or cancel with */
+	if (ep->event_fd < 0)
+		return ep->desc.direction == USBF_IN ?
+			writev(ep->epfile, iov, iovcnt) :
+			readv(ep->epfile, iov, iovcnt);
+
+	if (timeout_ms > 0) {
+		__usbf_ms_from_now(&deadline, timeout_ms);
+		/* Kernel might not give request back after deadline */
+		batch = malloc(sizeof(*batch) + sizeof(*req));
+		if (!batch) {
+			errno = ENOMEM;
+			return -1;
+		}
+		req = batch->reqs;
+	}
+
+	if (iovcnt == 1) {
+		__usbf_aio_prep(ep, &req->iocb, iov->iov_base, iov->iov_len,
+			req);
+	} else {
+		__usbf_aio_prep(ep, &req->iocb, (void *)iov, iovcnt, req);
+		req->iocb.aio_lio_opcode = ep->desc.direction == USBF_IN ?
+			IOCB_CMD_PWRITEV : IOCB_CMD_PREADV;
+	}
+	/* Nobody polls event_fd of blocking endpoint */
+	req->iocb.aio_flags = 0;
+	req->detached = 0;
+	__usbf_aio_link(ep, req);
+	iocbp = &req->iocb;
+	ret = __usbf_aio_submit(ep, &iocbp, 1);
+
+	pthread_mutex_lock(&ep->aio_lock);
+	__usbf_aio_drop_orphans(ep, 0);
+	if (ret < 0) {
+		__usbf_aio_unlink(ep, req);
+		pthread_mutex_unlock(&ep->aio_lock);
+		free(batch);
+		errno = -ret;
+		return -1;
+	}
+
+	if (__usbf_aio_wait(ep, req, batch ? &deadline : NULL) &&
+	    __usbf_aio_abandon(ep, batch, 1)) {
+		pthread_mutex_unlock(&ep->aio_lock);
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	__usbf_aio_unlink(ep, req);
+	pthread_mutex_unlock(&ep->aio_lock);
+
+	result = req->cancelled ? -req->cancelled : req->result;
+	free(batch);
+	if (result < 0) {
+		errno = -result;
+		return -1;
+	}
+
+	return result;
+}
+
+/* Without AIO context, one packet after another */
+static int __usbf_transfer_iso_sync(struct usbf_endpoint *ep,
+	struct usbf_iso_packet *packets, int count)
+{
+	int i, ret, done = 0;
+
+	for (i = 0; i < count; ++i) {
+		ret = ep->desc.direction == USBF_IN ?
+			write(ep->epfile, packets[i].data, packets[i].length) :
+			read(ep->epfile, packets[i].data, packets[i].length);
+		packets[i].status = ret < 0 ? -errno : 0;
+		packets[i].actual_length = ret < 0 ? 0 : ret;
+		done += ret >= 0;
+		__usbf_capture_transfer(ep, packets[i].data,
+			ret < 0 ? -errno : ret);
+	}
+
+	return done;
+}
+
+int usbf_transfer_iso(struct usbf_endpoint *ep,
+	struct usbf_iso_packet *packets, int count, int timeout_ms)
+{
+	struct __usbf_aio_req local[AIO_NR_EVENTS], *reqs = local;
+	struct __usbf_aio_batch *batch = NULL;
+	struct iocb *iocbs[AIO_NR_EVENTS];
+	struct timespec deadline;
+	long result;
+	int i, ret, submitted, done = 0;
+
+	if (ep->desc.type != USBF_ISOCHRONOUS || ep->nonblock ||
+	    count < 1 || count > AIO_NR_EVENTS)
+		return -EINVAL;
+
+	if (timeout_ms > 0)
+		__usbf_ms_from_now(&deadline, timeout_ms);
+	ret = usbf_wait_enabled(ep->func, timeout_ms > 0 ? timeout_ms : -1);
+	if (!ret && ep->event_fd >= 0 && timeout_ms > 0) {
+		/* Kernel might not give requests back after deadline */
+		batch = malloc(sizeof(*batch) + count * sizeof(*reqs));
+		if (batch)
+			reqs = batch->reqs;
+		else
+			ret = -ENOMEM;
+	}
+	if (ret) {
+		for (i = 0; i < count; ++i) {
+			packets[i].status = ret;
+			packets[i].actual_length = 0;
+		}
+		return ret;
+	}
+
+	if (ep->event_fd < 0)
+		return __usbf_transfer_iso_sync(ep, packets, count);
+
+	/* Each request is one service interval, all go in single syscall */
+	for (i = 0; i < count; ++i) {
+		__usbf_aio_prep(ep, &reqs[i].iocb, packets[i].data,
+			packets[i].length, &reqs[i]);
+		reqs[i].iocb.aio_flags = 0;
+		reqs[i].detached = 0;
+		__usbf_aio_link(ep, &reqs[i]);
+		iocbs[i] = &reqs[i].iocb;
+	}
+	ret = __usbf_aio_submit(ep, iocbs, count);
+	submitted = ret < 0 ? 0 : ret;
+
+	pthread_mutex_lock(&ep->aio_lock);
+	__usbf_aio_drop_orphans(ep, 0);
+	/* Not submitted ones fail with error of submission */
+	for (i = submitted; i < count; ++i) {
+		reqs[i].done = 1;
+		reqs[i].cancelled = ret < 0 ? -ret : EAGAIN;
+	}
+	if (__usbf_aio_wait_all(ep, reqs, submitted,
+			batch ? &deadline : NULL) &&
+	    __usbf_aio_abandon(ep, batch, submitted))
+		/* Abandoned ones belong to batch now */
+		batch = NULL;
+	/* Every packet gets its status, even when nothing went out */
+	for (i = 0; i < count; ++i) {
+		result = !reqs[i].done ? -ETIMEDOUT : reqs[i].cancelled ?
+			-reqs[i].cancelled : reqs[i].result;
+		packets[i].status = result < 0 ? result : 0;
+		packets[i].actual_length = result < 0 ? 0 : result;
+		done += result >= 0;
+		if (reqs[i].done)
+			__usbf_aio_unlink(ep, &reqs[i]);
+	}
+	pthread_mutex_unlock(&ep->aio_lock);
+	free(batch);
+
+	for (i = 0; i < count; ++i)
+		__usbf_capture_transfer(ep, packets[i].data,
+			packets[i].status < 0 ? packets[i].status :
+			(long)packets[i].actual_length);
+
+	if (!submitted)
+		return ret < 0 ? ret : -EAGAIN;
+
+	return done;
+}
+
+static int __usbf_nonblock_submit(struct usbf_endpoint *ep)
+{
+	struct __usbf_nonblock *nb = &ep->nb;
+	struct __usbf_aio_req *req = &nb->req;
+	struct iocb *iocbp = &req->iocb;
+	int ret;
+
+	__usbf_aio_prep(ep, &req->iocb, nb->buf, nb->length, req);
+	req->detached = 1;
+	req->seq = nb->seq;
+	__usbf_autotune_begin(ep, &nb->start);
+	__usbf_aio_link(ep, req);
+	ret = __usbf_aio_submit(ep, &iocbp, 1);
+	if (ret < 0) {
+		pthread_mutex_lock(&ep->aio_lock);
+		__usbf_aio_unlink(ep, req);
+		pthread_mutex_unlock(&ep->aio_lock);
+		return ret;
+	}
+
+	nb->state = NB_INFLIGHT;
+	nb->offset = 0;
+	return 0;
+}
+
+static void __usbf_nonblock_reap(struct usbf_endpoint *ep)
+{
+	struct __usbf_nonblock *nb = &ep->nb;
+	struct timespec zero = { 0, 0 };
+	uint8_t trailer[USBF_INTEGRITY_TRAILER];
+	struct io_event event;
+
+	if (nb->state != NB_INFLIGHT)
+		return;
+
+	pthread_mutex_lock(&ep->aio_lock);
+	/* Might have been completed by io_cancel() already */
+	if (!nb->req.done && __usbf_aio_reap(ep, &event, 0, 1, &zero) == 1)
+		__usbf_aio_complete(&event, 1);
+	if (nb->req.done) {
+		__usbf_aio_unlink(ep, &nb->req);
+		nb->state = NB_DONE;
+		if (nb->req.cancelled)
+			nb->req.result = -nb->req.cancelled;
+		__usbf_autotune_end(ep, &nb->start, nb->length -
+			(ep->integrity ? USBF_INTEGRITY_TRAILER : 0),
+			nb->req.result);
+		if (ep->integrity && ep->desc.direction == USBF_OUT &&
+		    nb->req.result >= 0) {
+			nb->req.result = __usbf_integrity_check(nb->buf,
+				nb->req.result, trailer, nb->req.result);
+			if (nb->req.result < 0)
+				nb->req.result = -errno;
+		}
+		__usbf_capture_transfer(ep, nb->buf, nb->req.result);
+	}
+	pthread_mutex_unlock(&ep->aio_lock);
+}
+
+void __usbf_aio_close(struct usbf_endpoint *ep)
+{
+	struct __usbf_aio_req *req;
+	struct io_event events[AIO_REAP_BATCH];
+	struct timespec deadline, ts;
+	int ret;
+
+	if (ep->event_fd < 0)
+		return;
+
+	/* Let blocked transfers notice cancellation and leave */
+	usbf_endpoint_cancel(ep);
+	__usbf_ms_from_now(&deadline, AIO_CLOSE_TIMEOUT);
+	pthread_mutex_lock(&ep->aio_lock);
+	while (ep->aio_reqs && __usbf_ms_left(&deadline) > 0) {
+		__usbf_aio_drop_orphans(ep, 0);
+		/* Nobody waits for detached requests, drop completed ones */
+		for (req = ep->aio_reqs; req; req = req->next)
+			if (req->detached && req->done)
+				break;
+		if (req) {
+			__usbf_aio_unlink(ep, req);
+			continue;
+		}
+		__usbf_ms_from_now(&ts, STATE_WAIT_SLICE);
+		if (ep->aio_reaping) {
+			pthread_cond_timedwait(&ep->aio_cond, &ep->aio_lock,
+				&ts);
+			continue;
+		}
+		ep->aio_reaping = 1;
+		pthread_mutex_unlock(&ep->aio_lock);
+		ts.tv_sec = 0;
+		ts.tv_nsec = STATE_WAIT_SLICE * 1000000;
+		ret = __usbf_aio_reap(ep, events, 1, AIO_REAP_BATCH, &ts);
+		pthread_mutex_lock(&ep->aio_lock);
+		ep->aio_reaping = 0;
+		if (ret > 0)
+			__usbf_aio_complete(events, ret);
+		pthread_cond_broadcast(&ep->aio_cond);
+	}
+	pthread_mutex_unlock(&ep->aio_lock);
+
+	/* Cancels and waits for anything still in flight */
+	io_destroy(ep->aio_ctx);
+	pthread_mutex_lock(&ep->aio_lock);
+	__usbf_aio_drop_orphans(ep, 1);
+	pthread_mutex_unlock(&ep->aio_lock);
+	close(ep->event_fd);
+	ep->event_fd = -1;
+	ep->nb.state = NB_IDLE;
+}
+
+static int __usbf_nonblock_reserve(struct __usbf_nonblock *nb, size_t length)
+{
+	void *buf;
+
+	if (length <= nb->size)
+		return 0;
+
+	buf = realloc(nb->buf, length);
+	if (!buf)
+		return -ENOMEM;
+	nb->buf = buf;
+	nb->size = length;
+
+	return 0;
+}
+
+/* Completed request failed, returns error to be reported or 0 if retried */
+static int __usbf_nonblock_failed(struct usbf_endpoint *ep)
+{
+	struct __usbf_nonblock *nb = &ep->nb;
+	int error = -nb->req.result;
+
+	nb->state = NB_IDLE;
+	if (error == ECANCELED || error == ETIMEDOUT)
+		return -error;
+
+	/* Disabled under us, submit it again once we're enabled */
+	if (error == ESHUTDOWN)
+		__usbf_state_shutdown(ep->func, nb->req.seq);
+	if (error == ESHUTDOWN ||
+	    (ep->recovery && !__usbf_endpoint_recover(ep, error))) {
+		nb->state = NB_RESUBMIT;
+		return 0;
+	}
+
+	return -error;
+}
+
+int __usbf_transfer_nonblock(struct usbf_endpoint *ep,
+	void *data, size_t length)
+{
+	struct __usbf_nonblock *nb = &ep->nb;
+	size_t count, trailer;
+	int ret;
+
+	trailer = ep->integrity ? USBF_INTEGRITY_TRAILER : 0;
+
+	pthread_mutex_lock(&ep->func->state_lock);
+	if (ep->func->state != USBF_STATE_ENABLED) {
+		/* We'll be signalled on ENABLE */
+		__usbf_aio_signal(ep, 0);
+		pthread_mutex_unlock(&ep->func->state_lock);
+		return -EAGAIN;
+	}
+	nb->seq = ep->func->enable_seq;
+	pthread_mutex_unlock(&ep->func->state_lock);
+
+	/* Consume readiness before reaping, completions can't get lost */
+	__usbf_aio_signal(ep, 0);
+	__usbf_nonblock_reap(ep);
+
+	if (nb->state == NB_DONE && nb->req.result < 0) {
+		ret = __usbf_nonblock_failed(ep);
+		if (ret)
+			goto out;
+	}
+
+	switch (nb->state) {
+	case NB_INFLIGHT:
+		ret = -EAGAIN;
+		break;
+	case NB_RESUBMIT:
+		ret = __usbf_nonblock_submit(ep);
+		if (!ret)
+			ret = -EAGAIN;
+		break;
+	case NB_DONE:
+		if (ep->desc.direction == USBF_OUT) {
+			count = nb->req.result - nb->offset;
+			if (count > length)
+				count = length;
+			memcpy(data, nb->buf + nb->offset, count);
+			nb->offset += count;
+			ret = count;
+			if (nb->offset < (size_t)nb->req.result)
+				break;
+			/* Read ahead, so data is there when we're asked */
+			nb->state = NB_IDLE;
+			if (!__usbf_nonblock_reserve(nb, length + trailer)) {
+				nb->length = length + trailer;
+				__usbf_nonblock_submit(ep);
+			}
+			break;
+		}
+		nb->state = NB_IDLE;
+		/* Fall through - previous IN request is done */
+	case NB_IDLE:
+		ret = __usbf_nonblock_reserve(nb, length + trailer);
+		if (ret)
+			break;
+		nb->length = length + trailer;
+		if (ep->desc.direction == USBF_IN) {
+			memcpy(nb->buf, data, length);
+			if (trailer)
+				__usbf_integrity_seal(data, length,
+					(uint8_t *)nb->buf + length);
+		}
+		ret = __usbf_nonblock_submit(ep);
+		if (!ret)
+			ret = ep->desc.direction == USBF_IN ? (int)length : -EAGAIN;
+		break;
+	}
+
+out:
+	/* Request in flight signals event_fd on completion by itself */
+	if (nb->state != NB_INFLIGHT)
+		__usbf_aio_signal(ep, 1);
+	return ret;
+}
+
+int usbf_endpoint_set_nonblock(struct usbf_endpoint *ep, int nonblock)
+{
+	if (ep->func->state != USBF_STATE_STOPPED)
+		return -EBUSY;
+
+	ep->nonblock = !!nonblock;
+	return 0;
+}
+
+int usbf_endpoint_set_handler(struct usbf_endpoint *ep,
+	void (*handler)(struct usbf_endpoint *ep, void *arg), void *arg)
+{
+	if (ep->func->runtime_shard >= 0)
+		return -EBUSY;
+
+	ep->handler = handler;
+	ep->handler_arg = arg;
+	return 0;
+}
+
+int usbf_endpoint_get_fd(struct usbf_endpoint *ep)
+{
+	return ep->nonblock ? ep->event_fd : -EINVAL;
+}
+
+void usbf_endpoint_set_timeout(struct usbf_endpoint *ep, int timeout_ms)
+{
+	ep->timeout = timeout_ms > 0 ? timeout_ms : 0;
+}
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Throughput gain (in percent) worth moving to bigger setting */
+#define AUTOTUNE_GAIN 5
+/* Windows without gain in any direction before we consider it settled */
+#define AUTOTUNE_PATIENCE 4
+/* Windows after settling before we probe again */
+#define AUTOTUNE_REPROBE 40
+#define AUTOTUNE_MIN_TRANSFERS 4
+
+static const struct usbf_autotune_params __usbf_autotune_defaults = {
+	.min_size = 4096,
+	.max_size = 256 * 1024,
+	.min_depth = 1,
+	.max_depth = 8,
+	.window_ms = 250,
+};
+
+static uint64_t __usbf_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+void __usbf_autotune_init(struct usbf_endpoint *ep)
+{
+	memset(&ep->autotune, 0, sizeof(ep->autotune));
+	pthread_mutex_init(&ep->autotune.lock, NULL);
+}
+
+void __usbf_autotune_destroy(struct usbf_endpoint *ep)
+{
+	pthread_mutex_destroy(&ep->autotune.lock);
+}
+
+static void __usbf_autotune_reset_window(struct __usbf_autotune *at)
+{
+	clock_gettime(CLOCK_MONOTONIC, &at->window_start);
+	at->bytes = 0;
+	at->transfers = 0;
+	at->latency_ns = 0;
+}
+
+int usbf_autotune_enable(struct usbf_endpoint *ep,
+	const struct usbf_autotune_params *params)
+{
+	struct __usbf_autotune *at = &ep->autotune;
+
+	if (ep->desc.type != USBF_BULK)
+		return -EINVAL;
+	if (!params)
+		params = &__usbf_autotune_defaults;
+	if (!params->min_size || params->min_size > params->max_size ||
+	    params->min_depth < 1 || params->min_depth > params->max_depth ||
+	    params->window_ms <= 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&at->lock);
+	at->params = *params;
+	/* Start from the bottom, we are looking for the knee */
+	at->size = params->min_size;
+	at->depth = params->min_depth;
+	at->best_size = at->size;
+	at->best_depth = at->depth;
+	at->best_rate = 0;
+	at->dim = 0;
+	at->dir = 1;
+	at->failures = 0;
+	at->settled = 0;
+	at->rate = 0;
+	at->latency_us = 0;
+	__usbf_autotune_reset_window(at);
+	at->enabled = 1;
+	pthread_mutex_unlock(&at->lock);
+
+	return 0;
+}
+
+void usbf_autotune_disable(struct usbf_endpoint *ep)
+{
+	pthread_mutex_lock(&ep->autotune.lock);
+	ep->autotune.enabled = 0;
+	pthread_mutex_unlock(&ep->autotune.lock);
+}
+
+int usbf_autotune_get(struct usbf_endpoint *ep,
+	struct usbf_autotune_stats *stats)
+{
+	struct __usbf_autotune *at = &ep->autotune;
+	int ret = -ENODATA;
+
+	pthread_mutex_lock(&at->lock);
+	if (at->enabled) {
+		stats->size = at->size;
+		stats->depth = at->depth;
+		stats->bytes_per_sec = at->rate;
+		stats->latency_us = at->latency_us;
+		stats->settled = at->settled > 0;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&at->lock);
+
+	return ret;
+}
+
+/* Returns 0 if there was room to move in current direction */
+static int __usbf_autotune_step(struct __usbf_autotune *at)
+{
+	const struct usbf_autotune_params *p = &at->params;
+	size_t size = at->best_size;
+	int depth = at->best_depth;
+
+	if (at->dim == 0) {
+		size = at->dir > 0 ? size * 2 : size / 2;
+		if (size > p->max_size)
+			size = p->max_size;
+		if (size < p->min_size)
+			size = p->min_size;
+		if (size == at->best_size)
+			return -1;
+	} else {
+		depth += at->dir;
+		if (depth > p->max_depth || depth < p->min_depth)
+			return -1;
+	}
+
+	at->size = size;
+	at->depth = depth;
+	return 0;
+}
+
+/* Try next direction: size up, size down, depth up, depth down */
+static void __usbf_autotune_turn(struct __usbf_autotune *at)
+{
+	at->size = at->best_size;
+	at->depth = at->best_depth;
+
+	while (at->failures < AUTOTUNE_PATIENCE) {
+		if (at->dir > 0) {
+			at->dir = -1;
+		} else {
+			at->dir = 1;
+			at->dim = !at->dim;
+		}
+		if (!__usbf_autotune_step(at))
+			return;
+		++at->failures;
+	}
+
+	at->settled = 1;
+}
+
+static void __usbf_autotune_evaluate(struct __usbf_autotune *at,
+	uint64_t elapsed_ns)
+{
+	at->rate = at->bytes * 1000000000 / elapsed_ns;
+	at->latency_us = at->latency_ns / at->transfers / 1000;
+
+	if (at->settled) {
+		if (++at->settled < AUTOTUNE_REPROBE)
+			return;
+		/* Host side might have changed, look around again */
+		at->settled = 0;
+		at->best_rate = at->rate;
+		at->failures = 0;
+		at->dim = 0;
+		at->dir = 1;
+		if (__usbf_autotune_step(at))
+			__usbf_autotune_turn(at);
+		return;
+	}
+
+	if (at->rate * 100 > at->best_rate * (100 + AUTOTUNE_GAIN)) {
+		at->best_rate = at->rate;
+		at->best_size = at->size;
+		at->best_depth = at->depth;
+		at->failures = 0;
+		if (__usbf_autotune_step(at)) {
+			++at->failures;
+			__usbf_autotune_turn(at);
+		}
+	} else {
+		/* Not worth it, go back to the best known setting */
+		++at->failures;
+		__usbf_autotune_turn(at);
+	}
+}
+
+void __usbf_autotune_begin(struct usbf_endpoint *ep, struct timespec *start)
+{
+	if (ep->autotune.enabled)
+		clock_gettime(CLOCK_MONOTONIC, start);
+	else
+		start->tv_nsec = -1;
+}
+
+/* Length is payload size transfer was submitted with */
+void __usbf_autotune_end(struct usbf_endpoint *ep,
+	const struct timespec *start, size_t length, int ret)
+{
+	struct __usbf_autotune *at = &ep->autotune;
+	struct timespec now;
+	uint64_t elapsed;
+
+	if (!at->enabled || start->tv_nsec < 0 || ret <= 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&at->lock);
+	/* Transfers of other size don't tell how recommended one does */
+	if (length != at->size) {
+		pthread_mutex_unlock(&at->lock);
+		return;
+	}
+	at->bytes += ret;
+	at->latency_ns += __usbf_ns(&now) - __usbf_ns(start);
+	++at->transfers;
+
+	elapsed = __usbf_ns(&now) - __usbf_ns(&at->window_start);
+	if (elapsed >= (uint64_t)at->params.window_ms * 1000000 &&
+	    at->transfers >= AUTOTUNE_MIN_TRANSFERS) {
+		__usbf_autotune_evaluate(at, elapsed);
+		__usbf_autotune_reset_window(at);
+	}
+	pthread_mutex_unlock(&at->lock);
+}
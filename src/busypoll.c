@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <string.h>
+#include <errno.h>
+#include <sys/poll.h>
+
+struct __usbf_busy_poll_fds {
+	struct pollfd pfds[MAX_ENDPOINTS + 1];
+	/* IN endpoints, their readiness is consumed once reported */
+	struct usbf_endpoint *edge[MAX_ENDPOINTS + 1];
+	int count;
+};
+
+/* Counters have single writer, stats reader may run concurrently */
+static inline void __usbf_busy_poll_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t __usbf_busy_poll_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void __usbf_busy_poll_init(struct __usbf_busy_poll *bp)
+{
+	memset(bp, 0, sizeof(*bp));
+}
+
+void __usbf_busy_poll_set(struct __usbf_busy_poll *bp,
+	const struct usbf_busy_poll_params *params)
+{
+	__atomic_store_n(&bp->window_us, params ? params->window_us : 0,
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&bp->budget_us, params ? params->budget_us : 0,
+		__ATOMIC_RELAXED);
+}
+
+/* Spin time left in current second, UINT64_MAX if unlimited */
+static uint64_t __usbf_busy_poll_budget(struct __usbf_busy_poll *bp,
+	uint64_t now)
+{
+	uint64_t budget, spin;
+
+	budget = __atomic_load_n(&bp->budget_us, __ATOMIC_RELAXED) * 1000ULL;
+	if (!budget)
+		return UINT64_MAX;
+
+	spin = now - __atomic_load_n(&bp->period_start, __ATOMIC_RELAXED) >=
+		1000000000ULL ? 0 :
+		__atomic_load_n(&bp->period_spin, __ATOMIC_RELAXED);
+	return budget > spin ? budget - spin : 0;
+}
+
+/*
+ * Spins on wait(arg, 0) while there was activity within window and budget
+ * allows it, then blocks in wait(arg, timeout). Like NAPI, busy traffic
+ * is picked up without wake-up latency and idle loop costs nothing.
+ */
+int __usbf_busy_poll_wait(struct __usbf_busy_poll *bp, int timeout_ms,
+	int (*wait)(void *arg, int timeout_ms), void *arg)
+{
+	uint64_t now, start, end, window, budget;
+	long elapsed;
+	int ret;
+
+	start = now = __usbf_busy_poll_now();
+	if (now - bp->period_start >= 1000000000ULL) {
+		__atomic_store_n(&bp->period_spin, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&bp->period_start, now, __ATOMIC_RELAXED);
+	}
+	window = __atomic_load_n(&bp->window_us, __ATOMIC_RELAXED) * 1000ULL;
+	budget = __usbf_busy_poll_budget(bp, now);
+
+	if (window && budget && now - bp->last_activity < window) {
+		end = bp->last_activity + window;
+		if (end - now > budget)
+			end = now + budget;
+		if (timeout_ms >= 0 && end - now > timeout_ms * 1000000ULL)
+			end = now + timeout_ms * 1000000ULL;
+
+		do {
+			ret = wait(arg, 0);
+			now = __usbf_busy_poll_now();
+		} while (!ret && now < end);
+
+		__usbf_busy_poll_add(&bp->period_spin, now - start);
+		__usbf_busy_poll_add(&bp->stats.spin_ns, now - start);
+		if (ret) {
+			if (ret > 0) {
+				__usbf_busy_poll_add(&bp->stats.spin_hits, 1);
+				bp->last_activity = now;
+			}
+			return ret;
+		}
+
+		if (timeout_ms >= 0) {
+			elapsed = (now - start) / 1000000;
+			timeout_ms = elapsed < timeout_ms ?
+				timeout_ms - elapsed : 0;
+		}
+	}
+
+	__usbf_busy_poll_add(&bp->stats.sleeps, 1);
+	ret = wait(arg, timeout_ms);
+	if (ret > 0)
+		bp->last_activity = __usbf_busy_poll_now();
+
+	return ret;
+}
+
+static int __usbf_busy_poll_fds_wait(void *arg, int timeout_ms)
+{
+	struct __usbf_busy_poll_fds *fds = arg;
+	int i, ret;
+
+	ret = poll(fds->pfds, fds->count, timeout_ms);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	/*
+	 * Idle IN endpoint is always ready to accept data, report it only
+	 * once after completion or ENABLE, or we would never sleep.
+	 */
+	for (i = 0; ret > 0 && i < fds->count; ++i)
+		if (fds->edge[i] && (fds->pfds[i].revents & POLLIN))
+			__usbf_aio_signal(fds->edge[i], 0);
+
+	return ret > 0;
+}
+
+int usbf_wait_events(struct usbf_function *func, int timeout_ms)
+{
+	struct __usbf_busy_poll_fds fds;
+	struct usbf_endpoint *ep;
+	int i, left;
+
+	fds.count = 0;
+	/*
+	 * ep0 keeps polling readable while deferred setup is pending, leave it
+	 * out until setup expires. Completion doesn't wake us, so wait in
+	 * slices meanwhile.
+	 */
+	left = __usbf_setup_time_left(func);
+	if (left <= 0) {
+		fds.edge[fds.count] = NULL;
+		fds.pfds[fds.count].fd = func->ep0_file;
+		fds.pfds[fds.count++].events = POLLIN;
+	} else {
+		if (left > STATE_WAIT_SLICE)
+			left = STATE_WAIT_SLICE;
+		if (timeout_ms < 0 || timeout_ms > left)
+			timeout_ms = left;
+	}
+	/* Blocking endpoints are waited for by their own threads */
+	for (i = 0; i < func->ep_count; ++i) {
+		ep = func->endpoints[i];
+		if (!ep->nonblock || ep->event_fd < 0)
+			continue;
+		fds.edge[fds.count] = ep->desc.direction == USBF_IN ? ep : NULL;
+		fds.pfds[fds.count].fd = ep->event_fd;
+		fds.pfds[fds.count++].events = POLLIN;
+	}
+
+	return __usbf_busy_poll_wait(&func->busy_poll, timeout_ms,
+		__usbf_busy_poll_fds_wait, &fds);
+}
+
+void usbf_set_busy_poll(struct usbf_function *func,
+	const struct usbf_busy_poll_params *params)
+{
+	__usbf_busy_poll_set(&func->busy_poll, params);
+}
+
+void usbf_get_busy_poll_stats(struct usbf_function *func,
+	struct usbf_busy_poll_stats *stats)
+{
+	struct __usbf_busy_poll *bp = &func->busy_poll;
+	uint64_t budget;
+
+	stats->spin_ns = __atomic_load_n(&bp->stats.spin_ns, __ATOMIC_RELAXED);
+	stats->spin_hits = __atomic_load_n(&bp->stats.spin_hits,
+		__ATOMIC_RELAXED);
+	stats->sleeps = __atomic_load_n(&bp->stats.sleeps, __ATOMIC_RELAXED);
+	budget = __usbf_busy_poll_budget(bp, __usbf_busy_poll_now());
+	stats->budget_left_us = budget == UINT64_MAX ? UINT32_MAX :
+		budget / 1000;
+}
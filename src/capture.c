@@ -0,0 +1,515 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Records are written in Linux usbmon format, as libpcap does */
+#define CAPTURE_PCAP_MAGIC 0xa1b2c3d4
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+
+#define CAPTURE_DEFAULT_SNAPLEN 512
+#define CAPTURE_DEFAULT_RING (256 * 1024)
+#define CAPTURE_FLUSH_INTERVAL 100
+/* Rings of captures thread has recorded into recently */
+#define CAPTURE_TLS_SLOTS 4
+
+#define USBMON_XFER_ISO 0
+#define USBMON_XFER_INT 1
+#define USBMON_XFER_CTRL 2
+#define USBMON_XFER_BULK 3
+
+struct __usbf_pcap_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t network;
+};
+
+struct __usbf_pcap_record {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+struct __usbf_usbmon_packet {
+	uint64_t id;
+	uint8_t type;
+	uint8_t xfer_type;
+	uint8_t epnum;
+	uint8_t devnum;
+	uint16_t busnum;
+	char flag_setup;
+	char flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	uint8_t setup[8];
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;
+};
+
+/* Single producer thread, flushing thread is the consumer */
+struct __usbf_capture_ring {
+	pthread_t owner;
+	uint8_t *buf;
+	size_t mask;
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t dropped;
+	uint64_t seq;
+	unsigned int count;
+	struct __usbf_capture_ring *next;
+};
+
+struct usbf_capture {
+	struct usbf_function *func;
+	FILE *file;
+	struct usbf_capture_params params;
+	uint64_t id;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stopping;
+	pthread_t thread;
+	struct __usbf_capture_ring *rings;
+};
+
+static uint64_t __usbf_capture_ids;
+
+static __thread struct {
+	uint64_t id;
+	struct __usbf_capture_ring *ring;
+} __usbf_capture_tls[CAPTURE_TLS_SLOTS];
+
+static __thread unsigned int __usbf_capture_tls_next;
+
+static struct __usbf_capture_ring *__usbf_capture_ring_get(
+	struct usbf_capture *cap)
+{
+	struct __usbf_capture_ring *ring;
+	pthread_t self = pthread_self();
+	unsigned int i;
+
+	for (i = 0; i < CAPTURE_TLS_SLOTS; ++i)
+		if (__usbf_capture_tls[i].id == cap->id)
+			return __usbf_capture_tls[i].ring;
+
+	pthread_mutex_lock(&cap->lock);
+	for (ring = cap->rings; ring; ring = ring->next)
+		if (pthread_equal(ring->owner, self))
+			break;
+	if (!ring) {
+		ring = calloc(1, sizeof(*ring));
+		if (ring) {
+			ring->buf = malloc(cap->params.ring_size);
+			if (!ring->buf) {
+				free(ring);
+				ring = NULL;
+			}
+		}
+		if (ring) {
+			ring->owner = self;
+			ring->mask = cap->params.ring_size - 1;
+			ring->next = cap->rings;
+			__atomic_store_n(&cap->rings, ring, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&cap->lock);
+	if (!ring)
+		return NULL;
+
+	i = __usbf_capture_tls_next++ % CAPTURE_TLS_SLOTS;
+	__usbf_capture_tls[i].id = cap->id;
+	__usbf_capture_tls[i].ring = ring;
+
+	return ring;
+}
+
+static void __usbf_capture_copy_in(struct __usbf_capture_ring *ring,
+	uint64_t pos, const void *data, size_t length)
+{
+	size_t off = pos & ring->mask, first;
+
+	first = ring->mask + 1 - off;
+	if (first > length)
+		first = length;
+	memcpy(ring->buf + off, data, first);
+	memcpy(ring->buf, (const uint8_t *)data + first, length - first);
+}
+
+static void __usbf_capture_copy_out(struct __usbf_capture_ring *ring,
+	uint64_t pos, void *data, size_t length)
+{
+	size_t off = pos & ring->mask, first;
+
+	first = ring->mask + 1 - off;
+	if (first > length)
+		first = length;
+	memcpy(data, ring->buf + off, first);
+	memcpy((uint8_t *)data + first, ring->buf, length - first);
+}
+
+static inline size_t __usbf_capture_reclen(uint32_t len_cap)
+{
+	return sizeof(struct __usbf_usbmon_packet) + ((len_cap + 7) & ~7);
+}
+
+static void __usbf_capture_put(struct __usbf_capture_ring *ring,
+	struct __usbf_usbmon_packet *pkt, const void *data)
+{
+	struct timespec ts;
+	uint64_t head, tail;
+	size_t length;
+
+	length = __usbf_capture_reclen(pkt->len_cap);
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (ring->mask + 1 - (head - tail) < length) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	pkt->id = ring->seq++;
+	pkt->devnum = 1;
+	pkt->ts_sec = ts.tv_sec;
+	pkt->ts_usec = ts.tv_nsec / 1000;
+	__usbf_capture_copy_in(ring, head, pkt, sizeof(*pkt));
+	if (pkt->len_cap)
+		__usbf_capture_copy_in(ring, head + sizeof(*pkt), data,
+			pkt->len_cap);
+	__atomic_store_n(&ring->head, head + length, __ATOMIC_RELEASE);
+}
+
+/*
+ * Users count is kept per endpoint, so that threads serving different
+ * endpoints don't bounce one cache line on every transfer. Counting in and
+ * checking capture has to be ordered against usbf_capture_stop() clearing
+ * it and checking users, which only sequential consistency guarantees.
+ */
+static struct usbf_capture *__usbf_capture_enter(struct usbf_function *func,
+	int *users)
+{
+	__atomic_add_fetch(users, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&func->capture, __ATOMIC_SEQ_CST);
+}
+
+static void __usbf_capture_leave(struct usbf_function *func, int *users)
+{
+	if (__atomic_sub_fetch(users, 1, __ATOMIC_SEQ_CST) ||
+	    !__atomic_load_n(&func->capture_waiting, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&func->capture_lock);
+	pthread_cond_broadcast(&func->capture_cond);
+	pthread_mutex_unlock(&func->capture_lock);
+}
+
+static const uint8_t __usbf_capture_xfer_types[] = {
+	[USBF_ISOCHRONOUS] = USBMON_XFER_ISO,
+	[USBF_BULK] = USBMON_XFER_BULK,
+	[USBF_INTERRUPT] = USBMON_XFER_INT,
+};
+
+void __usbf_capture_record_transfer(struct usbf_endpoint *ep,
+	const void *data, long result)
+{
+	struct usbf_function *func = ep->func;
+	struct __usbf_capture_ring *ring;
+	struct __usbf_usbmon_packet pkt;
+	struct usbf_capture *cap;
+
+	/* usbf_capture_stop() waits for us before freeing capture */
+	cap = __usbf_capture_enter(func, &ep->capture_users);
+	if (!cap)
+		goto out;
+	ring = __usbf_capture_ring_get(cap);
+	if (!ring || ring->count++ % cap->params.sample)
+		goto out;
+
+	memset(&pkt, 0, sizeof(pkt));
+	/* Device only sees completed transfers */
+	pkt.type = 'C';
+	pkt.xfer_type = __usbf_capture_xfer_types[ep->desc.type];
+	pkt.epnum = __atomic_load_n(&ep->info_valid, __ATOMIC_RELAXED) ?
+		ep->info.address : ep->address;
+	pkt.flag_setup = '-';
+	if (result < 0) {
+		pkt.status = result;
+	} else {
+		pkt.length = result;
+		pkt.len_cap = result < cap->params.snaplen ? result :
+			cap->params.snaplen;
+	}
+	pkt.flag_data = pkt.len_cap ? 0 : '<';
+	pkt.interval = ep->desc.fs_interval;
+	__usbf_capture_put(ring, &pkt, data);
+
+out:
+	__usbf_capture_leave(func, &ep->capture_users);
+}
+
+void __usbf_capture_record_control(struct usbf_function *func,
+	const struct usb_ctrlrequest *setup, int event)
+{
+	struct __usbf_capture_ring *ring;
+	struct __usbf_usbmon_packet pkt;
+	struct usbf_capture *cap;
+
+	cap = __usbf_capture_enter(func, &func->capture_users);
+	if (!cap)
+		goto out;
+	ring = __usbf_capture_ring_get(cap);
+	if (!ring)
+		goto out;
+
+	/* ep0 traffic is rare and most valuable, it's never sampled */
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.xfer_type = USBMON_XFER_CTRL;
+	pkt.flag_data = '<';
+	if (setup) {
+		pkt.type = 'S';
+		pkt.epnum = setup->bRequestType & USB_DIR_IN;
+		pkt.flag_setup = 0;
+		pkt.length = le16toh(setup->wLength);
+		memcpy(pkt.setup, setup, sizeof(pkt.setup));
+	} else {
+		/* Other FunctionFS events as error records */
+		pkt.type = 'E';
+		pkt.flag_setup = '-';
+		pkt.status = event;
+	}
+	__usbf_capture_put(ring, &pkt, NULL);
+
+out:
+	__usbf_capture_leave(func, &func->capture_users);
+}
+
+static void __usbf_capture_write(struct usbf_capture *cap,
+	struct __usbf_capture_ring *ring, const struct __usbf_usbmon_packet *pkt)
+{
+	struct __usbf_pcap_record rec;
+	uint8_t data[256];
+	uint64_t pos;
+	size_t left, chunk;
+
+	rec.ts_sec = pkt->ts_sec;
+	rec.ts_usec = pkt->ts_usec;
+	rec.incl_len = sizeof(*pkt) + pkt->len_cap;
+	rec.orig_len = sizeof(*pkt) + pkt->length;
+	fwrite(&rec, sizeof(rec), 1, cap->file);
+	fwrite(pkt, sizeof(*pkt), 1, cap->file);
+
+	pos = ring->tail + sizeof(*pkt);
+	for (left = pkt->len_cap; left; left -= chunk, pos += chunk) {
+		chunk = left < sizeof(data) ? left : sizeof(data);
+		__usbf_capture_copy_out(ring, pos, data, chunk);
+		fwrite(data, chunk, 1, cap->file);
+	}
+}
+
+/* Merges records from all rings in timestamp order */
+static void __usbf_capture_flush(struct usbf_capture *cap)
+{
+	struct __usbf_capture_ring *ring, *best, *rings;
+	struct __usbf_usbmon_packet pkt, best_pkt;
+
+	rings = __atomic_load_n(&cap->rings, __ATOMIC_ACQUIRE);
+	for (;;) {
+		best = NULL;
+		for (ring = rings; ring; ring = ring->next) {
+			if (ring->tail == __atomic_load_n(&ring->head,
+					__ATOMIC_ACQUIRE))
+				continue;
+			__usbf_capture_copy_out(ring, ring->tail, &pkt,
+				sizeof(pkt));
+			if (!best || pkt.ts_sec < best_pkt.ts_sec ||
+			    (pkt.ts_sec == best_pkt.ts_sec &&
+			     pkt.ts_usec < best_pkt.ts_usec)) {
+				best = ring;
+				best_pkt = pkt;
+			}
+		}
+		if (!best)
+			break;
+		__usbf_capture_write(cap, best, &best_pkt);
+		__atomic_store_n(&best->tail, best->tail +
+			__usbf_capture_reclen(best_pkt.len_cap),
+			__ATOMIC_RELEASE);
+	}
+	fflush(cap->file);
+}
+
+static void *__usbf_capture_loop(void *arg)
+{
+	struct usbf_capture *cap = arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&cap->lock);
+	while (!cap->stopping) {
+		__usbf_ms_from_now(&ts, CAPTURE_FLUSH_INTERVAL);
+		pthread_cond_timedwait(&cap->cond, &cap->lock, &ts);
+		pthread_mutex_unlock(&cap->lock);
+		__usbf_capture_flush(cap);
+		pthread_mutex_lock(&cap->lock);
+	}
+	pthread_mutex_unlock(&cap->lock);
+
+	return NULL;
+}
+
+struct usbf_capture *usbf_capture_start(struct usbf_function *func,
+	const char *path, const struct usbf_capture_params *params)
+{
+	struct __usbf_pcap_header hdr;
+	struct usbf_capture *cap;
+	pthread_condattr_t attr;
+	size_t size;
+	int ret;
+
+	if (func->capture) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	cap = calloc(1, sizeof(*cap));
+	if (!cap)
+		return NULL;
+
+	cap->func = func;
+	cap->params.snaplen = CAPTURE_DEFAULT_SNAPLEN;
+	cap->params.sample = 1;
+	cap->params.ring_size = CAPTURE_DEFAULT_RING;
+	if (params) {
+		if (params->snaplen)
+			cap->params.snaplen = params->snaplen;
+		if (params->sample)
+			cap->params.sample = params->sample;
+		if (params->ring_size)
+			cap->params.ring_size = params->ring_size;
+	}
+	/* Power of two, large enough for biggest record */
+	size = __usbf_capture_reclen(cap->params.snaplen);
+	if (size < cap->params.ring_size)
+		size = cap->params.ring_size;
+	cap->params.ring_size = 1;
+	while (cap->params.ring_size < size)
+		cap->params.ring_size <<= 1;
+
+	cap->file = fopen(path, "w");
+	if (!cap->file) {
+		free(cap);
+		return NULL;
+	}
+
+	hdr.magic = CAPTURE_PCAP_MAGIC;
+	hdr.version_major = 2;
+	hdr.version_minor = 4;
+	hdr.thiszone = 0;
+	hdr.sigfigs = 0;
+	hdr.snaplen = sizeof(struct __usbf_usbmon_packet) +
+		cap->params.snaplen;
+	hdr.network = LINKTYPE_USB_LINUX_MMAPPED;
+	if (fwrite(&hdr, sizeof(hdr), 1, cap->file) != 1) {
+		fclose(cap->file);
+		free(cap);
+		errno = EIO;
+		return NULL;
+	}
+
+	cap->id = __atomic_add_fetch(&__usbf_capture_ids, 1, __ATOMIC_RELAXED);
+	pthread_mutex_init(&cap->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cap->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	ret = pthread_create(&cap->thread, NULL, __usbf_capture_loop, cap);
+	if (ret) {
+		pthread_cond_destroy(&cap->cond);
+		pthread_mutex_destroy(&cap->lock);
+		fclose(cap->file);
+		free(cap);
+		errno = ret;
+		return NULL;
+	}
+
+	__atomic_store_n(&func->capture, cap, __ATOMIC_SEQ_CST);
+
+	return cap;
+}
+
+uint64_t usbf_capture_dropped(struct usbf_capture *cap)
+{
+	struct __usbf_capture_ring *ring;
+	uint64_t dropped = 0;
+
+	pthread_mutex_lock(&cap->lock);
+	for (ring = cap->rings; ring; ring = ring->next)
+		dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&cap->lock);
+
+	return dropped;
+}
+
+void usbf_capture_stop(struct usbf_capture *cap)
+{
+	struct usbf_function *func = cap->func;
+	struct __usbf_capture_ring *ring, *next;
+	int i;
+
+	__atomic_store_n(&func->capture, NULL, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&func->capture_lock);
+	__atomic_store_n(&func->capture_waiting, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&func->capture_users, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&func->capture_cond, &func->capture_lock);
+	for (i = 0; i < func->ep_count; ++i)
+		while (__atomic_load_n(&func->endpoints[i]->capture_users,
+				__ATOMIC_SEQ_CST))
+			pthread_cond_wait(&func->capture_cond,
+				&func->capture_lock);
+	__atomic_store_n(&func->capture_waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&func->capture_lock);
+
+	pthread_mutex_lock(&cap->lock);
+	cap->stopping = 1;
+	pthread_cond_signal(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+	pthread_join(cap->thread, NULL);
+	__usbf_capture_flush(cap);
+
+	for (ring = cap->rings; ring; ring = next) {
+		next = ring->next;
+		free(ring->buf);
+		free(ring);
+	}
+	pthread_cond_destroy(&cap->cond);
+	pthread_mutex_destroy(&cap->lock);
+	fclose(cap->file);
+	free(cap);
+}
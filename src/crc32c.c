@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <errno.h>
+#include <string.h>
+#include <endian.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_acle.h>
+#endif
+
+/* Castagnoli polynomial, reflected */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t __usbf_crc32c_table[8][256];
+
+static uint32_t (*__usbf_crc32c_impl)(uint32_t, const uint8_t *, size_t);
+
+static pthread_once_t __usbf_crc32c_once = PTHREAD_ONCE_INIT;
+
+/* Slicing-by-8, processes 8 bytes per iteration */
+static uint32_t __usbf_crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint32_t (*t)[256] = __usbf_crc32c_table;
+	uint64_t word;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		--len;
+	}
+
+	while (len >= 8) {
+		memcpy(&word, p, sizeof(word));
+		word = htole64(word) ^ crc;
+		crc = t[7][word & 0xff] ^
+			t[6][(word >> 8) & 0xff] ^
+			t[5][(word >> 16) & 0xff] ^
+			t[4][(word >> 24) & 0xff] ^
+			t[3][(word >> 32) & 0xff] ^
+			t[2][(word >> 40) & 0xff] ^
+			t[1][(word >> 48) & 0xff] ^
+			t[0][word >> 56];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static uint32_t __usbf_crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len && ((uintptr_t)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		--len;
+	}
+#ifdef __x86_64__
+	uint64_t word, crc64 = crc;
+
+	while (len >= 8) {
+		memcpy(&word, p, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+		p += 8;
+		len -= 8;
+	}
+	crc = crc64;
+#endif
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+static int __usbf_crc32c_hw_supported(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t __usbf_crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t word;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc = __crc32cb(crc, *p++);
+		--len;
+	}
+	while (len >= 8) {
+		memcpy(&word, p, sizeof(word));
+		crc = __crc32cd(crc, word);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+
+static int __usbf_crc32c_hw_supported(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#else
+#define __usbf_crc32c_hw NULL
+
+static int __usbf_crc32c_hw_supported(void)
+{
+	return 0;
+}
+#endif
+
+static void __usbf_crc32c_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; ++i) {
+		crc = i;
+		for (j = 0; j < 8; ++j)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		__usbf_crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; ++i)
+		for (j = 1; j < 8; ++j)
+			__usbf_crc32c_table[j][i] =
+				(__usbf_crc32c_table[j - 1][i] >> 8) ^
+				__usbf_crc32c_table[0][__usbf_crc32c_table[j - 1][i] & 0xff];
+
+	__usbf_crc32c_impl = __usbf_crc32c_hw_supported() ?
+		__usbf_crc32c_hw : __usbf_crc32c_sw;
+}
+
+uint32_t usbf_crc32c(uint32_t crc, const void *data, size_t length)
+{
+	pthread_once(&__usbf_crc32c_once, __usbf_crc32c_init);
+
+	return ~__usbf_crc32c_impl(~crc, data, length);
+}
+
+int usbf_endpoint_set_integrity(struct usbf_endpoint *ep,
+	enum usbf_integrity mode)
+{
+	switch (mode) {
+	case USBF_INTEGRITY_NONE:
+	case USBF_INTEGRITY_CRC32C:
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (ep->desc.type == USBF_ISOCHRONOUS && mode)
+		return -EINVAL;
+
+	ep->integrity = mode;
+	return 0;
+}
+
+void __usbf_integrity_seal(const void *data, size_t length, uint8_t *trailer)
+{
+	uint32_t crc;
+
+	crc = htole32(usbf_crc32c(0, data, length));
+	memcpy(trailer, &crc, USBF_INTEGRITY_TRAILER);
+}
+
+/*
+ * Received data is spread over payload buffer and trailer buffer, returns
+ * payload length or -1 with errno set if trailer doesn't match.
+ */
+int __usbf_integrity_check(void *data, size_t length, uint8_t *trailer,
+	size_t received)
+{
+	uint8_t expected[USBF_INTEGRITY_TRAILER], *pos = data;
+	size_t payload, in_data;
+
+	if (received < USBF_INTEGRITY_TRAILER) {
+		errno = EBADMSG;
+		return -1;
+	}
+	payload = received - USBF_INTEGRITY_TRAILER;
+
+	/* Trailer might have landed (partially) in payload buffer */
+	in_data = length > payload ? length - payload : 0;
+	if (in_data > USBF_INTEGRITY_TRAILER)
+		in_data = USBF_INTEGRITY_TRAILER;
+	memmove(trailer + in_data, trailer, USBF_INTEGRITY_TRAILER - in_data);
+	memcpy(trailer, pos + payload, in_data);
+
+	__usbf_integrity_seal(data, payload, expected);
+	if (memcmp(expected, trailer, USBF_INTEGRITY_TRAILER)) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	return payload;
+}
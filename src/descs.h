@@ -26,8 +26,13 @@
 struct __usbf_descs {
 	int speeds;
 	int endpoints;
+	/* Interface and endpoint descriptors of one speed */
+	size_t speed_length;
+	/* SuperSpeed is the last one, with companion after each endpoint */
+	int ss_idx;
 	size_t length;
 	void *data;
+	struct usbf_function *func;
 };
 
 struct __usbf_strings {
@@ -36,13 +41,34 @@ struct __usbf_strings {
 	void *data;
 };
 
-inline int __usbf_descs_alloc(struct __usbf_descs *descs)
+/* Audio class endpoints carry bRefresh and bSynchAddress */
+inline size_t __usbf_descs_endpoint_size(struct usbf_endpoint *ep)
 {
+	return ep->desc.audio ? USB_DT_ENDPOINT_AUDIO_SIZE :
+		USB_DT_ENDPOINT_SIZE;
+}
+
+inline size_t __usbf_descs_comp_size(struct __usbf_descs *descs, int spd_idx)
+{
+	return spd_idx == descs->ss_idx ? USB_DT_SS_EP_COMP_SIZE : 0;
+}
+
+inline int __usbf_descs_alloc(struct __usbf_descs *descs,
+	struct usbf_function *func)
+{
+	int i;
+
+	descs->func = func;
+	descs->speed_length = sizeof(struct usb_interface_descriptor);
+	for (i = 0; i < descs->endpoints; ++i)
+		descs->speed_length +=
+			__usbf_descs_endpoint_size(func->endpoints[i]);
+	descs->ss_idx = func->flags & USBF_SPEED_SS ? descs->speeds - 1 : -1;
 	descs->length =
 		sizeof(struct usb_functionfs_descs_head_v2) + descs->speeds *
-		(sizeof(struct usb_interface_descriptor) + descs->endpoints *
-		 sizeof(struct usb_endpoint_descriptor_no_audio) +
-		 sizeof(__le32));
+		(descs->speed_length + sizeof(__le32));
+	if (descs->ss_idx >= 0)
+		descs->length += descs->endpoints * USB_DT_SS_EP_COMP_SIZE;
 	descs->data = malloc(descs->length);
 	return descs->data ? 0 : -ENOMEM;
 }
@@ -68,20 +94,29 @@ inline struct usb_interface_descriptor *__usbf_descs_access_interface(
 	struct __usbf_descs *descs, int spd_idx)
 {
 	return descs->data + sizeof(struct usb_functionfs_descs_head_v2) +
-		descs->speeds * sizeof(__le32) + spd_idx *
-		(sizeof(struct usb_interface_descriptor) + descs->endpoints *
-		 sizeof(struct usb_endpoint_descriptor_no_audio));
+		descs->speeds * sizeof(__le32) + spd_idx * descs->speed_length;
 }
 
-inline struct usb_endpoint_descriptor_no_audio *__usbf_descs_access_endpoint(
+/* Only first __usbf_descs_endpoint_size() bytes belong to endpoint */
+inline struct usb_endpoint_descriptor *__usbf_descs_access_endpoint(
 	struct __usbf_descs *descs, int spd_idx, int ep_idx)
 {
-	return descs->data + sizeof(struct usb_functionfs_descs_head_v2) +
-		descs->speeds * sizeof(__le32) + spd_idx *
-		(sizeof(struct usb_interface_descriptor) + descs->endpoints *
-		 sizeof(struct usb_endpoint_descriptor_no_audio)) +
-		sizeof(struct usb_interface_descriptor) +
-		sizeof(struct usb_endpoint_descriptor_no_audio) * ep_idx;
+	void *ptr = __usbf_descs_access_interface(descs, spd_idx);
+	int i;
+
+	ptr += sizeof(struct usb_interface_descriptor);
+	for (i = 0; i < ep_idx; ++i)
+		ptr += __usbf_descs_endpoint_size(descs->func->endpoints[i]) +
+			__usbf_descs_comp_size(descs, spd_idx);
+
+	return ptr;
+}
+
+inline struct usb_ss_ep_comp_descriptor *__usbf_descs_access_comp(
+	struct __usbf_descs *descs, int spd_idx, int ep_idx)
+{
+	return (void *)__usbf_descs_access_endpoint(descs, spd_idx, ep_idx) +
+		__usbf_descs_endpoint_size(descs->func->endpoints[ep_idx]);
 }
 
 inline int __usbf_strings_alloc(struct __usbf_strings *strings)
@@ -0,0 +1,566 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/ioctl.h>
+
+/* Per speed bus limits, raw bytes without bit stuffing (USB 2.0 5.6 - 5.8) */
+static const struct __usbf_bus_limits {
+	uint32_t frame_us;
+	uint32_t frame_bytes;
+	uint16_t bulk_maxpacket;
+	uint16_t bulk_overhead;
+	/* Largest payload and longest service interval, in frames */
+	uint32_t int_bytes;
+	uint32_t iso_bytes;
+	uint32_t int_frames;
+	uint32_t iso_frames;
+} __usbf_bus_limits[] = {
+	{ 1000, 1500, 64, 13, 64, 1023, 255, 1 << 15 },
+	{ 125, 7500, 512, 55, 3 * 1024, 3 * 1024, 1 << 15, 1 << 15 },
+	{ 125, 62500, 1024, 32, 3 * 1024, 48 * 1024, 1 << 15, 1 << 15 },
+};
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+static const struct __usbf_bus_limits *__usbf_bus_limits_get(uint32_t speed)
+{
+	return &__usbf_bus_limits[speed == USBF_SPEED_FS ? 0 :
+		speed == USBF_SPEED_HS ? 1 : 2];
+}
+
+static uint16_t __usbf_desc_maxpacket(
+	const struct usbf_endpoint_descriptor *desc, uint32_t speed)
+{
+	switch (speed) {
+	case USBF_SPEED_FS:
+		return desc->fs_maxpacketsize;
+	case USBF_SPEED_HS:
+		return desc->hs_maxpacketsize;
+	case USBF_SPEED_SS:
+		return desc->ss_maxpacketsize;
+	default:
+		return 0;
+	}
+}
+
+/* Exponent encoded interval, the longest one not exceeding period_us */
+static uint8_t __usbf_interval_exponent(uint32_t period_us, uint32_t frame_us)
+{
+	uint8_t interval = 1;
+
+	while (interval < 16 && ((uint64_t)frame_us << interval) <= period_us)
+		++interval;
+
+	return interval;
+}
+
+static uint8_t __usbf_desc_interval(
+	const struct usbf_endpoint_descriptor *desc, uint32_t speed)
+{
+	uint32_t period;
+
+	switch (speed) {
+	case USBF_SPEED_FS:
+		return desc->fs_interval;
+	case USBF_SPEED_HS:
+		if (desc->hs_interval)
+			return desc->hs_interval;
+		break;
+	case USBF_SPEED_SS:
+		if (desc->ss_interval)
+			return desc->ss_interval;
+		break;
+	default:
+		return 0;
+	}
+
+	/* Keep service period of full speed, bInterval units differ */
+	if (desc->type == USBF_BULK || !desc->fs_interval)
+		return 0;
+	if (desc->type == USBF_INTERRUPT)
+		period = desc->fs_interval * 1000;
+	else
+		period = 1000U << (desc->fs_interval > 16 ? 15 :
+			desc->fs_interval - 1);
+
+	return __usbf_interval_exponent(period, 125);
+}
+
+uint16_t __usbf_endpoint_maxpacket(struct usbf_endpoint *ep, uint32_t speed)
+{
+	return __usbf_desc_maxpacket(&ep->desc, speed);
+}
+
+uint8_t __usbf_endpoint_interval(struct usbf_endpoint *ep, uint32_t speed)
+{
+	return __usbf_desc_interval(&ep->desc, speed);
+}
+
+/* Payload of one service interval, high bandwidth and bursts included */
+uint32_t __usbf_endpoint_bytes(struct usbf_endpoint *ep, uint32_t speed)
+{
+	uint16_t mps = __usbf_endpoint_maxpacket(ep, speed);
+
+	if (speed != USBF_SPEED_SS)
+		return (mps & 0x7ff) * (((mps >> 11) & 0x03) + 1);
+
+	return (mps & 0x7ff) * (ep->desc.ss_maxburst + 1) *
+		(ep->desc.type == USBF_ISOCHRONOUS ? ep->desc.ss_mult + 1 : 1);
+}
+
+/* Limits of USB 2.0 9.6.6 and USB 3.x 9.6.7 */
+static int __usbf_endpoint_check_speed(
+	const struct usbf_endpoint_descriptor *desc, uint32_t speed)
+{
+	uint16_t mps = __usbf_desc_maxpacket(desc, speed);
+	uint8_t interval = __usbf_desc_interval(desc, speed);
+	int mult = (mps >> 11) & 0x03;
+	uint32_t burst;
+
+	mps &= 0x7ff;
+	if (!mps || (mult && speed != USBF_SPEED_HS))
+		return -EINVAL;
+
+	if (desc->type == USBF_BULK) {
+		switch (speed) {
+		case USBF_SPEED_FS:
+			return mps < 8 || mps > 64 || (mps & (mps - 1)) ?
+				-EINVAL : 0;
+		case USBF_SPEED_HS:
+			return mps == 512 ? 0 : -EINVAL;
+		default:
+			return mps == 1024 && desc->ss_maxburst <= 15 ?
+				0 : -EINVAL;
+		}
+	}
+
+	/* Full speed interrupt interval counts frames, others are exponent */
+	if (speed == USBF_SPEED_FS && desc->type == USBF_INTERRUPT)
+		return interval && mps <= 64 ? 0 : -EINVAL;
+	if (interval < 1 || interval > 16)
+		return -EINVAL;
+
+	switch (speed) {
+	case USBF_SPEED_FS:
+		return mps <= 1023 ? 0 : -EINVAL;
+	case USBF_SPEED_HS:
+		return mps <= 1024 && mult < 3 ? 0 : -EINVAL;
+	}
+
+	if (mps > 1024 || (desc->ss_maxburst && mps != 1024))
+		return -EINVAL;
+	if (desc->type == USBF_INTERRUPT &&
+	    (desc->ss_maxburst > 2 || desc->ss_mult))
+		return -EINVAL;
+	if (desc->ss_maxburst > 15 || desc->ss_mult > 2)
+		return -EINVAL;
+
+	burst = mps * (desc->ss_maxburst + 1) * (desc->ss_mult + 1);
+	return desc->ss_bytes_per_interval > burst ? -EINVAL : 0;
+}
+
+int __usbf_endpoint_check(uint32_t speeds,
+	const struct usbf_endpoint_descriptor *desc)
+{
+	uint32_t speed;
+	int ret;
+
+	for (speed = USBF_SPEED_FS; speed <= USBF_SPEED_SS; speed <<= 1) {
+		if (!(speeds & speed))
+			continue;
+		ret = __usbf_endpoint_check_speed(desc, speed);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Bulk has bus time periodic transfers leave, best case is whole bus */
+static int __usbf_derive_bulk(const struct usbf_endpoint_intent *intent,
+	uint32_t speed, struct usbf_endpoint_descriptor *desc)
+{
+	const struct __usbf_bus_limits *lim = __usbf_bus_limits_get(speed);
+	uint64_t rate, packets;
+
+	rate = (uint64_t)(lim->frame_bytes /
+		(lim->bulk_maxpacket + lim->bulk_overhead)) *
+		lim->bulk_maxpacket * 1000000 / lim->frame_us;
+	if (intent->bytes_per_second > rate)
+		return -ERANGE;
+
+	switch (speed) {
+	case USBF_SPEED_FS:
+		desc->fs_maxpacketsize = lim->bulk_maxpacket;
+		break;
+	case USBF_SPEED_HS:
+		desc->hs_maxpacketsize = lim->bulk_maxpacket;
+		break;
+	case USBF_SPEED_SS:
+		desc->ss_maxpacketsize = lim->bulk_maxpacket;
+		/* Burst long enough to move one bus interval worth of data */
+		packets = DIV_ROUND_UP((uint64_t)intent->bytes_per_second *
+			lim->frame_us, 1000000ULL * lim->bulk_maxpacket);
+		desc->ss_maxburst = packets > 16 ? 15 :
+			packets ? packets - 1 : 0;
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Longest service interval moving at most one packet (or transfer_size)
+ * keeps packets well filled and (micro)frame reservations small, more
+ * packets per interval only when even the shortest one needs them.
+ */
+static int __usbf_derive_periodic(const struct usbf_endpoint_intent *intent,
+	uint32_t speed, struct usbf_endpoint_descriptor *desc)
+{
+	const struct __usbf_bus_limits *lim = __usbf_bus_limits_get(speed);
+	uint32_t cap, unit, bytes, packets, mps, burst = 0, mult = 0;
+	uint64_t frames, limit;
+	uint8_t interval;
+
+	if (intent->type == USBF_INTERRUPT) {
+		cap = lim->int_bytes;
+		frames = lim->int_frames;
+	} else {
+		cap = lim->iso_bytes;
+		frames = lim->iso_frames;
+	}
+	if (intent->transfer_size > cap)
+		return -ERANGE;
+
+	if (intent->max_latency_us) {
+		frames = intent->max_latency_us / lim->frame_us < frames ?
+			intent->max_latency_us / lim->frame_us : frames;
+		if (!frames)
+			return -ERANGE;
+	}
+	if (intent->bytes_per_second) {
+		unit = intent->transfer_size;
+		if (!unit)
+			unit = cap < 1024 ? cap : 1024;
+		limit = (uint64_t)unit * 1000000 /
+			((uint64_t)intent->bytes_per_second * lim->frame_us);
+		if (limit < frames)
+			frames = limit ? limit : 1;
+	}
+
+	if (speed == USBF_SPEED_FS && intent->type == USBF_INTERRUPT) {
+		interval = frames;
+	} else {
+		interval = __usbf_interval_exponent(frames * lim->frame_us,
+			lim->frame_us);
+		frames = 1 << (interval - 1);
+	}
+
+	bytes = DIV_ROUND_UP((uint64_t)intent->bytes_per_second * frames *
+		lim->frame_us, 1000000);
+	if (bytes < intent->transfer_size)
+		bytes = intent->transfer_size;
+	if (bytes > cap)
+		return -ERANGE;
+
+	packets = DIV_ROUND_UP(bytes, 1024);
+	switch (speed) {
+	case USBF_SPEED_FS:
+		desc->fs_maxpacketsize = bytes;
+		desc->fs_interval = interval;
+		break;
+	case USBF_SPEED_HS:
+		/* Additional transactions with evenly sized packets */
+		mps = DIV_ROUND_UP(bytes, packets);
+		desc->hs_maxpacketsize = mps | (packets - 1) << 11;
+		desc->hs_interval = interval;
+		break;
+	case USBF_SPEED_SS:
+		mps = packets > 1 ? 1024 : bytes;
+		if (packets > 1) {
+			mult = DIV_ROUND_UP(packets, 16) - 1;
+			burst = DIV_ROUND_UP(packets, mult + 1) - 1;
+		}
+		desc->ss_maxpacketsize = mps;
+		desc->ss_interval = interval;
+		desc->ss_maxburst = burst;
+		desc->ss_mult = mult;
+		desc->ss_bytes_per_interval = bytes;
+		break;
+	}
+
+	return 0;
+}
+
+int usbf_endpoint_derive(uint32_t speeds,
+	const struct usbf_endpoint_intent *intent,
+	struct usbf_endpoint_descriptor *desc)
+{
+	uint32_t speed;
+	int ret;
+
+	switch (intent->type) {
+	case USBF_BULK:
+		if (intent->max_latency_us)
+			return -EINVAL;
+		break;
+	case USBF_INTERRUPT:
+	case USBF_ISOCHRONOUS:
+		if (!intent->bytes_per_second && !intent->transfer_size)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (!(speeds & (USBF_SPEED_FS | USBF_SPEED_HS | USBF_SPEED_SS)))
+		return -EINVAL;
+
+	memset(desc, 0, sizeof(*desc));
+	desc->type = intent->type;
+	desc->direction = intent->direction;
+
+	for (speed = USBF_SPEED_FS; speed <= USBF_SPEED_SS; speed <<= 1) {
+		if (!(speeds & speed))
+			continue;
+		if (intent->type == USBF_BULK)
+			ret = __usbf_derive_bulk(intent, speed, desc);
+		else
+			ret = __usbf_derive_periodic(intent, speed, desc);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Service interval of periodic endpoint with given bInterval, in us */
+uint32_t __usbf_endpoint_period(struct usbf_endpoint *ep, uint32_t speed,
+	uint8_t interval)
+{
+	if (!interval)
+		interval = 1;
+	/* Full speed interrupt endpoints count frames, others use exponent */
+	if (speed == USBF_SPEED_FS && ep->desc.type == USBF_INTERRUPT)
+		return interval * 1000;
+	if (interval > 16)
+		interval = 16;
+
+	return (1U << (interval - 1)) * (speed == USBF_SPEED_FS ? 1000 : 125);
+}
+
+static int __usbf_endpoint_query(struct usbf_endpoint *ep)
+{
+	struct usb_endpoint_descriptor desc;
+	uint32_t speed;
+	uint16_t mps;
+	int ret;
+
+	/* Replay host enumerates function at its fastest speed */
+	if (ep->func->replay) {
+		for (speed = USBF_SPEED_SS; !(ep->func->flags & speed);
+				speed >>= 1)
+			;
+		mps = __usbf_endpoint_maxpacket(ep, speed);
+		ep->info.address = ep->address;
+		ep->info.maxpacketsize = mps & 0x7ff;
+		ep->info.mult = (mps >> 11) & 0x03;
+		ep->info.interval = __usbf_endpoint_interval(ep, speed);
+		ep->info_valid = 1;
+		return 0;
+	}
+
+	ret = ioctl(ep->epfile, FUNCTIONFS_ENDPOINT_DESC, &desc);
+	if (ret < 0)
+		return -errno;
+
+	ret = ioctl(ep->epfile, FUNCTIONFS_ENDPOINT_REVMAP);
+	ep->info.address = ret < 0 ? desc.bEndpointAddress : ret;
+
+	mps = le16toh(desc.wMaxPacketSize);
+	ep->info.maxpacketsize = mps & 0x7ff;
+	ep->info.mult = (mps >> 11) & 0x03;
+	ep->info.interval = desc.bInterval;
+	ep->info_valid = 1;
+
+	return 0;
+}
+
+/*
+ * FunctionFS doesn't tell us the speed, but it hands us descriptors
+ * for it, so we look for the speed we wrote such descriptors for.
+ */
+static uint32_t __usbf_guess_speed(struct usbf_function *func)
+{
+	struct usbf_endpoint *ep;
+	uint32_t speed;
+	int i;
+
+	for (speed = USBF_SPEED_SS; speed; speed >>= 1) {
+		if (!(func->flags & speed))
+			continue;
+		for (i = 0; i < func->ep_count; ++i) {
+			ep = func->endpoints[i];
+			if (!ep->info_valid || ep->info.maxpacketsize !=
+			    (__usbf_endpoint_maxpacket(ep, speed) & 0x7ff))
+				break;
+		}
+		if (i == func->ep_count)
+			return speed;
+	}
+
+	return 0;
+}
+
+void __usbf_endpoints_enable(struct usbf_function *func)
+{
+	int i;
+
+	for (i = 0; i < func->ep_count; ++i) {
+		__usbf_endpoint_query(func->endpoints[i]);
+		/* Non-blocking users wait for us on endpoint fd */
+		if (func->endpoints[i]->event_fd >= 0)
+			__usbf_aio_signal(func->endpoints[i], 1);
+	}
+
+	func->speed = func->ep_count ? __usbf_guess_speed(func) : 0;
+}
+
+void __usbf_endpoints_disable(struct usbf_function *func)
+{
+	int i;
+
+	for (i = 0; i < func->ep_count; ++i)
+		func->endpoints[i]->info_valid = 0;
+	func->speed = 0;
+}
+
+int usbf_endpoint_get_info(struct usbf_endpoint *ep,
+	struct usbf_endpoint_info *info)
+{
+	int ret = -ENOTCONN;
+
+	pthread_mutex_lock(&ep->func->state_lock);
+	if (ep->info_valid) {
+		*info = ep->info;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&ep->func->state_lock);
+
+	return ret;
+}
+
+uint32_t usbf_get_speed(struct usbf_function *func)
+{
+	uint32_t speed;
+
+	pthread_mutex_lock(&func->state_lock);
+	speed = func->speed;
+	pthread_mutex_unlock(&func->state_lock);
+
+	return speed;
+}
+
+int usbf_endpoint_fifo_status(struct usbf_endpoint *ep)
+{
+	int ret;
+
+	ret = ioctl(ep->epfile, FUNCTIONFS_FIFO_STATUS);
+	return ret < 0 ? -errno : ret;
+}
+
+int usbf_endpoint_fifo_flush(struct usbf_endpoint *ep)
+{
+	return ioctl(ep->epfile, FUNCTIONFS_FIFO_FLUSH) < 0 ? -errno : 0;
+}
+
+int usbf_endpoint_halt(struct usbf_endpoint *ep)
+{
+	int ret;
+
+	/* FunctionFS halts endpoint on I/O in wrong direction */
+	ret = ep->desc.direction == USBF_IN ?
+		read(ep->epfile, NULL, 0) :
+		write(ep->epfile, NULL, 0);
+	if (ret < 0 && errno != EBADMSG)
+		return -errno;
+
+	return 0;
+}
+
+int usbf_endpoint_clear_halt(struct usbf_endpoint *ep)
+{
+	return ioctl(ep->epfile, FUNCTIONFS_CLEAR_HALT) < 0 ? -errno : 0;
+}
+
+int usbf_endpoint_set_sync(struct usbf_endpoint *ep,
+	struct usbf_endpoint *sync_ep)
+{
+	if (sync_ep && (sync_ep->func != ep->func || sync_ep == ep))
+		return -EINVAL;
+	if (ep->func->ep0_file >= 0)
+		return -EBUSY;
+
+	ep->sync_ep = sync_ep;
+
+	return 0;
+}
+
+int usbf_endpoint_set_recovery(struct usbf_endpoint *ep,
+	unsigned int policy, int retries)
+{
+	if (policy & ~(USBF_RECOVERY_FLUSH | USBF_RECOVERY_CLEAR_HALT))
+		return -EINVAL;
+	if (retries < 0)
+		return -EINVAL;
+
+	ep->recovery = policy;
+	ep->recovery_retries = retries;
+
+	return 0;
+}
+
+int __usbf_endpoint_recover(struct usbf_endpoint *ep, int error)
+{
+	int ret = 0;
+
+	switch (error) {
+	case EPIPE:	/* stalled */
+	case EPROTO:
+	case EILSEQ:
+	case EOVERFLOW:	/* babble */
+	case ETIME:
+	case ECONNRESET:	/* request dequeued */
+		break;
+	default:
+		return -1;
+	}
+
+	if (!ep->recovery)
+		return -1;
+
+	if (ep->recovery & USBF_RECOVERY_FLUSH)
+		ret |= usbf_endpoint_fifo_flush(ep);
+	if (ep->recovery & USBF_RECOVERY_CLEAR_HALT)
+		ret |= usbf_endpoint_clear_halt(ep);
+
+	return ret ? -1 : 0;
+}
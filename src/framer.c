@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <endian.h>
+
+/*
+ * Every message is preceded by its length as 32-bit little endian. Many
+ * messages are packed into one transfer, message never spans transfers
+ * on the way out. FRAMER_PAD header means "rest of transfer is padding",
+ * we use it to avoid transfers which are multiple of wMaxPacketSize, as
+ * these would need zero length packet to be terminated. Room for it is
+ * kept within batch, so transfer never exceeds batch_size.
+ */
+#define FRAMER_HDR_SIZE 4
+#define FRAMER_PAD 0xffffffff
+
+struct usbf_framer {
+	struct usbf_endpoint *in;
+	struct usbf_endpoint *out;
+	size_t batch_size;
+
+	uint8_t *tx_buf;
+	size_t tx_len;
+
+	uint8_t *rx_buf;
+	size_t rx_len;
+	size_t rx_pos;
+};
+
+struct usbf_framer *usbf_framer_create(struct usbf_endpoint *in,
+	struct usbf_endpoint *out, size_t batch_size)
+{
+	struct usbf_framer *fr;
+
+	if (!in && !out)
+		return NULL;
+	if ((in && in->desc.direction != USBF_IN) ||
+	    (out && out->desc.direction != USBF_OUT))
+		return NULL;
+	if (batch_size <= 2 * FRAMER_HDR_SIZE)
+		return NULL;
+
+	fr = calloc(1, sizeof(*fr));
+	if (!fr)
+		return NULL;
+
+	fr->in = in;
+	fr->out = out;
+	fr->batch_size = batch_size;
+
+	if (in && !(fr->tx_buf = malloc(batch_size)))
+		goto err;
+	if (out && !(fr->rx_buf = malloc(batch_size)))
+		goto err;
+
+	return fr;
+
+err:
+	usbf_framer_delete(fr);
+	return NULL;
+}
+
+void usbf_framer_delete(struct usbf_framer *fr)
+{
+	free(fr->tx_buf);
+	free(fr->rx_buf);
+	free(fr);
+}
+
+static inline void __usbf_framer_put_hdr(uint8_t *pos, uint32_t value)
+{
+	value = htole32(value);
+	memcpy(pos, &value, sizeof(value));
+}
+
+static inline uint32_t __usbf_framer_get_hdr(const uint8_t *pos)
+{
+	uint32_t value;
+
+	memcpy(&value, pos, sizeof(value));
+	return le32toh(value);
+}
+
+int usbf_framer_flush(struct usbf_framer *fr)
+{
+	struct usbf_endpoint_info info;
+	size_t length = fr->tx_len;
+	int ret;
+
+	if (!fr->in)
+		return -EINVAL;
+	if (!length)
+		return 0;
+
+	if (!usbf_endpoint_get_info(fr->in, &info) && info.maxpacketsize &&
+	    !(length % info.maxpacketsize)) {
+		__usbf_framer_put_hdr(fr->tx_buf + length, FRAMER_PAD);
+		length += FRAMER_HDR_SIZE;
+	}
+
+	ret = usbf_transfer(fr->in, fr->tx_buf, length);
+	if (ret < 0)
+		return ret;
+
+	fr->tx_len = 0;
+	return 0;
+}
+
+int usbf_framer_send(struct usbf_framer *fr, const void *msg, size_t length)
+{
+	int ret;
+
+	if (!fr->in)
+		return -EINVAL;
+	/* Last header of batch is reserved for padding marker */
+	if (length > fr->batch_size - 2 * FRAMER_HDR_SIZE)
+		return -EMSGSIZE;
+
+	if (fr->tx_len + 2 * FRAMER_HDR_SIZE + length > fr->batch_size) {
+		ret = usbf_framer_flush(fr);
+		if (ret < 0)
+			return ret;
+	}
+
+	__usbf_framer_put_hdr(fr->tx_buf + fr->tx_len, length);
+	memcpy(fr->tx_buf + fr->tx_len + FRAMER_HDR_SIZE, msg, length);
+	fr->tx_len += FRAMER_HDR_SIZE + length;
+
+	return 0;
+}
+
+int usbf_framer_recv(struct usbf_framer *fr, const void **msg, size_t *length)
+{
+	size_t avail;
+	uint32_t len;
+	int ret;
+
+	if (!fr->out)
+		return -EINVAL;
+
+	for (;;) {
+		avail = fr->rx_len - fr->rx_pos;
+		if (avail >= FRAMER_HDR_SIZE) {
+			len = __usbf_framer_get_hdr(fr->rx_buf + fr->rx_pos);
+			if (len == FRAMER_PAD) {
+				fr->rx_pos = fr->rx_len;
+				continue;
+			}
+			if (len > fr->batch_size - FRAMER_HDR_SIZE)
+				return -EPROTO;
+			if (avail - FRAMER_HDR_SIZE >= len) {
+				*msg = fr->rx_buf + fr->rx_pos + FRAMER_HDR_SIZE;
+				*length = len;
+				fr->rx_pos += FRAMER_HDR_SIZE + len;
+				return 0;
+			}
+		}
+
+		/* Message split between transfers by host, keep the head */
+		if (avail && fr->rx_pos)
+			memmove(fr->rx_buf, fr->rx_buf + fr->rx_pos, avail);
+		fr->rx_len = avail;
+		fr->rx_pos = 0;
+
+		ret = usbf_transfer(fr->out, fr->rx_buf + fr->rx_len,
+			fr->batch_size - fr->rx_len);
+		if (ret < 0)
+			return ret;
+		fr->rx_len += ret;
+	}
+}
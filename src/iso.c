@@ -0,0 +1,623 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ISO_DEFAULT_DEPTH 8
+/* FIFO between application and USB, kept half full */
+#define ISO_DEFAULT_FIFO_MS 20
+/* FIFO level is averaged over that many packets */
+#define ISO_LEVEL_SHIFT 6
+/* Level error is corrected over that many packets */
+#define ISO_CORRECTION_PACKETS 256
+/* Drift reported is averaged over that many packets */
+#define ISO_DRIFT_SHIFT 10
+
+struct __usbf_iso_slot {
+	struct __usbf_aio_req req;
+	int inflight;
+	void *buf;
+};
+
+struct usbf_iso {
+	struct usbf_endpoint *ep;
+	struct usbf_iso_params params;
+	int in;
+	pthread_t thread;
+	int stopping;
+	struct __usbf_iso_slot *slots;
+	size_t buf_size;
+	/* Oldest slot in flight, transfers complete in order */
+	int head;
+	int running;
+	/* Frame FIFO, counters only grow, producer owns tail */
+	uint8_t *fifo;
+	uint64_t fifo_head;
+	uint64_t fifo_tail;
+	uint32_t target;
+	/* Consumer side of FIFO waits for target level after underrun */
+	int primed;
+	/* Rate control, 16.16 frames per service interval of period us */
+	uint32_t period;
+	uint32_t max_frames;
+	uint64_t nominal;
+	int64_t level;
+	int64_t drift;
+	uint64_t rate;
+	uint32_t accum;
+	struct usbf_iso_stats stats;
+};
+
+static inline uint32_t __usbf_iso_level(struct usbf_iso *iso)
+{
+	return __atomic_load_n(&iso->fifo_tail, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&iso->fifo_head, __ATOMIC_ACQUIRE);
+}
+
+static inline void __usbf_iso_inc(uint32_t *counter)
+{
+	__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+/* Copies frames from/to FIFO at position pos, wrapping around its end */
+static void __usbf_iso_copy(struct usbf_iso *iso, uint64_t pos,
+	void *data, uint32_t frames, int to_fifo)
+{
+	uint32_t cap = iso->params.fifo_frames;
+	uint32_t fs = iso->params.frame_size;
+	uint32_t first, index = pos % cap;
+	uint8_t *fifo = iso->fifo + (size_t)index * fs;
+
+	first = cap - index < frames ? cap - index : frames;
+	if (to_fifo) {
+		memcpy(fifo, data, (size_t)first * fs);
+		memcpy(iso->fifo, (uint8_t *)data + (size_t)first * fs,
+			(size_t)(frames - first) * fs);
+	} else {
+		memcpy(data, fifo, (size_t)first * fs);
+		memcpy((uint8_t *)data + (size_t)first * fs, iso->fifo,
+			(size_t)(frames - first) * fs);
+	}
+}
+
+static uint32_t __usbf_iso_push(struct usbf_iso *iso, const void *data,
+	uint32_t frames)
+{
+	uint32_t space = iso->params.fifo_frames - __usbf_iso_level(iso);
+
+	if (frames > space) {
+		__usbf_iso_inc(&iso->stats.overruns);
+		frames = space;
+	}
+	__usbf_iso_copy(iso, iso->fifo_tail, (void *)data, frames, 1);
+	__atomic_store_n(&iso->fifo_tail, iso->fifo_tail + frames,
+		__ATOMIC_RELEASE);
+
+	return frames;
+}
+
+static uint32_t __usbf_iso_pull(struct usbf_iso *iso, void *data,
+	uint32_t frames)
+{
+	uint32_t level = __usbf_iso_level(iso);
+
+	if (!iso->primed) {
+		if (level < iso->target)
+			return 0;
+		iso->primed = 1;
+	}
+	if (frames > level) {
+		/* Wait for FIFO to fill up again rather than glitch each time */
+		__usbf_iso_inc(&iso->stats.underruns);
+		iso->primed = 0;
+		frames = level;
+	}
+	__usbf_iso_copy(iso, iso->fifo_head, data, frames, 0);
+	__atomic_store_n(&iso->fifo_head, iso->fifo_head + frames,
+		__ATOMIC_RELEASE);
+
+	return frames;
+}
+
+/*
+ * Once per service interval. FIFO level above target means device clock
+ * runs faster than host one for IN (more data produced than sent) and
+ * slower for OUT (less data consumed than received). Rate is corrected
+ * proportionally to averaged level error, long term average of the
+ * correction is the drift.
+ */
+static void __usbf_iso_control(struct usbf_iso *iso)
+{
+	int64_t error, correction, limit;
+
+	iso->level += (((int64_t)__usbf_iso_level(iso) << 16) - iso->level) >>
+		ISO_LEVEL_SHIFT;
+	error = iso->level - ((int64_t)iso->target << 16);
+	if (!iso->in)
+		error = -error;
+
+	/* Hosts expect async endpoint to stay within one frame of nominal */
+	correction = error / ISO_CORRECTION_PACKETS;
+	limit = 1 << 16;
+	if (correction > limit)
+		correction = limit;
+	if (correction < -limit)
+		correction = -limit;
+
+	iso->rate = iso->nominal + correction;
+	iso->drift += (correction * 65536 - iso->drift) >> ISO_DRIFT_SHIFT;
+	__atomic_store_n(&iso->stats.drift_ppm, (int32_t)(iso->drift /
+		65536 * 1000000 / (int64_t)iso->nominal), __ATOMIC_RELAXED);
+	__atomic_store_n(&iso->stats.interval_frames,
+		(uint32_t)(iso->nominal + iso->drift / 65536), __ATOMIC_RELAXED);
+}
+
+static int __usbf_iso_submit(struct usbf_iso *iso,
+	struct __usbf_iso_slot *slot)
+{
+	struct usbf_endpoint *ep = iso->ep;
+	struct iocb *iocbp = &slot->req.iocb;
+	uint32_t frames = 0;
+	size_t length;
+	int ret;
+
+	__usbf_iso_control(iso);
+	if (iso->in) {
+		iso->accum += iso->rate;
+		frames = iso->accum >> 16;
+		iso->accum &= 0xffff;
+		if (frames > iso->max_frames)
+			frames = iso->max_frames;
+		/* Short packets while priming, host copes with them */
+		frames = __usbf_iso_pull(iso, slot->buf, frames);
+		length = (size_t)frames * iso->params.frame_size;
+	} else {
+		length = (size_t)iso->max_frames * iso->params.frame_size;
+	}
+
+	__usbf_aio_prep(ep, &slot->req.iocb, slot->buf, length, &slot->req);
+	slot->req.iocb.aio_flags = 0;
+	slot->req.detached = 1;
+	__usbf_aio_link(ep, &slot->req);
+	ret = __usbf_aio_submit(ep, &iocbp, 1);
+	if (ret < 0) {
+		pthread_mutex_lock(&ep->aio_lock);
+		__usbf_aio_unlink(ep, &slot->req);
+		pthread_mutex_unlock(&ep->aio_lock);
+		return ret;
+	}
+
+	slot->inflight = 1;
+	return 0;
+}
+
+/* Waits for slot with aio_lock held, -ETIMEDOUT if deadline passes */
+static int __usbf_iso_wait(struct usbf_iso *iso,
+	struct __usbf_iso_slot *slot, const struct timespec *deadline)
+{
+	struct usbf_endpoint *ep = iso->ep;
+	int ret = 0;
+
+	/* Context is gone with usbf_stop(), request won't complete anymore */
+	if (!slot->req.done && ep->event_fd < 0) {
+		slot->req.done = 1;
+		slot->req.cancelled = ECANCELED;
+	}
+	if (!slot->req.done)
+		ret = __usbf_aio_wait(ep, &slot->req, deadline);
+	if (!ret) {
+		__usbf_aio_unlink(ep, &slot->req);
+		slot->inflight = 0;
+	}
+
+	return ret;
+}
+
+static void __usbf_iso_drain(struct usbf_iso *iso)
+{
+	struct usbf_endpoint *ep = iso->ep;
+	int i;
+
+	usbf_endpoint_cancel(ep);
+	pthread_mutex_lock(&ep->aio_lock);
+	for (i = 0; i < iso->params.depth; ++i)
+		if (iso->slots[i].inflight)
+			__usbf_iso_wait(iso, &iso->slots[i], NULL);
+	pthread_mutex_unlock(&ep->aio_lock);
+	iso->running = 0;
+}
+
+/* Nominal 16.16 frames per service interval, 0 if packets can't carry it */
+static uint64_t __usbf_iso_nominal(struct usbf_iso *iso, uint32_t period,
+	size_t max)
+{
+	uint64_t nominal;
+	uint32_t frames;
+
+	frames = max / iso->params.frame_size;
+	nominal = ((uint64_t)iso->params.rate << 16) * period / 1000000;
+	if (!frames || nominal > (uint64_t)frames << 16)
+		return 0;
+
+	return nominal;
+}
+
+/* Packet sizes follow speed and descriptor host enabled us with */
+static int __usbf_iso_begin(struct usbf_iso *iso)
+{
+	struct usbf_endpoint *ep = iso->ep;
+	struct usbf_endpoint_info info;
+	uint32_t speed, period;
+	size_t max;
+	int i, ret;
+
+	speed = usbf_get_speed(ep->func);
+	if (usbf_endpoint_get_info(ep, &info) || !speed || ep->event_fd < 0)
+		return -ENOTCONN;
+
+	period = __usbf_endpoint_period(ep, speed, info.interval);
+	max = (size_t)info.maxpacketsize * (info.mult + 1);
+	if (max > iso->buf_size)
+		max = iso->buf_size;
+	iso->max_frames = max / iso->params.frame_size;
+	iso->nominal = __usbf_iso_nominal(iso, period, max);
+	if (!iso->nominal)
+		return -EINVAL;
+	__atomic_store_n(&iso->period, period, __ATOMIC_RELAXED);
+	iso->rate = iso->nominal;
+	iso->accum = 0;
+	iso->level = (int64_t)iso->target << 16;
+	iso->head = 0;
+
+	for (i = 0; i < iso->params.depth; ++i) {
+		ret = __usbf_iso_submit(iso, &iso->slots[i]);
+		if (ret) {
+			__usbf_iso_drain(iso);
+			return ret;
+		}
+	}
+	iso->running = 1;
+
+	return 0;
+}
+
+static void __usbf_iso_complete(struct usbf_iso *iso,
+	struct __usbf_iso_slot *slot)
+{
+	long result = slot->req.cancelled ? -slot->req.cancelled :
+		slot->req.result;
+
+	__usbf_capture_transfer(iso->ep, slot->buf, result);
+	if (result < 0) {
+		__usbf_iso_inc(&iso->stats.errors);
+		return;
+	}
+
+	__atomic_store_n(&iso->stats.packets, iso->stats.packets + 1,
+		__ATOMIC_RELAXED);
+	result /= iso->params.frame_size;
+	if (!iso->in)
+		result = __usbf_iso_push(iso, slot->buf, result);
+	__atomic_store_n(&iso->stats.frames, iso->stats.frames + result,
+		__ATOMIC_RELAXED);
+}
+
+static void *__usbf_iso_loop(void *arg)
+{
+	struct usbf_iso *iso = arg;
+	struct usbf_endpoint *ep = iso->ep;
+	struct __usbf_iso_slot *slot;
+	struct timespec deadline;
+	unsigned int seq;
+	int ret;
+
+	while (!__atomic_load_n(&iso->stopping, __ATOMIC_RELAXED)) {
+		if (!iso->running) {
+			ret = __usbf_wait_enabled(ep->func, STATE_WAIT_SLICE,
+				&seq);
+			if (!ret) {
+				/* Host picked settings we can't stream with */
+				ret = __usbf_iso_begin(iso);
+				__atomic_store_n(&iso->stats.error, ret,
+					__ATOMIC_RELAXED);
+			}
+			/* Not started yet or stopped, nothing to wait on */
+			if (ret && ret != -ETIMEDOUT)
+				usleep(STATE_WAIT_SLICE * 1000);
+			continue;
+		}
+
+		slot = &iso->slots[iso->head];
+		__usbf_ms_from_now(&deadline, STATE_WAIT_SLICE);
+		pthread_mutex_lock(&ep->aio_lock);
+		ret = __usbf_iso_wait(iso, slot, &deadline);
+		pthread_mutex_unlock(&ep->aio_lock);
+		if (ret)
+			continue;
+
+		/* Disabled, requests behind this one are failing as well */
+		if (slot->req.cancelled || slot->req.result == -ESHUTDOWN) {
+			if (!slot->req.cancelled)
+				__usbf_state_shutdown(ep->func, seq);
+			__usbf_iso_drain(iso);
+			continue;
+		}
+
+		__usbf_iso_complete(iso, slot);
+		if (__usbf_iso_submit(iso, slot)) {
+			__usbf_iso_drain(iso);
+			continue;
+		}
+		iso->head = (iso->head + 1) % iso->params.depth;
+	}
+
+	if (iso->running)
+		__usbf_iso_drain(iso);
+
+	return NULL;
+}
+
+struct usbf_iso *usbf_iso_create(struct usbf_endpoint *ep,
+	const struct usbf_iso_params *params)
+{
+	struct usbf_iso *iso;
+	uint32_t speed;
+	long page;
+	int i, ret;
+
+	if (!params || !params->rate || !params->frame_size ||
+	    params->depth < 0 || params->depth > AIO_NR_EVENTS ||
+	    ep->desc.type != USBF_ISOCHRONOUS || ep->nonblock) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	iso = calloc(1, sizeof(*iso));
+	if (!iso)
+		return NULL;
+
+	iso->ep = ep;
+	iso->params = *params;
+	iso->in = ep->desc.direction == USBF_IN;
+	if (!iso->params.depth)
+		iso->params.depth = ISO_DEFAULT_DEPTH;
+	if (!iso->params.fifo_frames)
+		iso->params.fifo_frames = (uint64_t)params->rate *
+			ISO_DEFAULT_FIFO_MS / 1000;
+	if (iso->params.fifo_frames < 2)
+		iso->params.fifo_frames = 2;
+	iso->target = iso->params.fifo_frames / 2;
+
+	/*
+	 * Largest packet of any speed, high bandwidth and bursts included.
+	 * Rate has to fit packets of every speed function can be enabled at.
+	 */
+	for (speed = USBF_SPEED_FS; speed <= USBF_SPEED_SS; speed <<= 1) {
+		if (!(ep->func->flags & speed))
+			continue;
+		if (!__usbf_iso_nominal(iso, __usbf_endpoint_period(ep, speed,
+				__usbf_endpoint_interval(ep, speed)),
+				__usbf_endpoint_bytes(ep, speed))) {
+			free(iso);
+			errno = EINVAL;
+			return NULL;
+		}
+		if (__usbf_endpoint_bytes(ep, speed) > iso->buf_size)
+			iso->buf_size = __usbf_endpoint_bytes(ep, speed);
+	}
+
+	iso->fifo = malloc((size_t)iso->params.fifo_frames *
+		params->frame_size);
+	iso->slots = calloc(iso->params.depth, sizeof(*iso->slots));
+	if (!iso->fifo || !iso->slots || !iso->buf_size)
+		goto err;
+
+	page = sysconf(_SC_PAGESIZE);
+	for (i = 0; i < iso->params.depth; ++i)
+		if (posix_memalign(&iso->slots[i].buf, page, iso->buf_size))
+			goto err;
+
+	ret = pthread_create(&iso->thread, NULL, __usbf_iso_loop, iso);
+	if (ret) {
+		errno = ret;
+		goto err_errno;
+	}
+
+	return iso;
+
+err:
+	errno = iso->buf_size ? ENOMEM : EINVAL;
+err_errno:
+	if (iso->slots)
+		for (i = 0; i < iso->params.depth; ++i)
+			free(iso->slots[i].buf);
+	free(iso->slots);
+	free(iso->fifo);
+	free(iso);
+	return NULL;
+}
+
+void usbf_iso_delete(struct usbf_iso *iso)
+{
+	int i;
+
+	__atomic_store_n(&iso->stopping, 1, __ATOMIC_RELAXED);
+	__usbf_aio_cancel_join(iso->ep, iso->thread);
+
+	for (i = 0; i < iso->params.depth; ++i)
+		free(iso->slots[i].buf);
+	free(iso->slots);
+	free(iso->fifo);
+	free(iso);
+}
+
+int usbf_iso_write(struct usbf_iso *iso, const void *data, size_t frames)
+{
+	if (!iso->in)
+		return -EINVAL;
+	if (frames > iso->params.fifo_frames)
+		frames = iso->params.fifo_frames;
+
+	return __usbf_iso_push(iso, data, frames);
+}
+
+int usbf_iso_read(struct usbf_iso *iso, void *data, size_t frames)
+{
+	if (iso->in)
+		return -EINVAL;
+	if (frames > iso->params.fifo_frames)
+		frames = iso->params.fifo_frames;
+
+	return __usbf_iso_pull(iso, data, frames);
+}
+
+void usbf_iso_get_stats(struct usbf_iso *iso, struct usbf_iso_stats *stats)
+{
+	struct usbf_iso_stats *src = &iso->stats;
+
+	stats->packets = __atomic_load_n(&src->packets, __ATOMIC_RELAXED);
+	stats->frames = __atomic_load_n(&src->frames, __ATOMIC_RELAXED);
+	stats->underruns = __atomic_load_n(&src->underruns, __ATOMIC_RELAXED);
+	stats->overruns = __atomic_load_n(&src->overruns, __ATOMIC_RELAXED);
+	stats->errors = __atomic_load_n(&src->errors, __ATOMIC_RELAXED);
+	stats->error = __atomic_load_n(&src->error, __ATOMIC_RELAXED);
+	stats->drift_ppm = __atomic_load_n(&src->drift_ppm, __ATOMIC_RELAXED);
+	stats->interval_frames = __atomic_load_n(&src->interval_frames,
+		__ATOMIC_RELAXED);
+	stats->fifo_level = __usbf_iso_level(iso);
+}
+
+struct usbf_feedback {
+	struct usbf_endpoint *ep;
+	struct usbf_iso *iso;
+	/* 16.16 frames per second */
+	uint64_t rate;
+	pthread_t thread;
+	int stopping;
+};
+
+/* Rate to report, 16.16 frames per millisecond */
+static uint64_t __usbf_feedback_rate(struct usbf_feedback *fb)
+{
+	uint32_t frames, period;
+
+	if (fb->iso) {
+		frames = __atomic_load_n(&fb->iso->stats.interval_frames,
+			__ATOMIC_RELAXED);
+		period = __atomic_load_n(&fb->iso->period, __ATOMIC_RELAXED);
+		if (frames && period)
+			return (uint64_t)frames * 1000 / period;
+	}
+
+	return __atomic_load_n(&fb->rate, __ATOMIC_RELAXED) / 1000;
+}
+
+static void *__usbf_feedback_loop(void *arg)
+{
+	struct usbf_feedback *fb = arg;
+	struct usbf_endpoint *ep = fb->ep;
+	uint8_t buf[4];
+	struct iovec iov;
+	uint64_t rate;
+	uint32_t value;
+	unsigned int seq;
+	int ret;
+
+	iov.iov_base = buf;
+	while (!__atomic_load_n(&fb->stopping, __ATOMIC_RELAXED)) {
+		ret = __usbf_wait_enabled(ep->func, STATE_WAIT_SLICE, &seq);
+		if (ret) {
+			if (ret != -ETIMEDOUT)
+				usleep(STATE_WAIT_SLICE * 1000);
+			continue;
+		}
+
+		rate = __usbf_feedback_rate(fb);
+		if (usbf_get_speed(ep->func) == USBF_SPEED_FS) {
+			/* 10.14 frames per frame, in 3 bytes */
+			value = rate >> 2;
+			iov.iov_len = 3;
+		} else {
+			/* 16.16 frames per microframe */
+			value = rate / 8;
+			iov.iov_len = 4;
+		}
+		buf[0] = value;
+		buf[1] = value >> 8;
+		buf[2] = value >> 16;
+		buf[3] = value >> 24;
+
+		/* Completes when host polls, value is fresh each time */
+		ret = __usbf_transfer_aio(ep, &iov, 1, 0);
+		if (ret < 0 && errno == ESHUTDOWN)
+			__usbf_state_shutdown(ep->func, seq);
+		else if (ret < 0 && errno != ECANCELED)
+			usleep(STATE_WAIT_SLICE * 1000);
+	}
+
+	return NULL;
+}
+
+struct usbf_feedback *usbf_feedback_create(struct usbf_endpoint *ep,
+	const struct usbf_feedback_params *params)
+{
+	struct usbf_feedback *fb;
+	int ret;
+
+	if (!params || !params->rate || ep->nonblock ||
+	    ep->desc.type != USBF_ISOCHRONOUS ||
+	    ep->desc.direction != USBF_IN ||
+	    (params->iso && params->iso->ep->func != ep->func)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	fb = calloc(1, sizeof(*fb));
+	if (!fb)
+		return NULL;
+
+	fb->ep = ep;
+	fb->iso = params->iso;
+	fb->rate = (uint64_t)params->rate << 16;
+
+	ret = pthread_create(&fb->thread, NULL, __usbf_feedback_loop, fb);
+	if (ret) {
+		free(fb);
+		errno = ret;
+		return NULL;
+	}
+
+	return fb;
+}
+
+void usbf_feedback_delete(struct usbf_feedback *fb)
+{
+	__atomic_store_n(&fb->stopping, 1, __ATOMIC_RELAXED);
+	__usbf_aio_cancel_join(fb->ep, fb->thread);
+	free(fb);
+}
+
+void usbf_feedback_set_rate(struct usbf_feedback *fb, double rate)
+{
+	if (rate > 0)
+		__atomic_store_n(&fb->rate, (uint64_t)(rate * 65536),
+			__ATOMIC_RELAXED);
+}
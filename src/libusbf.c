@@ -50,6 +50,24 @@ usbf_create_function(struct usbf_function_descriptor *desc, char *path)
 
 	func->flags = func->desc.speed;
 	func->ep_count = 0;
+	memset(func->setup_table, 0, sizeof(func->setup_table));
+	pthread_mutex_init(&func->setup_lock, NULL);
+	func->deferred = NULL;
+	func->setup_active = NULL;
+	func->setup_timeout = SETUP_DEFAULT_TIMEOUT;
+	func->ep0_file = -1;
+	func->runtime_shard = -1;
+	func->runtime_armed = 0;
+	func->wake_fd = -1;
+	func->speed = 0;
+	func->capture = NULL;
+	func->capture_users = 0;
+	func->capture_waiting = 0;
+	pthread_mutex_init(&func->capture_lock, NULL);
+	pthread_cond_init(&func->capture_cond, NULL);
+	func->replay = 0;
+	__usbf_busy_poll_init(&func->busy_poll);
+	__usbf_state_init(func);
 
 	return func;
 }
@@ -58,8 +76,19 @@ void usbf_delete_function(struct usbf_function *func)
 {
 	int i;
 	
-	for (i = 0; i < func->ep_count; ++i)
+	for (i = 0; i < func->ep_count; ++i) {
+		__usbf_autotune_destroy(func->endpoints[i]);
+		__usbf_aio_destroy(func->endpoints[i]);
+		__usbf_splice_destroy(func->endpoints[i]);
+		free(func->endpoints[i]->nb.buf);
 		free(func->endpoints[i]);
+	}
+	__usbf_setup_table_free(func);
+	__usbf_setup_deferred_free(func);
+	pthread_mutex_destroy(&func->setup_lock);
+	pthread_cond_destroy(&func->capture_cond);
+	pthread_mutex_destroy(&func->capture_lock);
+	__usbf_state_destroy(func);
 	free(func->ffs_path);
 	free(func);
 }
@@ -69,13 +98,18 @@ struct usbf_endpoint *usbf_add_endpoint(
 {
 	struct usbf_endpoint *ep;
 
-	/* TODO - validate maxpacketsize and interval for selected speeds */
 	switch (desc->type) {
 	case USBF_ISOCHRONOUS:
 	case USBF_BULK:
 	case USBF_INTERRUPT:
 		break;
 	default:
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (__usbf_endpoint_check(func->flags, desc)) {
+		errno = EINVAL;
 		return NULL;
 	}
 
@@ -87,6 +121,21 @@ struct usbf_endpoint *usbf_add_endpoint(
 		return NULL;
 
 	memcpy(&ep->desc, desc, sizeof(*desc));
+	ep->func = func;
+	ep->recovery = USBF_RECOVERY_NONE;
+	ep->recovery_retries = 0;
+	ep->info_valid = 0;
+	ep->nonblock = 0;
+	ep->handler = NULL;
+	ep->handler_arg = NULL;
+	ep->timeout = 0;
+	ep->integrity = USBF_INTEGRITY_NONE;
+	ep->sync_ep = NULL;
+	ep->capture_users = 0;
+	memset(&ep->nb, 0, sizeof(ep->nb));
+	__usbf_aio_init(ep);
+	__usbf_autotune_init(ep);
+	__usbf_splice_init(ep);
 
 	func->endpoints[func->ep_count++] = ep;
 	ep->address = func->ep_count | ep->desc.direction;
@@ -94,28 +143,66 @@ struct usbf_endpoint *usbf_add_endpoint(
 	return ep;
 }
 
+struct usbf_endpoint *usbf_add_endpoint_intent(struct usbf_function *func,
+	const struct usbf_endpoint_intent *intent)
+{
+	struct usbf_endpoint_descriptor desc;
+	int ret;
+
+	ret = usbf_endpoint_derive(func->flags, intent, &desc);
+	if (ret) {
+		errno = -ret;
+		return NULL;
+	}
+
+	return usbf_add_endpoint(func, &desc);
+}
+
 int usbf_start(struct usbf_function *func)
+{
+	return __usbf_start(func, NULL);
+}
+
+/* Closes given files __usbf_start() hasn't taken over yet */
+static void __usbf_start_close_files(struct usbf_function *func,
+	const int *files, int taken)
+{
+	if (!files)
+		return;
+	while (taken <= func->ep_count)
+		close(files[taken++]);
+}
+
+/*
+ * Uses already opened ep0 and endpoint files if given. They are owned by
+ * us from the call on: on failure all of them are closed, whatever step
+ * failed.
+ */
+int __usbf_start(struct usbf_function *func, const int *files)
 {
 	struct __usbf_descs descs;
 	struct __usbf_strings strings;
 	struct usb_functionfs_descs_head_v2 *descs_header;
 	struct usb_interface_descriptor *intf_desc;
-	struct usb_endpoint_descriptor_no_audio *ep_desc;
+	struct usb_endpoint_descriptor *ep_desc;
+	struct usb_ss_ep_comp_descriptor *comp_desc;
 	__le32 *count_ptr;
 	struct usb_functionfs_strings_head *strings_header;
 	struct usbf_endpoint *ep;
 	uint32_t speed;
 	char *path;
-	int ret, i, j;
+	int ret, i, j, taken = 0;
 
 	/* We count how many speeds we support */
 	descs.speeds = !!(func->flags & USBF_SPEED_FS) +
 		!!(func->flags & USBF_SPEED_HS) +
 		!!(func->flags & USBF_SPEED_SS);
 	descs.endpoints = func->ep_count;
-	ret = __usbf_descs_alloc(&descs);
-	if (ret)
+	ret = __usbf_descs_alloc(&descs, func);
+	if (ret) {
+		__usbf_start_close_files(func, files, 0);
 		return ret;
+	}
 
 	descs_header = __usbf_descs_access_header(&descs);
 	descs_header->magic = htole32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2);
@@ -125,7 +212,8 @@ int usbf_start(struct usbf_function *func)
 
 	for (i = 0; i < descs.speeds; ++i) {
 		count_ptr = __usbf_descs_access_count(&descs, i);
-		*count_ptr = htole32(descs.endpoints+1);
+		*count_ptr = htole32(i == descs.ss_idx ?
+			2 * descs.endpoints + 1 : descs.endpoints + 1);
 	}
 
 	speed = 1;
@@ -137,31 +225,40 @@ int usbf_start(struct usbf_function *func)
 		intf_desc->bDescriptorType = USB_DT_INTERFACE;
 		intf_desc->bNumEndpoints = descs.endpoints;
 		intf_desc->bInterfaceClass = func->desc.interface_class;
+		intf_desc->bInterfaceSubClass = func->desc.interface_subclass;
+		intf_desc->bInterfaceProtocol = func->desc.interface_protocol;
 		intf_desc->iInterface = 1;
 		for (j = 0; j < descs.endpoints; ++j) {
 			ep = func->endpoints[j];
 			ep_desc = __usbf_descs_access_endpoint(&descs, i, j);
-			ep_desc->bLength = sizeof(*ep_desc);
+			ep_desc->bLength = __usbf_descs_endpoint_size(ep);
 			ep_desc->bDescriptorType = USB_DT_ENDPOINT;
 			ep_desc->bEndpointAddress = ep->address;
 			ep_desc->bmAttributes = ep->desc.type;
-			switch (speed) {
-			case USBF_SPEED_FS:
-				ep_desc->wMaxPacketSize =
-					htole16(ep->desc.fs_maxpacketsize);
-				ep_desc->bInterval = ep->desc.fs_interval;
-				break;
-			case USBF_SPEED_HS:
-				ep_desc->wMaxPacketSize =
-					htole16(ep->desc.hs_maxpacketsize);
-				ep_desc->bInterval = ep->desc.fs_interval;
-				break;
-			case USBF_SPEED_SS:
-				ep_desc->wMaxPacketSize =
-					htole16(ep->desc.ss_maxpacketsize);
-				ep_desc->bInterval = ep->desc.fs_interval;
-				break;
+			if (ep->desc.type == USBF_ISOCHRONOUS)
+				ep_desc->bmAttributes |= ep->desc.iso_attributes;
+			ep_desc->wMaxPacketSize =
+				htole16(__usbf_endpoint_maxpacket(ep, speed));
+			ep_desc->bInterval = __usbf_endpoint_interval(ep, speed);
+			if (ep->desc.audio) {
+				ep_desc->bRefresh = ep->desc.refresh;
+				ep_desc->bSynchAddress = ep->sync_ep ?
+					ep->sync_ep->address : 0;
 			}
+			if (i != descs.ss_idx)
+				continue;
+			comp_desc = __usbf_descs_access_comp(&descs, i, j);
+			comp_desc->bLength = USB_DT_SS_EP_COMP_SIZE;
+			comp_desc->bDescriptorType = USB_DT_SS_ENDPOINT_COMP;
+			comp_desc->bMaxBurst = ep->desc.ss_maxburst;
+			comp_desc->bmAttributes =
+				ep->desc.type == USBF_ISOCHRONOUS ?
+				ep->desc.ss_mult : 0;
+			comp_desc->wBytesPerInterval =
+				ep->desc.type == USBF_BULK ? 0 :
+				htole16(ep->desc.ss_bytes_per_interval ?
+					ep->desc.ss_bytes_per_interval :
+					__usbf_endpoint_bytes(ep, speed));
 		}
 		speed <<= 1;
 	}
@@ -189,7 +286,8 @@ int usbf_start(struct usbf_function *func)
 	}
 
 	sprintf(path, "%s/ep0", func->ffs_path);
-	func->ep0_file = open(path, O_RDWR);
+	func->ep0_file = files ? files[0] : open(path, O_RDWR);
+	taken = 1;
 	if (func->ep0_file < 0) {
 		ret = func->ep0_file;
 		goto out3;
@@ -204,19 +302,32 @@ int usbf_start(struct usbf_function *func)
 		goto err;
 
 	for (i = 0; i < func->ep_count; ++i) {
+		ep = func->endpoints[i];
 		sprintf(path, "%s/ep%d", func->ffs_path, i+1);
-		func->endpoints[i]->epfile = open(path, O_RDWR);
-		if (func->endpoints[i]->epfile < 0) {
-			ret = func->endpoints[i]->epfile;
+		ep->epfile = files ? files[i + 1] :
+			open(path, O_RDWR | (ep->nonblock ? O_NONBLOCK : 0));
+		taken = i + 2;
+		if (ep->epfile < 0) {
+			ret = ep->epfile;
+			goto err_epfiles;
+		}
+		/* AIO doesn't work on sockets, replay does without it */
+		ret = func->replay ? 0 : __usbf_aio_open(ep, AIO_NR_EVENTS);
+		if (ret) {
+			close(ep->epfile);
 			goto err_epfiles;
 		}
 	}
 
+	__usbf_state_set(func, USBF_STATE_UNBOUND);
 	goto out3;
 
 err_epfiles:
-	while (i)
-		close(func->endpoints[--i]->epfile);
+	while (i) {
+		ep = func->endpoints[--i];
+		__usbf_aio_close(ep);
+		close(ep->epfile);
+	}
 err:
 	close(func->ep0_file);
 out3:
@@ -225,6 +336,8 @@ out2:
 	__usbf_strings_free(&strings);
 out:
 	__usbf_descs_free(&descs);
+	if (ret < 0)
+		__usbf_start_close_files(func, files, taken);
 	return ret;
 }
 
@@ -232,87 +345,203 @@ void usbf_stop(struct usbf_function *func)
 {
 	int i;
 
-	for (i = 0; i < func->ep_count; ++i)
+	/* Wake up everyone waiting for ENABLE */
+	__usbf_state_set(func, USBF_STATE_STOPPED);
+
+	for (i = 0; i < func->ep_count; ++i) {
+		__usbf_aio_close(func->endpoints[i]);
 		close(func->endpoints[i]->epfile);
+	}
 	close(func->ep0_file);
+	func->ep0_file = -1;
 }
 
 int usbf_transfer(struct usbf_endpoint *ep, void *data, size_t length)
 {
+	return usbf_transfer_timeout(ep, data, length, ep->timeout);
+}
+
+int usbf_transfer_timeout(struct usbf_endpoint *ep, void *data, size_t length,
+	int timeout_ms)
+{
+	struct timespec start, deadline;
+	uint8_t trailer[USBF_INTEGRITY_TRAILER];
+	struct iovec iov[2];
+	int ret, error, retries, iovcnt = 1;
+	unsigned int seq;
+	long left = 0;
+
 	/* TODO - check if (lenght <= maxpacketsize) for current speed */
 
-	switch (ep->desc.direction) {
-	case USBF_OUT:
-		return read(ep->epfile, data, length);
-	case USBF_IN:
-		return write(ep->epfile, data, length);
-	default:
-		return -EINVAL;
+	if (ep->nonblock) {
+		ret = __usbf_transfer_nonblock(ep, data, length);
+		if (ret < 0)
+			errno = -ret;
+		return ret;
+	}
+
+	if (timeout_ms > 0)
+		__usbf_ms_from_now(&deadline, timeout_ms);
+
+	iov[0].iov_base = data;
+	iov[0].iov_len = length;
+	if (ep->integrity) {
+		/* Trailer goes in the same transfer, without copying payload */
+		if (ep->desc.direction == USBF_IN)
+			__usbf_integrity_seal(data, length, trailer);
+		iov[1].iov_base = trailer;
+		iov[1].iov_len = sizeof(trailer);
+		iovcnt = 2;
+	}
+
+	retries = ep->recovery_retries;
+	for (;;) {
+		ret = 0;
+		if (timeout_ms > 0) {
+			left = __usbf_ms_left(&deadline);
+			if (left <= 0)
+				ret = -ETIMEDOUT;
+		}
+		if (!ret)
+			ret = __usbf_wait_enabled(ep->func,
+				timeout_ms > 0 ? left : -1, &seq);
+		if (ret) {
+			errno = -ret;
+			return ret;
+		}
+
+		if (timeout_ms > 0) {
+			left = __usbf_ms_left(&deadline);
+			if (left <= 0)
+				continue;
+		}
+
+		__usbf_autotune_begin(ep, &start);
+		ret = __usbf_transfer_aio(ep, iov, iovcnt, left);
+		if (ret >= 0) {
+			__usbf_autotune_end(ep, &start, length, ret);
+			if (ep->integrity && ep->desc.direction == USBF_IN)
+				ret = ret < USBF_INTEGRITY_TRAILER ? 0 :
+					ret - USBF_INTEGRITY_TRAILER;
+			else if (ep->integrity)
+				ret = __usbf_integrity_check(data, length,
+					trailer, ret);
+			if (ret < 0)
+				ret = -errno;
+			__usbf_capture_transfer(ep, data, ret);
+			return ret;
+		}
+
+		/* Endpoint was disabled under us, retry after ENABLE */
+		error = errno;
+		if (error == ESHUTDOWN) {
+			__usbf_state_shutdown(ep->func, seq);
+			continue;
+		}
+		if (retries-- > 0 && !__usbf_endpoint_recover(ep, error))
+			continue;
+		__usbf_capture_transfer(ep, NULL, -error);
+		errno = error;
+		return -error;
 	}
 }
 
 int usbf_handle_events(struct usbf_function *func)
 {
+	int ret, handler_ret = 0;
+
+	__usbf_events_claim(func);
+	/* Someone else is handling events right now */
+	if (pthread_mutex_trylock(&func->events_lock))
+		return 0;
+	ret = __usbf_handle_events(func, &handler_ret);
+	pthread_mutex_unlock(&func->events_lock);
+
+	return ret ? ret : handler_ret;
+}
+
+/*
+ * Returns negative errno when ep0 fails. Nonzero return of application
+ * handler stops processing, it goes to handler_ret and 0 is returned.
+ */
+int __usbf_handle_events(struct usbf_function *func, int *handler_ret)
+{
+	int (*handler)(const struct usbf_setup_request *);
 	struct usb_functionfs_event event;
 	struct usbf_setup_request setup;
+	struct __usbf_setup_entry *entry;
 	int ret;
 
 	struct pollfd pfds[1];
 	pfds[0].fd = func->ep0_file;
 	pfds[0].events = POLLIN;
 
+	/* FunctionFS would take ep0 read as data stage of deferred request */
+	if (__usbf_setup_pending(func))
+		return 0;
+
 	while ((ret = poll(pfds, 1, 0)) && (pfds[0].revents & POLLIN)) {
 		ret = read(func->ep0_file, &event, sizeof(event));
 		if (ret < 0)
-			return ret;
+			return -errno;
+		__usbf_capture_control(func, event.type == FUNCTIONFS_SETUP ?
+			&event.u.setup : NULL, event.type);
 		if (event.type == FUNCTIONFS_SETUP) {
-			if (!func->desc.setup_handler) {
-				if (event.u.setup.bRequestType & USB_DIR_IN) {
-					ret = read(func->ep0_file, NULL, 0);
-					if (ret)
-						return ret;
-				} else {
-					ret = write(func->ep0_file, NULL, 0);
-					if (ret)
-						return ret;
-				}
-				continue;
-			}
 			setup.bRequestType = event.u.setup.bRequestType;
 			setup.bRequest = event.u.setup.bRequest;
 			setup.wValue = le16toh(event.u.setup.wValue);
 			setup.wIndex = le16toh(event.u.setup.wIndex);
 			setup.wLength = le16toh(event.u.setup.wLength);
 			setup.function = func;
-			ret = func->desc.setup_handler(&setup);
+			entry = __usbf_setup_lookup(func, &setup);
+			if (entry && !entry->handler) {
+				ret = __usbf_setup_dispatch(entry, &setup);
+				if (ret)
+					return ret;
+				continue;
+			}
+			handler = entry ? entry->handler :
+				func->desc.setup_handler;
+			if (!handler) {
+				ret = __usbf_ep0_io(func,
+					!(event.u.setup.bRequestType & USB_DIR_IN),
+					NULL, 0);
+				/* Stalled request is reported as EL2HLT */
+				if (ret < 0 && errno != EL2HLT)
+					return -errno;
+				continue;
+			}
+			ret = handler(&setup);
+			if (!ret && __usbf_setup_time_left(func) >= 0)
+				return 0;
 		} else {
-			if (func->desc.event_handler)
-				ret = func->desc.event_handler(event.type);
+			__usbf_state_event(func, event.type);
+			ret = func->desc.event_handler ?
+				func->desc.event_handler(event.type) : 0;
+		}
+		if (ret) {
+			*handler_ret = ret;
+			return 0;
 		}
-		if (ret)
-			return ret;
 	}
 	return 0;
 }
 
 int usbf_setup_ack(const struct usbf_setup_request *setup)
 {
-	return (setup->bRequestType & USB_DIR_IN) ?
-		write(setup->function->ep0_file, NULL, 0) :
-		read(setup->function->ep0_file, NULL, 0);
+	return __usbf_setup_complete(setup,
+		setup->bRequestType & USB_DIR_IN, NULL, 0);
 }
 
 int usbf_setup_response(const struct usbf_setup_request *setup,
 	void *data, size_t length)
 {
-	return (setup->bRequestType & USB_DIR_IN) ?
-		write(setup->function->ep0_file, data, length) :
-		read(setup->function->ep0_file, data, length);
+	return __usbf_setup_complete(setup,
+		setup->bRequestType & USB_DIR_IN, data, length);
 }
 
 int usbf_setup_stall(const struct usbf_setup_request *setup)
 {
-	return (setup->bRequestType & USB_DIR_IN) ?
-		read(setup->function->ep0_file, NULL, 0) :
-		write(setup->function->ep0_file, NULL, 0);
+	return __usbf_setup_complete(setup,
+		!(setup->bRequestType & USB_DIR_IN), NULL, 0);
 }
@@ -21,15 +21,182 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include <linux/usb/functionfs.h>
+#include <linux/aio_abi.h>
 
 #define MAX_ENDPOINTS 16
 
+#define RUNTIME_MAX_FUNCTIONS 32
+
+/* How long waiter sleeps before checking if nobody handles events */
+#define STATE_WAIT_SLICE 10
+
+#define AIO_NR_EVENTS USBF_MAX_DEPTH
+#define AIO_REAP_BATCH 16
+/* How long usbf_stop() waits for cancelled transfers, in ms */
+#define AIO_CLOSE_TIMEOUT 1000
+/* How long timed out transfer waits for its cancellation, in ms */
+#define AIO_CANCEL_GRACE 100
+
+#define USBF_INTEGRITY_TRAILER 4
+
+#define SETUP_TABLE_BITS 6
+#define SETUP_TABLE_SIZE (1 << SETUP_TABLE_BITS)
+
+struct __usbf_setup_entry {
+	uint64_t key;
+	int (*handler)(const struct usbf_setup_request *);
+	void *data;
+	size_t length;
+	struct __usbf_setup_entry *next;
+};
+
+/* USB 2.0 9.2.6.4 - host gives up on control transfer after 5 seconds */
+#define SETUP_DEFAULT_TIMEOUT 5000
+
+/* ep0 I/O of deferred request is done without setup_lock held */
+enum __usbf_deferred_state {
+	DEFERRED_PENDING,
+	/* Application response is being sent */
+	DEFERRED_COMPLETING,
+	/* Stalled on timeout, or stall is being sent */
+	DEFERRED_EXPIRED,
+};
+
+struct __usbf_setup_deferred {
+	/* Handle passed to application, has to be first */
+	struct usbf_setup_request setup;
+	struct timespec deadline;
+	enum __usbf_deferred_state state;
+	struct __usbf_setup_deferred *next;
+};
+
+struct __usbf_autotune {
+	pthread_mutex_t lock;
+	int enabled;
+	struct usbf_autotune_params params;
+	/* Current recommendation */
+	size_t size;
+	int depth;
+	/* Current measurement window */
+	struct timespec window_start;
+	uint64_t bytes;
+	uint64_t transfers;
+	uint64_t latency_ns;
+	/* Last window results */
+	uint64_t rate;
+	uint32_t latency_us;
+	/* Hill climbing state */
+	uint64_t best_rate;
+	size_t best_size;
+	int best_depth;
+	int dim;
+	int dir;
+	int failures;
+	int settled;
+};
+
+/* Spin then sleep wait strategy shared by event loops */
+struct __usbf_busy_poll {
+	uint32_t window_us;
+	uint32_t budget_us;
+	uint64_t last_activity;
+	/* Spin time spent in current second */
+	uint64_t period_start;
+	uint64_t period_spin;
+	struct usbf_busy_poll_stats stats;
+};
+
+struct __usbf_aio_req {
+	struct iocb iocb;
+	long result;
+	int done;
+	/* Reason to cancel with, becomes cancelled if cancel takes effect */
+	int cancel;
+	/* errno reported instead of result if cancelled */
+	int cancelled;
+	/* No thread waits for completion, reaped by owner later */
+	int detached;
+	/* Connection request was submitted in, see __usbf_wait_enabled() */
+	unsigned int seq;
+	/* Set when abandoned by timed out transfer, freed once completed */
+	struct __usbf_aio_batch *batch;
+	struct __usbf_aio_req *next;
+};
+
+/* Requests of timed transfer, on heap so they can outlive it */
+struct __usbf_aio_batch {
+	/* Abandoned requests not completed yet */
+	int orphans;
+	struct __usbf_aio_req reqs[];
+};
+
+enum __usbf_nonblock_state {
+	NB_IDLE,
+	NB_INFLIGHT,
+	NB_DONE,
+	/* Failed request to be submitted again */
+	NB_RESUBMIT,
+};
+
+/* Single request bounce buffer used by non-blocking usbf_transfer() */
+struct __usbf_nonblock {
+	struct __usbf_aio_req req;
+	enum __usbf_nonblock_state state;
+	void *buf;
+	size_t size;
+	size_t length;
+	size_t offset;
+	struct timespec start;
+	/* Connection seen by last usbf_transfer() call */
+	unsigned int seq;
+};
+
 struct usbf_endpoint {
 	struct usbf_endpoint_descriptor desc;
+	struct usbf_function *func;
 	uint8_t address;
 	int epfile;
+	unsigned int recovery;
+	int recovery_retries;
+	/* Filled on ENABLE, protected by function state_lock */
+	struct usbf_endpoint_info info;
+	int info_valid;
+	struct __usbf_autotune autotune;
+	int nonblock;
+	/* Called by runtime when non-blocking endpoint is ready */
+	void (*handler)(struct usbf_endpoint *ep, void *arg);
+	void *handler_arg;
+	int timeout;
+	enum usbf_integrity integrity;
+	/* Feedback endpoint of audio data endpoint */
+	struct usbf_endpoint *sync_ep;
+	aio_context_t aio_ctx;
+	int event_fd;
+	/* Requests in flight, reaped by one thread at a time */
+	pthread_mutex_t aio_lock;
+	pthread_cond_t aio_cond;
+	struct __usbf_aio_req *aio_reqs;
+	int aio_reaping;
+	struct __usbf_nonblock nb;
+	/* Pipe used by usbf_splice(), created on first use */
+	int splice_pipe[2];
+	/* IN data taken from fd but not sent yet */
+	size_t splice_pending;
+	/*
+	 * Last pending byte held back for next call, ZLP owed after data.
+	 * Dropped by usbf_splice_reset().
+	 */
+	int splice_carry;
+	int splice_zlp;
+	/* Kernel can splice endpoint file, -1 until found out */
+	int splice_support;
+	/* Threads recording transfer of endpoint into capture right now */
+	int capture_users;
 };
 
 struct usbf_function {
@@ -39,6 +206,211 @@ struct usbf_function {
 	struct usbf_endpoint *endpoints[MAX_ENDPOINTS];
 	int ep_count;
 	int ep0_file;
+	struct __usbf_setup_entry *setup_table[SETUP_TABLE_SIZE];
+	pthread_mutex_t setup_lock;
+	/* All deferred requests not yet completed by application */
+	struct __usbf_setup_deferred *deferred;
+	/* Deferred request FunctionFS is currently waiting for */
+	struct __usbf_setup_deferred *setup_active;
+	int setup_timeout;
+	/* Runtime shard the function is dispatched on, or -1 */
+	int runtime_shard;
+	int runtime_armed;
+	int wake_fd;
+	/* Serializes ep0 event handling */
+	pthread_mutex_t events_lock;
+	/* Thread calling usbf_handle_events(), protected by state_lock */
+	pthread_t events_thread;
+	int events_owned;
+	pthread_mutex_t state_lock;
+	pthread_cond_t state_cond;
+	enum usbf_state state;
+	enum usbf_state suspended_state;
+	/* Bumped on every ENABLE, tells connections apart, never 0 */
+	unsigned int enable_seq;
+	/* enable_seq while ENABLED and 0 otherwise, read without state_lock */
+	unsigned int enabled_seq;
+	uint32_t speed;
+	struct usbf_capture *capture;
+	/* Threads recording ep0 events into capture right now */
+	int capture_users;
+	/* usbf_capture_stop() waits for users to drop to 0 */
+	int capture_waiting;
+	pthread_mutex_t capture_lock;
+	pthread_cond_t capture_cond;
+	/* Files are replay harness sockets, not FunctionFS ones */
+	int replay;
+	struct __usbf_busy_poll busy_poll;
 };
 
+struct __usbf_setup_entry *__usbf_setup_lookup(struct usbf_function *func,
+	const struct usbf_setup_request *setup);
+
+int __usbf_setup_dispatch(struct __usbf_setup_entry *entry,
+	const struct usbf_setup_request *setup);
+
+void __usbf_setup_table_free(struct usbf_function *func);
+
+int __usbf_setup_complete(const struct usbf_setup_request *setup, int in,
+	void *data, size_t length);
+
+int __usbf_setup_pending(struct usbf_function *func);
+
+int __usbf_setup_time_left(struct usbf_function *func);
+
+void __usbf_setup_deferred_free(struct usbf_function *func);
+
+int __usbf_ep0_io(struct usbf_function *func, int in,
+	void *data, size_t length);
+
+int __usbf_replay_ep0_io(struct usbf_function *func, int in,
+	void *data, size_t length);
+
+int __usbf_start(struct usbf_function *func, const int *files);
+
+void __usbf_runtime_notify(struct usbf_function *func);
+
+void __usbf_busy_poll_init(struct __usbf_busy_poll *bp);
+
+void __usbf_busy_poll_set(struct __usbf_busy_poll *bp,
+	const struct usbf_busy_poll_params *params);
+
+int __usbf_busy_poll_wait(struct __usbf_busy_poll *bp, int timeout_ms,
+	int (*wait)(void *arg, int timeout_ms), void *arg);
+
+void __usbf_state_init(struct usbf_function *func);
+
+void __usbf_state_destroy(struct usbf_function *func);
+
+void __usbf_state_set(struct usbf_function *func, enum usbf_state state);
+
+void __usbf_state_event(struct usbf_function *func,
+	enum usbf_event_type event);
+
+/* Like usbf_wait_enabled(), seq identifies connection I/O is issued in */
+int __usbf_wait_enabled(struct usbf_function *func, int timeout_ms,
+	unsigned int *seq);
+
+/* I/O issued in connection seq failed with ESHUTDOWN */
+void __usbf_state_shutdown(struct usbf_function *func, unsigned int seq);
+
+void __usbf_events_claim(struct usbf_function *func);
+
+int __usbf_handle_events(struct usbf_function *func, int *handler_ret);
+
+int __usbf_endpoint_recover(struct usbf_endpoint *ep, int error);
+
+uint16_t __usbf_endpoint_maxpacket(struct usbf_endpoint *ep, uint32_t speed);
+
+uint8_t __usbf_endpoint_interval(struct usbf_endpoint *ep, uint32_t speed);
+
+uint32_t __usbf_endpoint_bytes(struct usbf_endpoint *ep, uint32_t speed);
+
+int __usbf_endpoint_check(uint32_t speeds,
+	const struct usbf_endpoint_descriptor *desc);
+
+uint32_t __usbf_endpoint_period(struct usbf_endpoint *ep, uint32_t speed,
+	uint8_t interval);
+
+void __usbf_endpoints_enable(struct usbf_function *func);
+
+void __usbf_endpoints_disable(struct usbf_function *func);
+
+void __usbf_aio_init(struct usbf_endpoint *ep);
+
+void __usbf_aio_destroy(struct usbf_endpoint *ep);
+
+int __usbf_aio_open(struct usbf_endpoint *ep, int nr);
+
+void __usbf_aio_close(struct usbf_endpoint *ep);
+
+void __usbf_aio_prep(struct usbf_endpoint *ep, struct iocb *iocb,
+	void *buf, size_t length, void *data);
+
+int __usbf_aio_submit(struct usbf_endpoint *ep, struct iocb **iocbs, int nr);
+
+int __usbf_aio_reap(struct usbf_endpoint *ep, struct io_event *events,
+	int min_nr, int nr, struct timespec *timeout);
+
+void __usbf_aio_signal(struct usbf_endpoint *ep, int ready);
+
+void __usbf_aio_link(struct usbf_endpoint *ep, struct __usbf_aio_req *req);
+
+void __usbf_aio_unlink(struct usbf_endpoint *ep, struct __usbf_aio_req *req);
+
+int __usbf_aio_wait(struct usbf_endpoint *ep, struct __usbf_aio_req *req,
+	const struct timespec *deadline);
+
+int __usbf_aio_wait_all(struct usbf_endpoint *ep, struct __usbf_aio_req *reqs,
+	int count, const struct timespec *deadline);
+
+void __usbf_aio_poll(struct usbf_endpoint *ep);
+
+void __usbf_aio_cancel_join(struct usbf_endpoint *ep, pthread_t thread);
+
+int __usbf_transfer_aio(struct usbf_endpoint *ep, const struct iovec *iov,
+	int iovcnt, int timeout_ms);
+
+int __usbf_transfer_nonblock(struct usbf_endpoint *ep,
+	void *data, size_t length);
+
+void __usbf_splice_init(struct usbf_endpoint *ep);
+
+void __usbf_splice_destroy(struct usbf_endpoint *ep);
+
+void __usbf_integrity_seal(const void *data, size_t length, uint8_t *trailer);
+
+int __usbf_integrity_check(void *data, size_t length, uint8_t *trailer,
+	size_t received);
+
+void __usbf_autotune_init(struct usbf_endpoint *ep);
+
+void __usbf_autotune_destroy(struct usbf_endpoint *ep);
+
+void __usbf_autotune_begin(struct usbf_endpoint *ep, struct timespec *start);
+
+void __usbf_autotune_end(struct usbf_endpoint *ep,
+	const struct timespec *start, size_t length, int ret);
+
+void __usbf_capture_record_transfer(struct usbf_endpoint *ep,
+	const void *data, long result);
+
+void __usbf_capture_record_control(struct usbf_function *func,
+	const struct usb_ctrlrequest *setup, int event);
+
+/* Capture hooks, cheap enough to be called unconditionally */
+static inline void __usbf_capture_transfer(struct usbf_endpoint *ep,
+	const void *data, long result)
+{
+	if (__atomic_load_n(&ep->func->capture, __ATOMIC_RELAXED))
+		__usbf_capture_record_transfer(ep, data, result);
+}
+
+static inline void __usbf_capture_control(struct usbf_function *func,
+	const struct usb_ctrlrequest *setup, int event)
+{
+	if (__atomic_load_n(&func->capture, __ATOMIC_RELAXED))
+		__usbf_capture_record_control(func, setup, event);
+}
+
+static inline void __usbf_ms_from_now(struct timespec *ts, long ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_nsec -= 1000000000;
+		++ts->tv_sec;
+	}
+}
+
+static inline long __usbf_ms_left(const struct timespec *deadline)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (deadline->tv_sec - now.tv_sec) * 1000 +
+		(deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
 #endif /* __LIBUSBF_PRIVATE_H__ */
@@ -0,0 +1,689 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+/*
+ * Function runs on socket pairs instead of FunctionFS files, replay thread
+ * plays host on the other ends. Sequenced packet sockets keep transfer
+ * boundaries. ep0 data stages can't be told from stalls by host end of
+ * plain socket, so in replay mode they are sent as requests, see
+ * __usbf_replay_ep0_io().
+ */
+
+#define REPLAY_DEFAULT_TIMEOUT 1000
+#define REPLAY_MAX_LINE 4096
+
+enum __usbf_replay_op {
+	REPLAY_EVENT,
+	REPLAY_SETUP,
+	REPLAY_IN,
+	REPLAY_OUT,
+	REPLAY_TIMEOUT,
+};
+
+struct __usbf_replay_cmd {
+	enum __usbf_replay_op op;
+	uint64_t time_us;
+	uint64_t period_us;
+	uint32_t count;
+	int event;
+	int ep;
+	size_t length;
+	struct usb_ctrlrequest setup;
+	uint8_t *data;
+	size_t data_len;
+};
+
+/* Single run of command, timeline is sorted by time */
+struct __usbf_replay_step {
+	uint64_t time_us;
+	uint32_t cmd;
+	uint32_t iteration;
+};
+
+/* Sent by function on ep0 in replay mode, data follows for IN */
+struct __usbf_replay_request {
+	uint32_t in;
+	uint32_t length;
+};
+
+struct usbf_replay {
+	struct usbf_function *func;
+	double speed;
+	struct __usbf_replay_cmd *cmds;
+	int cmd_count;
+	struct __usbf_replay_step *steps;
+	size_t step_count;
+	/* Host ends */
+	int ep0;
+	int eps[MAX_ENDPOINTS];
+	int timeout;
+	uint8_t *buf;
+	size_t buf_size;
+	pthread_t thread;
+	int running;
+	int stopping;
+	struct usbf_replay_stats stats;
+	uint64_t setup_latency;
+	uint64_t in_latency;
+};
+
+int __usbf_replay_ep0_io(struct usbf_function *func, int in,
+	void *data, size_t length)
+{
+	struct __usbf_replay_request req;
+	struct msghdr msg;
+	struct iovec iov[2];
+	int32_t result;
+	ssize_t ret;
+
+	req.in = in;
+	req.length = length;
+	memset(&msg, 0, sizeof(msg));
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = data;
+	iov[1].iov_len = in ? length : 0;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if (sendmsg(func->ep0_file, &msg, MSG_NOSIGNAL) < 0)
+		return -1;
+
+	/* Host answers with result, followed by data for OUT */
+	iov[0].iov_base = &result;
+	iov[0].iov_len = sizeof(result);
+	iov[1].iov_len = in ? 0 : length;
+	do {
+		ret = recvmsg(func->ep0_file, &msg, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < (ssize_t)sizeof(result)) {
+		if (ret >= 0)
+			errno = EPIPE;
+		return -1;
+	}
+	if (result < 0) {
+		errno = -result;
+		return -1;
+	}
+
+	return result;
+}
+
+static uint64_t __usbf_replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int __usbf_replay_hex(const char *str, uint8_t **data, size_t *length)
+{
+	size_t len = strlen(str), i;
+	unsigned int byte;
+
+	if (!len || len % 2)
+		return -EINVAL;
+
+	*data = malloc(len / 2);
+	if (!*data)
+		return -ENOMEM;
+	for (i = 0; i < len / 2; ++i) {
+		if (sscanf(str + 2 * i, "%2x", &byte) != 1) {
+			free(*data);
+			*data = NULL;
+			return -EINVAL;
+		}
+		(*data)[i] = byte;
+	}
+	*length = len / 2;
+
+	return 0;
+}
+
+static int __usbf_replay_event(const char *name)
+{
+	static const char *const names[] = {
+		[USBF_EVENT_BIND] = "bind",
+		[USBF_EVENT_UNBIND] = "unbind",
+		[USBF_EVENT_ENABLE] = "enable",
+		[USBF_EVENT_DISABLE] = "disable",
+		[USBF_EVENT_SUSPEND] = "suspend",
+		[USBF_EVENT_RESUME] = "resume",
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+		if (names[i] && !strcasecmp(name, names[i]))
+			return i;
+
+	return -1;
+}
+
+/* Options are key=value pairs following positional arguments */
+static int __usbf_replay_option(struct __usbf_replay_cmd *cmd, char *arg)
+{
+	char *value = strchr(arg, '=');
+
+	if (!value)
+		return -EINVAL;
+	*value++ = '\0';
+
+	if (!strcmp(arg, "data") || !strcmp(arg, "expect"))
+		return __usbf_replay_hex(value, &cmd->data, &cmd->data_len);
+	if (!strcmp(arg, "count")) {
+		cmd->count = strtoul(value, NULL, 0);
+		return cmd->count ? 0 : -EINVAL;
+	}
+	if (!strcmp(arg, "period")) {
+		cmd->period_us = strtod(value, NULL) * 1000;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+static int __usbf_replay_parse_line(struct usbf_replay *rp, char *line,
+	struct __usbf_replay_cmd *cmd)
+{
+	struct usbf_endpoint *ep;
+	char *args[16], *save, *end;
+	unsigned int fields[5];
+	int argc = 0, pos, i, ret;
+	double time;
+
+	memset(cmd, 0, sizeof(*cmd));
+	for (args[0] = strtok_r(line, " \t\r\n", &save);
+	     args[argc] && argc < 15 && args[argc][0] != '#';
+	     args[argc] = strtok_r(NULL, " \t\r\n", &save))
+		++argc;
+	if (!argc)
+		return 0;
+	if (argc < 2)
+		return -EINVAL;
+
+	time = strtod(args[0], &end);
+	if (*end || time < 0)
+		return -EINVAL;
+	cmd->time_us = time * 1000;
+	cmd->count = 1;
+
+	pos = 2;
+	cmd->event = __usbf_replay_event(args[1]);
+	if (cmd->event >= 0) {
+		cmd->op = REPLAY_EVENT;
+	} else if (!strcmp(args[1], "timeout")) {
+		if (argc < 3)
+			return -EINVAL;
+		cmd->op = REPLAY_TIMEOUT;
+		cmd->length = strtoul(args[2], NULL, 0);
+		pos = 3;
+	} else if (!strcmp(args[1], "setup")) {
+		if (argc < 7)
+			return -EINVAL;
+		cmd->op = REPLAY_SETUP;
+		for (i = 0; i < 5; ++i)
+			fields[i] = strtoul(args[2 + i], NULL, 16);
+		cmd->setup.bRequestType = fields[0];
+		cmd->setup.bRequest = fields[1];
+		cmd->setup.wValue = htole16(fields[2]);
+		cmd->setup.wIndex = htole16(fields[3]);
+		cmd->setup.wLength = htole16(fields[4]);
+		pos = 7;
+	} else if (!strcmp(args[1], "in") || !strcmp(args[1], "out")) {
+		if (argc < 4)
+			return -EINVAL;
+		cmd->op = args[1][0] == 'i' ? REPLAY_IN : REPLAY_OUT;
+		cmd->ep = strtoul(args[2], NULL, 0);
+		cmd->length = strtoul(args[3], NULL, 0);
+		if (cmd->ep < 1 || cmd->ep > rp->func->ep_count)
+			return -EINVAL;
+		ep = rp->func->endpoints[cmd->ep - 1];
+		if ((ep->desc.direction == USBF_IN) != (cmd->op == REPLAY_IN))
+			return -EINVAL;
+		pos = 4;
+	} else {
+		return -EINVAL;
+	}
+
+	for (; pos < argc; ++pos) {
+		ret = __usbf_replay_option(cmd, args[pos]);
+		if (ret)
+			return ret;
+	}
+
+	return 1;
+}
+
+static int __usbf_replay_parse(struct usbf_replay *rp, const char *path)
+{
+	struct __usbf_replay_cmd *cmds;
+	char line[REPLAY_MAX_LINE];
+	size_t size;
+	FILE *file;
+	int ret = 0, alloc = 0;
+
+	file = fopen(path, "r");
+	if (!file)
+		return -errno;
+
+	rp->buf_size = 0;
+	while (fgets(line, sizeof(line), file)) {
+		if (rp->cmd_count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			cmds = realloc(rp->cmds, alloc * sizeof(*cmds));
+			if (!cmds) {
+				ret = -ENOMEM;
+				break;
+			}
+			rp->cmds = cmds;
+		}
+		ret = __usbf_replay_parse_line(rp, line,
+			&rp->cmds[rp->cmd_count]);
+		if (ret < 0) {
+			free(rp->cmds[rp->cmd_count].data);
+			break;
+		}
+		if (!ret)
+			continue;
+
+		size = rp->cmds[rp->cmd_count].length;
+		if (rp->cmds[rp->cmd_count].op == REPLAY_SETUP)
+			size = le16toh(rp->cmds[rp->cmd_count].setup.wLength);
+		if (size > rp->buf_size)
+			rp->buf_size = size;
+		++rp->cmd_count;
+		ret = 0;
+	}
+	fclose(file);
+
+	/* Room for ep0 request header and for detecting babble */
+	rp->buf_size += sizeof(struct __usbf_replay_request) + 1;
+
+	return ret;
+}
+
+static int __usbf_replay_step_cmp(const void *a, const void *b)
+{
+	const struct __usbf_replay_step *x = a, *y = b;
+
+	if (x->time_us != y->time_us)
+		return x->time_us < y->time_us ? -1 : 1;
+	/* Keep script order for simultaneous steps */
+	if (x->cmd != y->cmd)
+		return x->cmd < y->cmd ? -1 : 1;
+	return x->iteration < y->iteration ? -1 : x->iteration > y->iteration;
+}
+
+/* Repeated commands are interleaved with others, as host would do */
+static int __usbf_replay_timeline(struct usbf_replay *rp)
+{
+	struct __usbf_replay_cmd *cmd;
+	size_t n = 0;
+	uint32_t k;
+	int i;
+
+	for (i = 0; i < rp->cmd_count; ++i)
+		n += rp->cmds[i].count;
+	rp->steps = malloc(n * sizeof(*rp->steps));
+	if (n && !rp->steps)
+		return -ENOMEM;
+
+	for (i = 0; i < rp->cmd_count; ++i) {
+		cmd = &rp->cmds[i];
+		for (k = 0; k < cmd->count; ++k) {
+			rp->steps[rp->step_count].time_us =
+				cmd->time_us + k * cmd->period_us;
+			rp->steps[rp->step_count].cmd = i;
+			rp->steps[rp->step_count].iteration = k;
+			++rp->step_count;
+		}
+	}
+	qsort(rp->steps, n, sizeof(*rp->steps), __usbf_replay_step_cmp);
+
+	return 0;
+}
+
+static int __usbf_replay_poll(struct usbf_replay *rp, int fd, short events)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	do {
+		ret = poll(&pfd, 1, rp->timeout);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret > 0 ? 0 : -ETIMEDOUT;
+}
+
+static void __usbf_replay_latency(uint64_t latency, uint64_t *sum,
+	uint32_t *max)
+{
+	*sum += latency;
+	if (latency > *max)
+		*max = latency;
+}
+
+static void __usbf_replay_setup(struct usbf_replay *rp,
+	struct __usbf_replay_cmd *cmd)
+{
+	struct usb_functionfs_event event;
+	struct __usbf_replay_request *req = (void *)rp->buf;
+	uint8_t *data = rp->buf + sizeof(*req);
+	int in = cmd->setup.bRequestType & USB_DIR_IN;
+	struct iovec iov[2];
+	struct msghdr msg;
+	int32_t result;
+	uint64_t start;
+	ssize_t ret;
+	size_t length;
+
+	memset(&event, 0, sizeof(event));
+	event.u.setup = cmd->setup;
+	event.type = FUNCTIONFS_SETUP;
+	start = __usbf_replay_now();
+	if (send(rp->ep0, &event, sizeof(event), MSG_NOSIGNAL) < 0 ||
+	    __usbf_replay_poll(rp, rp->ep0, POLLIN)) {
+		++rp->stats.failures;
+		return;
+	}
+	ret = recv(rp->ep0, rp->buf, rp->buf_size, 0);
+	if (ret < (ssize_t)sizeof(*req)) {
+		++rp->stats.failures;
+		return;
+	}
+	__usbf_replay_latency(__usbf_replay_now() - start, &rp->setup_latency,
+		&rp->stats.setup_latency_max);
+	++rp->stats.setups;
+
+	memset(&msg, 0, sizeof(msg));
+	iov[0].iov_base = &result;
+	iov[0].iov_len = sizeof(result);
+	iov[1].iov_base = cmd->data;
+	iov[1].iov_len = 0;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	if (!req->in != !in) {
+		/* Reading ep0 for IN request or writing it for OUT one */
+		++rp->stats.stalls;
+		result = -EL2HLT;
+	} else if (in) {
+		length = ret - sizeof(*req);
+		if (cmd->data && (length != cmd->data_len ||
+				  memcmp(data, cmd->data, length)))
+			++rp->stats.failures;
+		result = length;
+	} else {
+		length = cmd->data_len < req->length ?
+			cmd->data_len : req->length;
+		iov[1].iov_len = length;
+		result = length;
+	}
+	sendmsg(rp->ep0, &msg, MSG_NOSIGNAL);
+}
+
+static void __usbf_replay_in(struct usbf_replay *rp,
+	struct __usbf_replay_cmd *cmd)
+{
+	int fd = rp->eps[cmd->ep - 1];
+	uint64_t start;
+	ssize_t ret;
+
+	start = __usbf_replay_now();
+	if (__usbf_replay_poll(rp, fd, POLLIN)) {
+		++rp->stats.failures;
+		return;
+	}
+	ret = recv(fd, rp->buf, rp->buf_size, MSG_TRUNC);
+	if (ret < 0) {
+		++rp->stats.failures;
+		return;
+	}
+	__usbf_replay_latency(__usbf_replay_now() - start, &rp->in_latency,
+		&rp->stats.in_latency_max);
+	++rp->stats.in_transfers;
+	rp->stats.in_bytes += ret;
+
+	/* More than host asked for is babble */
+	if ((size_t)ret > cmd->length ||
+	    (cmd->data && ((size_t)ret != cmd->data_len ||
+			   memcmp(rp->buf, cmd->data, ret))))
+		++rp->stats.failures;
+}
+
+static void __usbf_replay_out(struct usbf_replay *rp,
+	struct __usbf_replay_cmd *cmd, uint32_t iteration)
+{
+	int fd = rp->eps[cmd->ep - 1];
+	size_t i;
+
+	for (i = 0; i < cmd->length; ++i)
+		rp->buf[i] = cmd->data ? cmd->data[i % cmd->data_len] :
+			(uint8_t)(iteration + i);
+
+	if (__usbf_replay_poll(rp, fd, POLLOUT) ||
+	    send(fd, rp->buf, cmd->length, MSG_NOSIGNAL) < 0) {
+		++rp->stats.failures;
+		return;
+	}
+	++rp->stats.out_transfers;
+	rp->stats.out_bytes += cmd->length;
+}
+
+static void __usbf_replay_exec(struct usbf_replay *rp,
+	struct __usbf_replay_cmd *cmd, uint32_t iteration)
+{
+	struct usb_functionfs_event event;
+
+	switch (cmd->op) {
+	case REPLAY_EVENT:
+		memset(&event, 0, sizeof(event));
+		event.type = cmd->event;
+		if (send(rp->ep0, &event, sizeof(event), MSG_NOSIGNAL) < 0)
+			++rp->stats.failures;
+		break;
+	case REPLAY_SETUP:
+		__usbf_replay_setup(rp, cmd);
+		break;
+	case REPLAY_IN:
+		__usbf_replay_in(rp, cmd);
+		break;
+	case REPLAY_OUT:
+		__usbf_replay_out(rp, cmd, iteration);
+		break;
+	case REPLAY_TIMEOUT:
+		rp->timeout = cmd->length;
+		break;
+	}
+}
+
+static void *__usbf_replay_loop(void *arg)
+{
+	struct usbf_replay *rp = arg;
+	struct __usbf_replay_step *step;
+	struct timespec ts;
+	uint64_t start, at;
+	size_t i;
+
+	start = __usbf_replay_now();
+	for (i = 0; i < rp->step_count; ++i) {
+		if (__atomic_load_n(&rp->stopping, __ATOMIC_RELAXED))
+			break;
+		step = &rp->steps[i];
+		/* Late steps are run right away, as host would */
+		if (rp->speed > 0) {
+			at = start + step->time_us / rp->speed;
+			ts.tv_sec = at / 1000000;
+			ts.tv_nsec = (at % 1000000) * 1000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				NULL);
+		}
+		__usbf_replay_exec(rp, &rp->cmds[step->cmd], step->iteration);
+	}
+
+	rp->stats.duration_us = __usbf_replay_now() - start;
+	if (rp->stats.setups)
+		rp->stats.setup_latency_avg =
+			rp->setup_latency / rp->stats.setups;
+	if (rp->stats.in_transfers)
+		rp->stats.in_latency_avg =
+			rp->in_latency / rp->stats.in_transfers;
+
+	return NULL;
+}
+
+static void __usbf_replay_free(struct usbf_replay *rp)
+{
+	int i;
+
+	if (rp->ep0 >= 0)
+		close(rp->ep0);
+	for (i = 0; i < MAX_ENDPOINTS; ++i)
+		if (rp->eps[i] >= 0)
+			close(rp->eps[i]);
+	for (i = 0; i < rp->cmd_count; ++i)
+		free(rp->cmds[i].data);
+	free(rp->cmds);
+	free(rp->steps);
+	free(rp->buf);
+	free(rp);
+}
+
+/* Descriptors and strings function wrote to ep0 */
+static int __usbf_replay_check_descs(struct usbf_replay *rp)
+{
+	uint32_t magic[2], expected[2] = {
+		FUNCTIONFS_DESCRIPTORS_MAGIC_V2,
+		FUNCTIONFS_STRINGS_MAGIC,
+	};
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		if (recv(rp->ep0, &magic[i], sizeof(magic[i]),
+				MSG_DONTWAIT) != sizeof(magic[i]) ||
+		    le32toh(magic[i]) != expected[i])
+			return -EPROTO;
+	}
+
+	return 0;
+}
+
+struct usbf_replay *usbf_replay_start(struct usbf_function *func,
+	const char *script, double speed)
+{
+	struct usbf_replay *rp;
+	int files[MAX_ENDPOINTS + 1], sv[2], bufsize, ret, i;
+
+	rp = calloc(1, sizeof(*rp));
+	if (!rp)
+		return NULL;
+
+	rp->func = func;
+	rp->speed = speed;
+	rp->timeout = REPLAY_DEFAULT_TIMEOUT;
+	rp->ep0 = -1;
+	for (i = 0; i < MAX_ENDPOINTS; ++i)
+		rp->eps[i] = -1;
+
+	ret = __usbf_replay_parse(rp, script);
+	if (!ret)
+		ret = __usbf_replay_timeline(rp);
+	if (ret)
+		goto err;
+	ret = -ENOMEM;
+	rp->buf = malloc(rp->buf_size);
+	if (!rp->buf)
+		goto err;
+
+	for (i = 0; i <= func->ep_count; ++i) {
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+				sv) < 0) {
+			ret = -errno;
+			while (i--)
+				close(files[i]);
+			goto err;
+		}
+		/* Whole transfer has to fit in single message */
+		bufsize = rp->buf_size * 2;
+		setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &bufsize,
+			sizeof(bufsize));
+		setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &bufsize,
+			sizeof(bufsize));
+		files[i] = sv[0];
+		if (i)
+			rp->eps[i - 1] = sv[1];
+		else
+			rp->ep0 = sv[1];
+	}
+
+	func->replay = 1;
+	ret = __usbf_start(func, files);
+	if (ret < 0) {
+		func->replay = 0;
+		goto err;
+	}
+
+	ret = __usbf_replay_check_descs(rp);
+	if (ret)
+		goto err_stop;
+
+	ret = -pthread_create(&rp->thread, NULL, __usbf_replay_loop, rp);
+	if (ret)
+		goto err_stop;
+	rp->running = 1;
+
+	return rp;
+
+err_stop:
+	usbf_stop(func);
+	func->replay = 0;
+err:
+	__usbf_replay_free(rp);
+	errno = -ret;
+	return NULL;
+}
+
+int usbf_replay_wait(struct usbf_replay *rp, struct usbf_replay_stats *stats)
+{
+	if (rp->running) {
+		pthread_join(rp->thread, NULL);
+		rp->running = 0;
+	}
+	if (stats)
+		memcpy(stats, &rp->stats, sizeof(*stats));
+
+	return rp->stats.failures ? -EPROTO : 0;
+}
+
+void usbf_replay_delete(struct usbf_replay *rp)
+{
+	__atomic_store_n(&rp->stopping, 1, __ATOMIC_RELAXED);
+	usbf_replay_wait(rp, NULL);
+	rp->func->replay = 0;
+	__usbf_replay_free(rp);
+}
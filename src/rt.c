@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#define RT_DEFAULT_PRIORITY 80
+/* USB 2.0 high speed microframe */
+#define RT_DEFAULT_DEADLINE 125
+/* Locked along with buffer, so thread doesn't fault on its stack */
+#define RT_STACK_SIZE (256 * 1024)
+
+struct usbf_rt {
+	struct usbf_endpoint *ep;
+	struct usbf_rt_params params;
+	pthread_t thread;
+	void *buf;
+	void *stack;
+	size_t trailer;
+	int stopping;
+	int error;
+	/* Written by real-time thread only */
+	struct usbf_rt_stats stats;
+	uint64_t latency_sum;
+};
+
+static inline void __usbf_rt_inc(uint64_t *counter)
+{
+	__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t __usbf_rt_ns(const struct timespec *from,
+	const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000000ULL +
+		to->tv_nsec - from->tv_nsec;
+}
+
+static void __usbf_rt_record(struct usbf_rt *rt, uint64_t ns)
+{
+	struct usbf_rt_stats *stats = &rt->stats;
+	uint64_t us = ns / 1000;
+	uint32_t latency = ns > UINT32_MAX ? UINT32_MAX : ns;
+
+	if (us >= USBF_RT_HISTOGRAM_SIZE)
+		us = USBF_RT_HISTOGRAM_SIZE - 1;
+	__usbf_rt_inc(&stats->histogram[us]);
+	if (ns > rt->params.deadline_us * 1000ULL)
+		__usbf_rt_inc(&stats->misses);
+	if (!stats->latency_min_ns || latency < stats->latency_min_ns)
+		__atomic_store_n(&stats->latency_min_ns, latency,
+			__ATOMIC_RELAXED);
+	if (latency > stats->latency_max_ns)
+		__atomic_store_n(&stats->latency_max_ns, latency,
+			__ATOMIC_RELAXED);
+	__atomic_store_n(&rt->latency_sum, rt->latency_sum + ns,
+		__ATOMIC_RELAXED);
+}
+
+static void *__usbf_rt_loop(void *arg)
+{
+	struct usbf_rt *rt = arg;
+	struct usbf_endpoint *ep = rt->ep;
+	int in = ep->desc.direction == USBF_IN;
+	uint8_t trailer[USBF_INTEGRITY_TRAILER];
+	struct timespec armed, done;
+	struct iovec iov[2];
+	int ret, error, valid = 0;
+	unsigned int seq;
+
+	iov[0].iov_base = rt->buf;
+	iov[1].iov_base = trailer;
+	iov[1].iov_len = sizeof(trailer);
+	while (!__atomic_load_n(&rt->stopping, __ATOMIC_RELAXED)) {
+		/*
+		 * Cheap once enabled, single atomic load. Otherwise sleeps on
+		 * state change, so event thread gets to run meanwhile.
+		 */
+		ret = __usbf_wait_enabled(ep->func, STATE_WAIT_SLICE, &seq);
+		if (ret == -ETIMEDOUT)
+			continue;
+		if (ret) {
+			rt->error = ret;
+			break;
+		}
+
+		iov[0].iov_len = rt->params.size;
+		if (in) {
+			ret = rt->params.handler(rt->buf, rt->params.size,
+				rt->params.arg);
+			if (ret < 0) {
+				rt->error = ret;
+				break;
+			}
+			iov[0].iov_len = (size_t)ret < rt->params.size ?
+				(size_t)ret : rt->params.size;
+			if (rt->trailer)
+				__usbf_integrity_seal(rt->buf, iov[0].iov_len,
+					trailer);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &armed);
+		if (valid)
+			__usbf_rt_record(rt, __usbf_rt_ns(&done, &armed));
+		ret = __usbf_transfer_aio(ep, iov, rt->trailer ? 2 : 1, 0);
+		clock_gettime(CLOCK_MONOTONIC, &done);
+		valid = ret >= 0;
+
+		if (ret < 0) {
+			error = errno;
+			/*
+			 * Disabled under us, next wait sleeps until ENABLE.
+			 * Or cancelled by usbf_rt_stop().
+			 */
+			if (error == ESHUTDOWN)
+				__usbf_state_shutdown(ep->func, seq);
+			if (error == ESHUTDOWN || error == ECANCELED)
+				continue;
+			__usbf_capture_transfer(ep, NULL, -error);
+			__usbf_rt_inc(&rt->stats.errors);
+			if (ep->recovery_retries &&
+			    !__usbf_endpoint_recover(ep, error))
+				continue;
+			/* Don't spin on broken endpoint at real-time priority */
+			rt->error = -error;
+			break;
+		}
+
+		if (rt->trailer && in)
+			ret = ret < USBF_INTEGRITY_TRAILER ? 0 :
+				ret - USBF_INTEGRITY_TRAILER;
+		else if (rt->trailer)
+			ret = __usbf_integrity_check(rt->buf, rt->params.size,
+				trailer, ret);
+		__usbf_capture_transfer(ep, rt->buf, ret < 0 ? -errno : ret);
+		if (ret < 0) {
+			__usbf_rt_inc(&rt->stats.errors);
+			continue;
+		}
+		__usbf_rt_inc(&rt->stats.transfers);
+
+		if (!in) {
+			ret = rt->params.handler(rt->buf, ret, rt->params.arg);
+			if (ret < 0) {
+				rt->error = ret;
+				break;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void __usbf_rt_free(struct usbf_rt *rt)
+{
+	int error = errno;
+
+	/* Unlocking memory which isn't locked is harmless */
+	if (rt->buf)
+		munlock(rt->buf, rt->params.size + rt->trailer);
+	if (rt->stack)
+		munlock(rt->stack, RT_STACK_SIZE);
+	free(rt->buf);
+	free(rt->stack);
+	free(rt);
+	errno = error;
+}
+
+static int __usbf_rt_spawn(struct usbf_rt *rt, int realtime)
+{
+	struct sched_param param;
+	pthread_attr_t attr;
+	cpu_set_t cpuset;
+	int ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, rt->stack, RT_STACK_SIZE);
+	if (realtime) {
+		param.sched_priority = rt->params.priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	if (rt->params.cpu) {
+		CPU_ZERO(&cpuset);
+		CPU_SET(rt->params.cpu - 1, &cpuset);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+	}
+	ret = pthread_create(&rt->thread, &attr, __usbf_rt_loop, rt);
+	pthread_attr_destroy(&attr);
+
+	return ret;
+}
+
+struct usbf_rt *usbf_rt_start(struct usbf_endpoint *ep,
+	const struct usbf_rt_params *params)
+{
+	struct usbf_rt *rt;
+	long page;
+	int ret;
+
+	if (!params || !params->handler || !params->size ||
+	    ep->nonblock || ep->desc.type == USBF_ISOCHRONOUS ||
+	    params->priority < 0 ||
+	    params->priority > sched_get_priority_max(SCHED_FIFO) ||
+	    params->cpu < 0 || params->cpu > CPU_SETSIZE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	rt = calloc(1, sizeof(*rt));
+	if (!rt)
+		return NULL;
+
+	rt->ep = ep;
+	rt->params = *params;
+	if (!rt->params.priority)
+		rt->params.priority = RT_DEFAULT_PRIORITY;
+	if (!rt->params.deadline_us)
+		rt->params.deadline_us = RT_DEFAULT_DEADLINE;
+	rt->trailer = ep->integrity ? USBF_INTEGRITY_TRAILER : 0;
+
+	if (params->lock_all && mlockall(MCL_CURRENT | MCL_FUTURE) < 0 &&
+	    !params->best_effort)
+		goto err;
+
+	page = sysconf(_SC_PAGESIZE);
+	if (posix_memalign(&rt->buf, page, params->size + rt->trailer) ||
+	    posix_memalign(&rt->stack, page, RT_STACK_SIZE)) {
+		errno = ENOMEM;
+		goto err;
+	}
+	memset(rt->buf, 0, params->size + rt->trailer);
+
+	/* Faults pages in as well, nothing left to fault on real-time path */
+	if ((mlock(rt->buf, params->size + rt->trailer) < 0 ||
+	     mlock(rt->stack, RT_STACK_SIZE) < 0) && !params->best_effort)
+		goto err;
+
+	ret = __usbf_rt_spawn(rt, 1);
+	if (ret == EPERM && params->best_effort)
+		ret = __usbf_rt_spawn(rt, 0);
+	if (ret) {
+		errno = ret;
+		goto err;
+	}
+
+	return rt;
+
+err:
+	__usbf_rt_free(rt);
+	return NULL;
+}
+
+int usbf_rt_stop(struct usbf_rt *rt)
+{
+	int ret;
+
+	__atomic_store_n(&rt->stopping, 1, __ATOMIC_RELAXED);
+	__usbf_aio_cancel_join(rt->ep, rt->thread);
+
+	ret = rt->error;
+	__usbf_rt_free(rt);
+
+	return ret;
+}
+
+void usbf_rt_get_stats(struct usbf_rt *rt, struct usbf_rt_stats *stats)
+{
+	struct usbf_rt_stats *src = &rt->stats;
+	uint64_t sum, samples = 0;
+	int i;
+
+	for (i = 0; i < USBF_RT_HISTOGRAM_SIZE; ++i) {
+		stats->histogram[i] = __atomic_load_n(&src->histogram[i],
+			__ATOMIC_RELAXED);
+		samples += stats->histogram[i];
+	}
+	stats->transfers = __atomic_load_n(&src->transfers, __ATOMIC_RELAXED);
+	stats->errors = __atomic_load_n(&src->errors, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&src->misses, __ATOMIC_RELAXED);
+	stats->latency_min_ns = __atomic_load_n(&src->latency_min_ns,
+		__ATOMIC_RELAXED);
+	stats->latency_max_ns = __atomic_load_n(&src->latency_max_ns,
+		__ATOMIC_RELAXED);
+	sum = __atomic_load_n(&rt->latency_sum, __ATOMIC_RELAXED);
+	stats->latency_avg_ns = samples ? sum / samples : 0;
+}
@@ -0,0 +1,455 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define RUNTIME_MAX_EVENTS 16
+
+struct __usbf_runtime_shard {
+	struct usbf_runtime *rt;
+	pthread_t thread;
+	int cpu;
+	int epoll_fd;
+	int wake_fd;
+	pthread_mutex_t lock;
+	struct usbf_function *functions[RUNTIME_MAX_FUNCTIONS];
+	int func_count;
+	struct __usbf_busy_poll busy_poll;
+	struct epoll_event events[RUNTIME_MAX_EVENTS];
+	int event_count;
+};
+
+struct usbf_runtime {
+	struct __usbf_runtime_shard *shards;
+	int shard_count;
+	int running;
+	/* Serializes adding and removing functions across shards */
+	pthread_mutex_t lock;
+};
+
+static int __usbf_runtime_index(struct __usbf_runtime_shard *shard,
+	struct usbf_function *func)
+{
+	int i;
+
+	for (i = 0; i < shard->func_count; ++i)
+		if (shard->functions[i] == func)
+			return i;
+
+	return -1;
+}
+
+/* Endpoint of function on shard, ep itself might be gone already */
+static struct usbf_endpoint *__usbf_runtime_endpoint(
+	struct __usbf_runtime_shard *shard, void *ptr)
+{
+	struct usbf_function *func;
+	int i, j;
+
+	for (i = 0; i < shard->func_count; ++i) {
+		func = shard->functions[i];
+		for (j = 0; j < func->ep_count; ++j)
+			if (func->endpoints[j] == ptr)
+				return func->endpoints[j];
+	}
+
+	return NULL;
+}
+
+/* Non-blocking endpoints with handler are dispatched by runtime */
+static int __usbf_runtime_dispatched(struct usbf_endpoint *ep)
+{
+	return ep->nonblock && ep->handler && ep->event_fd >= 0;
+}
+
+static void __usbf_runtime_arm(struct __usbf_runtime_shard *shard,
+	struct usbf_function *func, int armed)
+{
+	struct epoll_event ev;
+
+	if (func->runtime_armed == armed)
+		return;
+
+	ev.events = armed ? EPOLLIN : 0;
+	ev.data.ptr = func;
+	epoll_ctl(shard->epoll_fd, EPOLL_CTL_MOD, func->ep0_file, &ev);
+	func->runtime_armed = armed;
+}
+
+static void __usbf_runtime_dispatch(struct __usbf_runtime_shard *shard,
+	struct usbf_function *func)
+{
+	int ret, handler_ret = 0;
+
+	/* Someone else is handling events right now */
+	if (pthread_mutex_trylock(&func->events_lock))
+		return;
+	/* Handler return codes are application's business, not ep0 state */
+	ret = __usbf_handle_events(func, &handler_ret);
+	pthread_mutex_unlock(&func->events_lock);
+	if (ret < 0 && ret != -EINTR && ret != -EAGAIN) {
+		/* ep0 is broken, stop spinning on it */
+		epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, func->ep0_file, NULL);
+		func->runtime_armed = -1;
+		return;
+	}
+
+	/* ep0 keeps polling readable while deferred setup is pending */
+	__usbf_runtime_arm(shard, func, __usbf_setup_time_left(func) < 0);
+}
+
+static void __usbf_runtime_dispatch_endpoint(struct usbf_endpoint *ep)
+{
+	/* Idle IN endpoint is always ready, report it once as wait does */
+	if (ep->desc.direction == USBF_IN)
+		__usbf_aio_signal(ep, 0);
+	ep->handler(ep, ep->handler_arg);
+}
+
+static int __usbf_runtime_timeout(struct __usbf_runtime_shard *shard)
+{
+	int i, left, timeout = -1;
+
+	for (i = 0; i < shard->func_count; ++i) {
+		if (shard->functions[i]->runtime_armed)
+			continue;
+		left = __usbf_setup_time_left(shard->functions[i]);
+		if (left < 0)
+			left = 0;
+		if (timeout < 0 || left < timeout)
+			timeout = left;
+	}
+
+	return timeout;
+}
+
+static int __usbf_runtime_epoll(void *arg, int timeout_ms)
+{
+	struct __usbf_runtime_shard *shard = arg;
+	int n;
+
+	n = epoll_wait(shard->epoll_fd, shard->events, RUNTIME_MAX_EVENTS,
+		timeout_ms);
+	if (n < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	shard->event_count = n;
+	return n;
+}
+
+static void *__usbf_runtime_loop(void *arg)
+{
+	struct __usbf_runtime_shard *shard = arg;
+	struct usbf_function *func;
+	struct usbf_endpoint *ep;
+	eventfd_t count;
+	void *ptr;
+	int i, n, timeout;
+
+	while (__atomic_load_n(&shard->rt->running, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&shard->lock);
+		timeout = __usbf_runtime_timeout(shard);
+		pthread_mutex_unlock(&shard->lock);
+
+		shard->event_count = 0;
+		n = __usbf_busy_poll_wait(&shard->busy_poll, timeout,
+			__usbf_runtime_epoll, shard);
+		if (n < 0)
+			break;
+
+		pthread_mutex_lock(&shard->lock);
+		for (i = 0; i < shard->event_count; ++i) {
+			ptr = shard->events[i].data.ptr;
+			if (!ptr) {
+				eventfd_read(shard->wake_fd, &count);
+				continue;
+			}
+			/*
+			 * ep0 of function or endpoint, either might have been
+			 * removed while we were waiting
+			 */
+			if (__usbf_runtime_index(shard, ptr) >= 0) {
+				__usbf_runtime_dispatch(shard, ptr);
+				continue;
+			}
+			ep = __usbf_runtime_endpoint(shard, ptr);
+			if (ep)
+				__usbf_runtime_dispatch_endpoint(ep);
+		}
+		/* Deferred setups completed or timed out */
+		for (i = 0; i < shard->func_count; ++i) {
+			func = shard->functions[i];
+			if (!func->runtime_armed)
+				__usbf_runtime_dispatch(shard, func);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	return NULL;
+}
+
+struct usbf_runtime *usbf_runtime_create(int threads)
+{
+	struct usbf_runtime *rt;
+	struct __usbf_runtime_shard *shard;
+	struct epoll_event ev;
+	int cpus[CPU_SETSIZE];
+	int cpu_count = 0, i;
+	cpu_set_t cpuset;
+
+	/* CPUs we are allowed to run on, not necessarily 0 .. n-1 */
+	if (!sched_getaffinity(0, sizeof(cpuset), &cpuset))
+		for (i = 0; i < CPU_SETSIZE; ++i)
+			if (CPU_ISSET(i, &cpuset))
+				cpus[cpu_count++] = i;
+	if (threads <= 0)
+		threads = cpu_count ? cpu_count : 1;
+
+	rt = malloc(sizeof(*rt));
+	if (!rt)
+		return NULL;
+
+	rt->shards = calloc(threads, sizeof(*rt->shards));
+	if (!rt->shards) {
+		free(rt);
+		return NULL;
+	}
+	rt->shard_count = threads;
+	rt->running = 0;
+	pthread_mutex_init(&rt->lock, NULL);
+
+	for (i = 0; i < threads; ++i) {
+		shard = &rt->shards[i];
+		shard->rt = rt;
+		/* Without affinity mask threads stay unpinned */
+		shard->cpu = cpu_count ? cpus[i % cpu_count] : -1;
+		shard->func_count = 0;
+		__usbf_busy_poll_init(&shard->busy_poll);
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (shard->wake_fd < 0 || shard->epoll_fd < 0)
+			goto err;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD,
+				shard->wake_fd, &ev) < 0)
+			goto err;
+	}
+
+	return rt;
+
+err:
+	rt->shard_count = i + 1;
+	usbf_runtime_delete(rt);
+	return NULL;
+}
+
+void usbf_runtime_delete(struct usbf_runtime *rt)
+{
+	struct __usbf_runtime_shard *shard;
+	int i;
+
+	usbf_runtime_stop(rt);
+
+	for (i = 0; i < rt->shard_count; ++i) {
+		shard = &rt->shards[i];
+		while (shard->func_count)
+			usbf_runtime_remove_function(rt, shard->functions[0]);
+		if (shard->epoll_fd >= 0)
+			close(shard->epoll_fd);
+		if (shard->wake_fd >= 0)
+			close(shard->wake_fd);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	pthread_mutex_destroy(&rt->lock);
+	free(rt->shards);
+	free(rt);
+}
+
+int usbf_runtime_add_function(struct usbf_runtime *rt,
+	struct usbf_function *func)
+{
+	struct __usbf_runtime_shard *shard;
+	struct usbf_endpoint *ep;
+	struct epoll_event ev;
+	int i, ret = 0;
+
+	/* Function has to be started, we need its ep0 */
+	if (func->ep0_file < 0)
+		return -EINVAL;
+
+	/* Shard loads don't change under us until function is placed */
+	pthread_mutex_lock(&rt->lock);
+	if (func->runtime_shard >= 0) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	/* Least loaded shard, all events of function stay there */
+	shard = &rt->shards[0];
+	for (i = 1; i < rt->shard_count; ++i)
+		if (rt->shards[i].func_count < shard->func_count)
+			shard = &rt->shards[i];
+	if (shard->func_count >= RUNTIME_MAX_FUNCTIONS) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	pthread_mutex_lock(&shard->lock);
+	ev.events = EPOLLIN;
+	ev.data.ptr = func;
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, func->ep0_file,
+			&ev) < 0) {
+		ret = -errno;
+		goto unlock;
+	}
+	for (i = 0; i < func->ep_count; ++i) {
+		ep = func->endpoints[i];
+		if (!__usbf_runtime_dispatched(ep))
+			continue;
+		ev.data.ptr = ep;
+		if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, ep->event_fd,
+				&ev) < 0) {
+			ret = -errno;
+			break;
+		}
+	}
+	if (ret) {
+		while (i--)
+			if (__usbf_runtime_dispatched(func->endpoints[i]))
+				epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL,
+					func->endpoints[i]->event_fd, NULL);
+		epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, func->ep0_file,
+			NULL);
+		goto unlock;
+	}
+	func->runtime_armed = 1;
+	func->runtime_shard = shard - rt->shards;
+	func->wake_fd = shard->wake_fd;
+	shard->functions[shard->func_count++] = func;
+unlock:
+	pthread_mutex_unlock(&shard->lock);
+out:
+	pthread_mutex_unlock(&rt->lock);
+
+	return ret;
+}
+
+int usbf_runtime_remove_function(struct usbf_runtime *rt,
+	struct usbf_function *func)
+{
+	struct __usbf_runtime_shard *shard;
+	int i, j;
+
+	pthread_mutex_lock(&rt->lock);
+	if (func->runtime_shard < 0 || func->runtime_shard >= rt->shard_count) {
+		pthread_mutex_unlock(&rt->lock);
+		return -EINVAL;
+	}
+
+	shard = &rt->shards[func->runtime_shard];
+	pthread_mutex_lock(&shard->lock);
+	i = __usbf_runtime_index(shard, func);
+	if (i >= 0) {
+		if (func->runtime_armed >= 0)
+			epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL,
+				func->ep0_file, NULL);
+		for (j = 0; j < func->ep_count; ++j)
+			if (__usbf_runtime_dispatched(func->endpoints[j]))
+				epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL,
+					func->endpoints[j]->event_fd, NULL);
+		shard->functions[i] = shard->functions[--shard->func_count];
+		func->runtime_shard = -1;
+		func->wake_fd = -1;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	pthread_mutex_unlock(&rt->lock);
+
+	return i < 0 ? -EINVAL : 0;
+}
+
+void usbf_runtime_set_busy_poll(struct usbf_runtime *rt,
+	const struct usbf_busy_poll_params *params)
+{
+	int i;
+
+	for (i = 0; i < rt->shard_count; ++i)
+		__usbf_busy_poll_set(&rt->shards[i].busy_poll, params);
+}
+
+int usbf_runtime_start(struct usbf_runtime *rt)
+{
+	struct __usbf_runtime_shard *shard;
+	cpu_set_t cpuset;
+	int i, ret;
+
+	if (rt->running)
+		return -EBUSY;
+	rt->running = 1;
+
+	for (i = 0; i < rt->shard_count; ++i) {
+		shard = &rt->shards[i];
+		ret = pthread_create(&shard->thread, NULL,
+			__usbf_runtime_loop, shard);
+		if (ret)
+			goto err;
+		if (shard->cpu < 0)
+			continue;
+		CPU_ZERO(&cpuset);
+		CPU_SET(shard->cpu, &cpuset);
+		/* Best effort, shard works unpinned as well */
+		pthread_setaffinity_np(shard->thread, sizeof(cpuset), &cpuset);
+	}
+
+	return 0;
+
+err:
+	__atomic_store_n(&rt->running, 0, __ATOMIC_RELEASE);
+	while (i--) {
+		eventfd_write(rt->shards[i].wake_fd, 1);
+		pthread_join(rt->shards[i].thread, NULL);
+	}
+	return -ret;
+}
+
+void usbf_runtime_stop(struct usbf_runtime *rt)
+{
+	int i;
+
+	if (!rt->running)
+		return;
+
+	__atomic_store_n(&rt->running, 0, __ATOMIC_RELEASE);
+	for (i = 0; i < rt->shard_count; ++i)
+		eventfd_write(rt->shards[i].wake_fd, 1);
+	for (i = 0; i < rt->shard_count; ++i)
+		pthread_join(rt->shards[i].thread, NULL);
+}
+
+void __usbf_runtime_notify(struct usbf_function *func)
+{
+	if (func->wake_fd >= 0)
+		eventfd_write(func->wake_fd, 1);
+}
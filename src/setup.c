@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+static inline uint64_t __usbf_setup_key(uint8_t bRequestType,
+	uint8_t bRequest, uint16_t wValue, uint16_t wIndex)
+{
+	return (uint64_t)bRequestType << 40 | (uint64_t)bRequest << 32 |
+		(uint64_t)wValue << 16 | wIndex;
+}
+
+static inline unsigned int __usbf_setup_hash(uint64_t key)
+{
+	/* Fibonacci hashing - top bits of the product are well mixed */
+	return (key * 0x9e3779b97f4a7c15ULL) >> (64 - SETUP_TABLE_BITS);
+}
+
+static struct __usbf_setup_entry **__usbf_setup_find(
+	struct usbf_function *func, uint64_t key)
+{
+	struct __usbf_setup_entry **pos;
+
+	pos = &func->setup_table[__usbf_setup_hash(key)];
+	while (*pos && (*pos)->key != key)
+		pos = &(*pos)->next;
+
+	return pos;
+}
+
+static int __usbf_setup_register(struct usbf_function *func, uint64_t key,
+	int (*handler)(const struct usbf_setup_request *),
+	const void *data, size_t length)
+{
+	struct __usbf_setup_entry **pos, *entry;
+
+	entry = malloc(sizeof(*entry));
+	if (!entry)
+		return -ENOMEM;
+
+	entry->key = key;
+	entry->handler = handler;
+	entry->length = length;
+	entry->data = NULL;
+	if (length) {
+		entry->data = malloc(length);
+		if (!entry->data) {
+			free(entry);
+			return -ENOMEM;
+		}
+		memcpy(entry->data, data, length);
+	}
+
+	pos = __usbf_setup_find(func, key);
+	if (*pos) {
+		/* Replace previous registration in place */
+		entry->next = (*pos)->next;
+		free((*pos)->data);
+		free(*pos);
+	} else {
+		entry->next = NULL;
+	}
+	*pos = entry;
+
+	return 0;
+}
+
+int usbf_register_setup_handler(struct usbf_function *func,
+	uint8_t bRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	int (*handler)(const struct usbf_setup_request *))
+{
+	if (!handler)
+		return -EINVAL;
+
+	return __usbf_setup_register(func,
+		__usbf_setup_key(bRequestType, bRequest, wValue, wIndex),
+		handler, NULL, 0);
+}
+
+int usbf_register_setup_response(struct usbf_function *func,
+	uint8_t bRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	const void *data, size_t length)
+{
+	if (!(bRequestType & USB_DIR_IN) && length)
+		return -EINVAL;
+	if (length > UINT16_MAX || (length && !data))
+		return -EINVAL;
+
+	return __usbf_setup_register(func,
+		__usbf_setup_key(bRequestType, bRequest, wValue, wIndex),
+		NULL, data, length);
+}
+
+int usbf_unregister_setup(struct usbf_function *func,
+	uint8_t bRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex)
+{
+	struct __usbf_setup_entry **pos, *entry;
+
+	pos = __usbf_setup_find(func,
+		__usbf_setup_key(bRequestType, bRequest, wValue, wIndex));
+	if (!*pos)
+		return -ENOENT;
+
+	entry = *pos;
+	*pos = entry->next;
+	free(entry->data);
+	free(entry);
+
+	return 0;
+}
+
+struct __usbf_setup_entry *__usbf_setup_lookup(struct usbf_function *func,
+	const struct usbf_setup_request *setup)
+{
+	return *__usbf_setup_find(func, __usbf_setup_key(setup->bRequestType,
+		setup->bRequest, setup->wValue, setup->wIndex));
+}
+
+/* Serves static response, entries with handler are called by caller */
+int __usbf_setup_dispatch(struct __usbf_setup_entry *entry,
+	const struct usbf_setup_request *setup)
+{
+	size_t length;
+	int ret;
+
+	if (!(setup->bRequestType & USB_DIR_IN))
+		ret = usbf_setup_ack(setup);
+	else {
+		length = entry->length < setup->wLength ?
+			entry->length : setup->wLength;
+		ret = usbf_setup_response(setup, entry->data, length);
+	}
+
+	return ret < 0 ? -errno : 0;
+}
+
+void __usbf_setup_table_free(struct usbf_function *func)
+{
+	struct __usbf_setup_entry *entry, *next;
+	int i;
+
+	for (i = 0; i < SETUP_TABLE_SIZE; ++i) {
+		for (entry = func->setup_table[i]; entry; entry = next) {
+			next = entry->next;
+			free(entry->data);
+			free(entry);
+		}
+		func->setup_table[i] = NULL;
+	}
+}
+
+int __usbf_ep0_io(struct usbf_function *func, int in,
+	void *data, size_t length)
+{
+	if (func->replay)
+		return __usbf_replay_ep0_io(func, in, data, length);
+
+	return in ? write(func->ep0_file, data, length) :
+		read(func->ep0_file, data, length);
+}
+
+static struct __usbf_setup_deferred **__usbf_setup_find_deferred(
+	struct usbf_function *func, const struct usbf_setup_request *setup)
+{
+	struct __usbf_setup_deferred **pos;
+
+	pos = &func->deferred;
+	while (*pos && &(*pos)->setup != setup)
+		pos = &(*pos)->next;
+
+	return pos;
+}
+
+const struct usbf_setup_request *
+usbf_setup_defer(const struct usbf_setup_request *setup)
+{
+	struct usbf_function *func = setup->function;
+	struct __usbf_setup_deferred *deferred;
+
+	deferred = malloc(sizeof(*deferred));
+	if (!deferred)
+		return NULL;
+
+	memcpy(&deferred->setup, setup, sizeof(*setup));
+	deferred->state = DEFERRED_PENDING;
+	__usbf_ms_from_now(&deferred->deadline, func->setup_timeout);
+
+	pthread_mutex_lock(&func->setup_lock);
+	if (func->setup_active) {
+		pthread_mutex_unlock(&func->setup_lock);
+		free(deferred);
+		return NULL;
+	}
+	deferred->next = func->deferred;
+	func->deferred = deferred;
+	func->setup_active = deferred;
+	pthread_mutex_unlock(&func->setup_lock);
+
+	return &deferred->setup;
+}
+
+int usbf_setup_time_left(const struct usbf_setup_request *setup)
+{
+	struct usbf_function *func = setup->function;
+	struct __usbf_setup_deferred *deferred;
+	long left = 0;
+
+	pthread_mutex_lock(&func->setup_lock);
+	deferred = *__usbf_setup_find_deferred(func, setup);
+	if (deferred && deferred->state == DEFERRED_PENDING) {
+		left = __usbf_ms_left(&deferred->deadline);
+		if (left < 0)
+			left = 0;
+	}
+	pthread_mutex_unlock(&func->setup_lock);
+
+	return left;
+}
+
+void usbf_setup_set_timeout(struct usbf_function *func, int timeout_ms)
+{
+	func->setup_timeout = timeout_ms > 0 ? timeout_ms :
+		SETUP_DEFAULT_TIMEOUT;
+}
+
+int __usbf_setup_complete(const struct usbf_setup_request *setup, int in,
+	void *data, size_t length)
+{
+	struct usbf_function *func = setup->function;
+	struct __usbf_setup_deferred **pos, *deferred;
+	int ret;
+
+	pthread_mutex_lock(&func->setup_lock);
+	pos = __usbf_setup_find_deferred(func, setup);
+	if (!*pos) {
+		/* Synchronous completion from setup handler */
+		pthread_mutex_unlock(&func->setup_lock);
+		return __usbf_ep0_io(func, in, data, length);
+	}
+
+	deferred = *pos;
+	if (deferred->state == DEFERRED_EXPIRED) {
+		*pos = deferred->next;
+		/* Timeout path is still stalling it, it frees it then */
+		if (func->setup_active != deferred)
+			free(deferred);
+		pthread_mutex_unlock(&func->setup_lock);
+		return -ETIMEDOUT;
+	}
+	/* ep0 stays blocked for everyone else until we're done */
+	deferred->state = DEFERRED_COMPLETING;
+	pthread_mutex_unlock(&func->setup_lock);
+
+	ret = __usbf_ep0_io(func, in, data, length);
+
+	pthread_mutex_lock(&func->setup_lock);
+	pos = __usbf_setup_find_deferred(func, setup);
+	*pos = deferred->next;
+	func->setup_active = NULL;
+	pthread_mutex_unlock(&func->setup_lock);
+	__usbf_runtime_notify(func);
+	free(deferred);
+
+	return ret;
+}
+
+int __usbf_setup_pending(struct usbf_function *func)
+{
+	struct __usbf_setup_deferred *active;
+	int pending = 0, stall = 0;
+
+	pthread_mutex_lock(&func->setup_lock);
+	active = func->setup_active;
+	if (active) {
+		pending = 1;
+		if (active->state == DEFERRED_PENDING &&
+		    __usbf_ms_left(&active->deadline) <= 0) {
+			active->state = DEFERRED_EXPIRED;
+			stall = 1;
+		}
+	}
+	pthread_mutex_unlock(&func->setup_lock);
+
+	if (!stall)
+		return pending;
+
+	/* Host has given up already, unblock ep0 */
+	__usbf_ep0_io(func, !(active->setup.bRequestType & USB_DIR_IN),
+		NULL, 0);
+
+	pthread_mutex_lock(&func->setup_lock);
+	func->setup_active = NULL;
+	/* Application completed it meanwhile, nobody else will free it */
+	if (!*__usbf_setup_find_deferred(func, &active->setup))
+		free(active);
+	pthread_mutex_unlock(&func->setup_lock);
+
+	return 0;
+}
+
+/* Time left for deferred setup FunctionFS waits for, -1 if there is none */
+int __usbf_setup_time_left(struct usbf_function *func)
+{
+	long left = -1;
+
+	pthread_mutex_lock(&func->setup_lock);
+	if (func->setup_active) {
+		left = __usbf_ms_left(&func->setup_active->deadline);
+		if (left < 0)
+			left = 0;
+	}
+	pthread_mutex_unlock(&func->setup_lock);
+
+	return left;
+}
+
+void __usbf_setup_deferred_free(struct usbf_function *func)
+{
+	struct __usbf_setup_deferred *deferred, *next;
+
+	/* Active one might be unlinked already, see __usbf_setup_pending() */
+	if (func->setup_active &&
+	    !*__usbf_setup_find_deferred(func, &func->setup_active->setup))
+		free(func->setup_active);
+	for (deferred = func->deferred; deferred; deferred = next) {
+		next = deferred->next;
+		free(deferred);
+	}
+	func->deferred = NULL;
+	func->setup_active = NULL;
+}
@@ -0,0 +1,582 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+/*
+ * Ring shared between process owning endpoint and its peer. Producer
+ * (peer for IN, owner for OUT) advances head, consumer advances tail,
+ * each side rings doorbell of the other one when it moves its index.
+ * Peer is not trusted, owner never reads layout back from shared memory.
+ */
+
+#define SHM_MAGIC 0x66627375	/* "usbf" */
+#define SHM_VERSION 1
+
+struct __usbf_shm_slot {
+	uint32_t length;
+	/* Negative errno of transfer done on slot */
+	int32_t status;
+};
+
+struct __usbf_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t direction;
+	uint32_t depth;
+	uint64_t size;
+	uint64_t stride;
+	uint64_t data_offset;
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	struct __usbf_shm_slot slots[] __attribute__((aligned(64)));
+};
+
+struct usbf_shm {
+	struct __usbf_shm_header *hdr;
+	size_t map_size;
+	uint8_t *data;
+	size_t size;
+	size_t stride;
+	uint32_t depth;
+	int in;
+	int memfd;
+	/* Rung by peer and by completed transfers */
+	int owner_fd;
+	/* Rung by owner */
+	int peer_fd;
+	/* Owner side only */
+	struct usbf_endpoint *ep;
+	struct __usbf_aio_req *reqs;
+	uint64_t submitted;
+	/* Index owner advances, tail for IN and head for OUT */
+	uint64_t retired;
+	/* Peer side only */
+	int acquired;
+};
+
+static size_t __usbf_shm_round(size_t value, size_t align)
+{
+	return (value + align - 1) / align * align;
+}
+
+static void __usbf_shm_free(struct usbf_shm *shm)
+{
+	if (shm->hdr)
+		munmap(shm->hdr, shm->map_size);
+	if (shm->memfd >= 0)
+		close(shm->memfd);
+	if (shm->owner_fd >= 0)
+		close(shm->owner_fd);
+	if (shm->peer_fd >= 0)
+		close(shm->peer_fd);
+	free(shm->reqs);
+	free(shm);
+}
+
+static struct usbf_shm *__usbf_shm_alloc(void)
+{
+	struct usbf_shm *shm;
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm)
+		return NULL;
+
+	shm->memfd = -1;
+	shm->owner_fd = -1;
+	shm->peer_fd = -1;
+
+	return shm;
+}
+
+struct usbf_shm *usbf_shm_create(struct usbf_endpoint *ep,
+	size_t size, int depth)
+{
+	struct __usbf_shm_header *hdr;
+	struct usbf_shm *shm;
+	size_t page, data_offset;
+
+	if (ep->nonblock || ep->desc.type == USBF_ISOCHRONOUS ||
+	    !size || size > UINT32_MAX || depth < 1 || depth > AIO_NR_EVENTS) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	shm = __usbf_shm_alloc();
+	if (!shm)
+		return NULL;
+
+	shm->ep = ep;
+	shm->in = ep->desc.direction == USBF_IN;
+	shm->size = size;
+	shm->depth = depth;
+	shm->reqs = calloc(depth, sizeof(*shm->reqs));
+	if (!shm->reqs)
+		goto err;
+
+	/* Room for integrity trailer behind each buffer */
+	page = sysconf(_SC_PAGESIZE);
+	shm->stride = __usbf_shm_round(size + USBF_INTEGRITY_TRAILER, page);
+	data_offset = __usbf_shm_round(offsetof(struct __usbf_shm_header,
+		slots) + depth * sizeof(struct __usbf_shm_slot), page);
+	shm->map_size = data_offset + depth * shm->stride;
+
+	shm->memfd = memfd_create("usbf-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (shm->memfd < 0)
+		goto err;
+	if (ftruncate(shm->memfd, shm->map_size) < 0)
+		goto err;
+	/* Peer can't shrink it under us and make us SIGBUS */
+	if (fcntl(shm->memfd, F_ADD_SEALS,
+			F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+		goto err;
+
+	hdr = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		shm->memfd, 0);
+	if (hdr == MAP_FAILED)
+		goto err;
+	shm->hdr = hdr;
+	shm->data = (uint8_t *)hdr + data_offset;
+
+	shm->owner_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	shm->peer_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (shm->owner_fd < 0 || shm->peer_fd < 0)
+		goto err;
+
+	hdr->magic = SHM_MAGIC;
+	hdr->version = SHM_VERSION;
+	hdr->direction = ep->desc.direction;
+	hdr->depth = depth;
+	hdr->size = size;
+	hdr->stride = shm->stride;
+	hdr->data_offset = data_offset;
+
+	return shm;
+
+err:
+	__usbf_shm_free(shm);
+	return NULL;
+}
+
+struct usbf_shm *usbf_shm_attach(const int fds[3])
+{
+	struct __usbf_shm_header *hdr;
+	struct usbf_shm *shm;
+	struct stat st;
+
+	if (fstat(fds[0], &st) < 0)
+		return NULL;
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	shm = __usbf_shm_alloc();
+	if (!shm)
+		return NULL;
+
+	shm->map_size = st.st_size;
+	hdr = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		fds[0], 0);
+	if (hdr == MAP_FAILED) {
+		__usbf_shm_free(shm);
+		return NULL;
+	}
+	shm->hdr = hdr;
+
+	if (hdr->magic != SHM_MAGIC || hdr->version != SHM_VERSION ||
+	    !hdr->depth || hdr->size > hdr->stride ||
+	    hdr->data_offset + hdr->depth * hdr->stride > shm->map_size) {
+		__usbf_shm_free(shm);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	shm->data = (uint8_t *)hdr + hdr->data_offset;
+	shm->size = hdr->size;
+	shm->stride = hdr->stride;
+	shm->depth = hdr->depth;
+	shm->in = hdr->direction == USBF_IN;
+	/* Descriptors are ours from now on */
+	shm->memfd = fds[0];
+	shm->owner_fd = fds[1];
+	shm->peer_fd = fds[2];
+
+	return shm;
+}
+
+void usbf_shm_get_fds(struct usbf_shm *shm, int fds[3])
+{
+	fds[0] = shm->memfd;
+	fds[1] = shm->owner_fd;
+	fds[2] = shm->peer_fd;
+}
+
+int usbf_shm_get_fd(struct usbf_shm *shm)
+{
+	return shm->ep ? shm->owner_fd : shm->peer_fd;
+}
+
+static inline uint8_t *__usbf_shm_buf(struct usbf_shm *shm, uint64_t index)
+{
+	return shm->data + (index % shm->depth) * shm->stride;
+}
+
+/* Called with aio_lock held */
+static void __usbf_shm_wait(struct usbf_shm *shm, struct __usbf_aio_req *req)
+{
+	struct usbf_endpoint *ep = shm->ep;
+
+	/* Context is gone with usbf_stop(), request won't complete anymore */
+	if (!req->done && ep->event_fd < 0) {
+		req->done = 1;
+		req->cancelled = ECANCELED;
+	}
+	if (!req->done)
+		__usbf_aio_wait(ep, req, NULL);
+	__usbf_aio_unlink(ep, req);
+}
+
+void usbf_shm_delete(struct usbf_shm *shm)
+{
+	struct usbf_endpoint *ep = shm->ep;
+
+	if (ep && shm->submitted != shm->retired) {
+		usbf_endpoint_cancel(ep);
+		pthread_mutex_lock(&ep->aio_lock);
+		while (shm->retired != shm->submitted)
+			__usbf_shm_wait(shm,
+				&shm->reqs[shm->retired++ % shm->depth]);
+		pthread_mutex_unlock(&ep->aio_lock);
+	}
+
+	__usbf_shm_free(shm);
+}
+
+/* Queues all buffers peer has filled (IN) or released (OUT) */
+static int __usbf_shm_submit(struct usbf_shm *shm)
+{
+	struct usbf_endpoint *ep = shm->ep;
+	struct __usbf_shm_header *hdr = shm->hdr;
+	struct __usbf_aio_req *req;
+	struct iocb *iocbp;
+	uint64_t limit, tail;
+	uint32_t index;
+	unsigned int seq;
+	size_t length;
+	uint8_t *buf;
+	int ret;
+
+	if (shm->in) {
+		limit = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		if (limit - shm->retired > shm->depth)
+			return -EPROTO;
+	} else {
+		tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+		if (shm->retired - tail > shm->depth)
+			return -EPROTO;
+		limit = tail + shm->depth;
+	}
+	/* Peer can't take back what it has handed over */
+	if (limit < shm->submitted)
+		return -EPROTO;
+
+	if (shm->submitted == limit)
+		return 0;
+	if (__usbf_wait_enabled(ep->func, 0, &seq))
+		return -ESHUTDOWN;
+
+	while (shm->submitted != limit) {
+		index = shm->submitted % shm->depth;
+		req = &shm->reqs[index];
+		buf = __usbf_shm_buf(shm, shm->submitted);
+		if (shm->in) {
+			length = __atomic_load_n(&hdr->slots[index].length,
+				__ATOMIC_RELAXED);
+			if (length > shm->size)
+				length = shm->size;
+			if (ep->integrity) {
+				__usbf_integrity_seal(buf, length, buf + length);
+				length += USBF_INTEGRITY_TRAILER;
+			}
+		} else {
+			length = shm->size;
+			if (ep->integrity)
+				length += USBF_INTEGRITY_TRAILER;
+		}
+
+		__usbf_aio_prep(ep, &req->iocb, buf, length, req);
+		req->iocb.aio_resfd = shm->owner_fd;
+		req->detached = 1;
+		req->seq = seq;
+		__usbf_aio_link(ep, req);
+		iocbp = &req->iocb;
+		ret = __usbf_aio_submit(ep, &iocbp, 1);
+		if (ret < 0) {
+			pthread_mutex_lock(&ep->aio_lock);
+			__usbf_aio_unlink(ep, req);
+			pthread_mutex_unlock(&ep->aio_lock);
+			return ret;
+		}
+		++shm->submitted;
+	}
+
+	return 0;
+}
+
+/*
+ * Hands completed buffers over to peer in order. Sets restart if endpoint
+ * was disabled, then all requests behind failed one fail as well.
+ */
+static int __usbf_shm_retire(struct usbf_shm *shm, int *restart)
+{
+	struct usbf_endpoint *ep = shm->ep;
+	struct __usbf_shm_slot *slot;
+	struct __usbf_aio_req *req;
+	uint8_t trailer[USBF_INTEGRITY_TRAILER];
+	uint32_t index;
+	long result;
+	int count = 0;
+
+	pthread_mutex_lock(&ep->aio_lock);
+	__usbf_aio_poll(ep);
+	while (shm->retired != shm->submitted) {
+		index = shm->retired % shm->depth;
+		req = &shm->reqs[index];
+		if (!req->done && ep->event_fd < 0) {
+			req->done = 1;
+			req->cancelled = ECANCELED;
+		}
+		if (!req->done)
+			break;
+		result = req->cancelled ? -req->cancelled : req->result;
+		if (result == -ESHUTDOWN) {
+			__usbf_state_shutdown(ep->func, req->seq);
+			*restart = 1;
+			break;
+		}
+		__usbf_aio_unlink(ep, req);
+
+		slot = &shm->hdr->slots[index];
+		if (!shm->in && result >= 0 && ep->integrity) {
+			result = __usbf_integrity_check(__usbf_shm_buf(shm,
+				shm->retired), result, trailer, result);
+			if (result < 0)
+				result = -errno;
+		}
+		__usbf_capture_transfer(ep, __usbf_shm_buf(shm, shm->retired),
+			shm->in && result >= USBF_INTEGRITY_TRAILER &&
+			ep->integrity ?
+			result - USBF_INTEGRITY_TRAILER : result);
+		if (!shm->in)
+			slot->length = result < 0 ? 0 : result;
+		slot->status = result < 0 ? result : 0;
+		++shm->retired;
+		++count;
+	}
+	pthread_mutex_unlock(&ep->aio_lock);
+
+	if (count) {
+		__atomic_store_n(shm->in ? &shm->hdr->tail : &shm->hdr->head,
+			shm->retired, __ATOMIC_RELEASE);
+		eventfd_write(shm->peer_fd, 1);
+	}
+
+	return count;
+}
+
+static void __usbf_shm_restart(struct usbf_shm *shm)
+{
+	struct usbf_endpoint *ep = shm->ep;
+	uint64_t i;
+
+	pthread_mutex_lock(&ep->aio_lock);
+	for (i = shm->retired; i != shm->submitted; ++i)
+		__usbf_shm_wait(shm, &shm->reqs[i % shm->depth]);
+	pthread_mutex_unlock(&ep->aio_lock);
+
+	shm->submitted = shm->retired;
+}
+
+int usbf_shm_process(struct usbf_shm *shm, int timeout_ms)
+{
+	struct timespec deadline;
+	struct pollfd pfd;
+	eventfd_t value;
+	int ret, restart, count = 0;
+	long left = -1;
+
+	if (!shm->ep)
+		return -EINVAL;
+
+	if (timeout_ms > 0)
+		__usbf_ms_from_now(&deadline, timeout_ms);
+
+	pfd.fd = shm->owner_fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		/* Consume doorbell before looking at ring, so none gets lost */
+		eventfd_read(shm->owner_fd, &value);
+
+		restart = 0;
+		count += __usbf_shm_retire(shm, &restart);
+		if (restart)
+			__usbf_shm_restart(shm);
+
+		if (timeout_ms > 0) {
+			left = __usbf_ms_left(&deadline);
+			if (left < 0)
+				left = 0;
+		} else if (!timeout_ms) {
+			left = 0;
+		}
+
+		ret = __usbf_shm_submit(shm);
+		if (ret == -ESHUTDOWN) {
+			ret = usbf_wait_enabled(shm->ep->func, left);
+			if (!ret)
+				continue;
+		}
+		if (ret == -ETIMEDOUT)
+			return count;
+		if (ret < 0)
+			return ret;
+
+		if (count || !left)
+			return count;
+
+		if (poll(&pfd, 1, left) < 0 && errno != EINTR)
+			return -errno;
+		if (timeout_ms > 0 && __usbf_ms_left(&deadline) <= 0)
+			timeout_ms = 0;
+	}
+}
+
+/* Peer waits until owner moves index it's interested in */
+static int __usbf_shm_peer_wait(struct usbf_shm *shm, uint64_t *index,
+	const struct timespec *deadline)
+{
+	struct __usbf_shm_header *hdr = shm->hdr;
+	struct pollfd pfd;
+	eventfd_t value;
+	uint64_t head, tail;
+	long left = -1;
+
+	pfd.fd = shm->peer_fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+		if (shm->in && head - tail < shm->depth) {
+			*index = head;
+			return 0;
+		}
+		if (!shm->in && head != tail) {
+			*index = tail;
+			return 0;
+		}
+
+		if (deadline) {
+			left = __usbf_ms_left(deadline);
+			if (left <= 0)
+				return -ETIMEDOUT;
+		}
+		if (poll(&pfd, 1, left) < 0 && errno != EINTR)
+			return -errno;
+		eventfd_read(shm->peer_fd, &value);
+	}
+}
+
+void *usbf_shm_acquire(struct usbf_shm *shm, size_t *length, int timeout_ms)
+{
+	struct __usbf_shm_slot *slot;
+	struct timespec deadline;
+	uint64_t index = 0;
+	int ret, status;
+
+	if (shm->ep || shm->acquired) {
+		errno = shm->ep ? EINVAL : EBUSY;
+		return NULL;
+	}
+
+	if (timeout_ms > 0)
+		__usbf_ms_from_now(&deadline, timeout_ms);
+
+	ret = __usbf_shm_peer_wait(shm, &index, timeout_ms > 0 ?
+		&deadline : NULL);
+	if (ret) {
+		errno = -ret;
+		return NULL;
+	}
+
+	slot = &shm->hdr->slots[index % shm->depth];
+	status = slot->status;
+	if (status < 0) {
+		/* Report failure once, buffer stays usable */
+		slot->status = 0;
+		if (!shm->in) {
+			__atomic_store_n(&shm->hdr->tail, index + 1,
+				__ATOMIC_RELEASE);
+			eventfd_write(shm->owner_fd, 1);
+		}
+		errno = -status;
+		return NULL;
+	}
+
+	*length = shm->in ? shm->size : slot->length;
+	if (*length > shm->size)
+		*length = shm->size;
+	shm->acquired = 1;
+
+	return __usbf_shm_buf(shm, index);
+}
+
+int usbf_shm_commit(struct usbf_shm *shm, size_t length)
+{
+	struct __usbf_shm_header *hdr = shm->hdr;
+	uint64_t index;
+
+	if (!shm->acquired)
+		return -EINVAL;
+
+	if (shm->in) {
+		if (length > shm->size)
+			return -EINVAL;
+		index = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+		hdr->slots[index % shm->depth].length = length;
+		__atomic_store_n(&hdr->head, index + 1, __ATOMIC_RELEASE);
+	} else {
+		index = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+		__atomic_store_n(&hdr->tail, index + 1, __ATOMIC_RELEASE);
+	}
+	shm->acquired = 0;
+	eventfd_write(shm->owner_fd, 1);
+
+	return 0;
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+
+void __usbf_splice_init(struct usbf_endpoint *ep)
+{
+	ep->splice_pipe[0] = -1;
+	ep->splice_pipe[1] = -1;
+	ep->splice_pending = 0;
+	ep->splice_carry = 0;
+	ep->splice_zlp = 0;
+	ep->splice_support = -1;
+}
+
+void __usbf_splice_destroy(struct usbf_endpoint *ep)
+{
+	if (ep->splice_pipe[0] >= 0) {
+		close(ep->splice_pipe[0]);
+		close(ep->splice_pipe[1]);
+	}
+	__usbf_splice_init(ep);
+}
+
+/* Returns how much pipe holds, after trying to grow it to length */
+static int __usbf_splice_pipe(struct usbf_endpoint *ep, size_t length)
+{
+	int size, ret;
+
+	if (ep->splice_pipe[0] < 0 && pipe2(ep->splice_pipe, O_CLOEXEC) < 0)
+		return -errno;
+
+	size = fcntl(ep->splice_pipe[0], F_GETPIPE_SZ);
+	if (size < 0)
+		return -errno;
+	if ((size_t)size < length) {
+		ret = fcntl(ep->splice_pipe[0], F_SETPIPE_SZ,
+			length < INT_MAX ? (int)length : INT_MAX);
+		/* Over pipe-max-size we make do with what we have */
+		if (ret > 0)
+			size = ret;
+	}
+
+	return size;
+}
+
+/*
+ * FunctionFS files got splice support only with some kernels. Unsupported
+ * splice fails with EINVAL before touching data, but for IN we have to
+ * know before data is taken from fd. Pipe is empty then, so supported
+ * non-blocking splice fails with EAGAIN.
+ */
+static int __usbf_splice_probe(struct usbf_endpoint *ep)
+{
+	ssize_t ret;
+
+	if (ep->splice_support < 0 && ep->desc.direction == USBF_IN) {
+		ret = splice(ep->splice_pipe[0], NULL, ep->epfile, NULL, 1,
+			SPLICE_F_NONBLOCK);
+		ep->splice_support = !(ret < 0 && errno == EINVAL);
+	}
+
+	return ep->splice_support;
+}
+
+static int __usbf_splice_readable(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/* Sends pending data but carried byte, then ZLP if one is owed */
+static int __usbf_splice_send(struct usbf_endpoint *ep)
+{
+	unsigned int seq;
+	ssize_t ret;
+
+	while (ep->splice_pending > (size_t)ep->splice_carry ||
+			ep->splice_zlp) {
+		ret = __usbf_wait_enabled(ep->func, -1, &seq);
+		if (ret)
+			return ret;
+
+		if (ep->splice_pending > (size_t)ep->splice_carry)
+			ret = splice(ep->splice_pipe[0], NULL, ep->epfile,
+				NULL, ep->splice_pending - ep->splice_carry,
+				SPLICE_F_MOVE);
+		else
+			ret = write(ep->epfile, NULL, 0);
+		if (ret < 0) {
+			/* Endpoint was disabled under us, retry after ENABLE */
+			if (errno == ESHUTDOWN) {
+				__usbf_state_shutdown(ep->func, seq);
+				continue;
+			}
+			return -errno;
+		}
+		if (ep->splice_pending > (size_t)ep->splice_carry)
+			ep->splice_pending -= ret;
+		else
+			ep->splice_zlp = 0;
+	}
+
+	return 0;
+}
+
+static int __usbf_splice_in(struct usbf_endpoint *ep, int fd, size_t length)
+{
+	struct usbf_endpoint_info info;
+	size_t moved;
+	ssize_t ret;
+
+	/* Finish transfer interrupted by signal before taking more */
+	if (ep->splice_pending > (size_t)ep->splice_carry || ep->splice_zlp) {
+		moved = ep->splice_pending - ep->splice_carry;
+		ret = __usbf_splice_send(ep);
+		return ret ? ret : (int)moved;
+	}
+
+	/* Carried byte is already in pipe, it opens this transfer */
+	ret = splice(fd, NULL, ep->splice_pipe[1], NULL,
+		length - ep->splice_carry, SPLICE_F_MOVE);
+	if (ret < 0)
+		return -errno;
+	if (!ret && !ep->splice_carry)
+		return 0;
+	ep->splice_pending += ret;
+	ep->splice_carry = 0;
+
+	if (usbf_endpoint_get_info(ep, &info))
+		info.maxpacketsize = 0;
+
+	/*
+	 * Transfer of whole packets isn't over for host until short one
+	 * comes. If fd has more, last byte waits in pipe and opens next
+	 * transfer, else we owe host zero length packet.
+	 */
+	if (ret && info.maxpacketsize > 1 &&
+			ep->splice_pending % info.maxpacketsize == 0) {
+		if (ep->splice_pending > 1 && __usbf_splice_readable(fd))
+			ep->splice_carry = 1;
+		else
+			ep->splice_zlp = 1;
+	}
+
+	moved = ep->splice_pending - ep->splice_carry;
+	ret = __usbf_splice_send(ep);
+
+	return ret ? ret : (int)moved;
+}
+
+static int __usbf_splice_out(struct usbf_endpoint *ep, int fd, size_t length)
+{
+	ssize_t ret, received;
+	unsigned int seq;
+	size_t left;
+
+	for (;;) {
+		ret = __usbf_wait_enabled(ep->func, -1, &seq);
+		if (ret)
+			return ret;
+
+		received = splice(ep->epfile, NULL, ep->splice_pipe[1], NULL,
+			length, SPLICE_F_MOVE);
+		if (received >= 0)
+			break;
+		if (errno == ESHUTDOWN) {
+			__usbf_state_shutdown(ep->func, seq);
+			continue;
+		}
+		if (errno == EINVAL)
+			ep->splice_support = 0;
+		return -errno;
+	}
+	ep->splice_support = 1;
+
+	for (left = received; left; left -= ret) {
+		ret = splice(ep->splice_pipe[0], NULL, fd, NULL, left,
+			SPLICE_F_MOVE);
+		if (ret < 0 && errno == EINTR) {
+			ret = 0;
+			continue;
+		}
+		if (ret <= 0) {
+			ret = ret < 0 ? -errno : -EPIPE;
+			/* Don't let rest of transfer leak to next fd */
+			__usbf_splice_destroy(ep);
+			ep->splice_support = 1;
+			return ret;
+		}
+	}
+
+	return received;
+}
+
+void usbf_splice_reset(struct usbf_endpoint *ep)
+{
+	int support = ep->splice_support;
+
+	/* Closing pipe drops whatever it holds */
+	__usbf_splice_destroy(ep);
+	ep->splice_support = support;
+}
+
+int usbf_splice(struct usbf_endpoint *ep, int fd, size_t length)
+{
+	int size;
+
+	if (ep->nonblock || ep->integrity != USBF_INTEGRITY_NONE)
+		return -EINVAL;
+
+	size = __usbf_splice_pipe(ep, length);
+	if (size < 0)
+		return size;
+	if (length > (size_t)size)
+		length = size;
+
+	if (!__usbf_splice_probe(ep))
+		return -EINVAL;
+
+	return ep->desc.direction == USBF_IN ?
+		__usbf_splice_in(ep, fd, length) :
+		__usbf_splice_out(ep, fd, length);
+}
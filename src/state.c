@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <errno.h>
+#include <sys/poll.h>
+
+void __usbf_state_init(struct usbf_function *func)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&func->state_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&func->state_lock, NULL);
+	pthread_mutex_init(&func->events_lock, NULL);
+	func->state = USBF_STATE_STOPPED;
+	func->suspended_state = USBF_STATE_STOPPED;
+	func->enable_seq = 0;
+	func->enabled_seq = 0;
+}
+
+void __usbf_state_destroy(struct usbf_function *func)
+{
+	pthread_cond_destroy(&func->state_cond);
+	pthread_mutex_destroy(&func->state_lock);
+	pthread_mutex_destroy(&func->events_lock);
+}
+
+/* Called with state_lock held after state changes */
+static void __usbf_state_publish(struct usbf_function *func)
+{
+	__atomic_store_n(&func->enabled_seq,
+		func->state == USBF_STATE_ENABLED ? func->enable_seq : 0,
+		__ATOMIC_RELEASE);
+}
+
+void __usbf_state_set(struct usbf_function *func, enum usbf_state state)
+{
+	pthread_mutex_lock(&func->state_lock);
+	if (state == USBF_STATE_STOPPED)
+		__usbf_endpoints_disable(func);
+	func->state = state;
+	__usbf_state_publish(func);
+	pthread_cond_broadcast(&func->state_cond);
+	pthread_mutex_unlock(&func->state_lock);
+}
+
+void __usbf_state_event(struct usbf_function *func,
+	enum usbf_event_type event)
+{
+	pthread_mutex_lock(&func->state_lock);
+	switch (event) {
+	case USBF_EVENT_BIND:
+		func->state = USBF_STATE_BOUND;
+		break;
+	case USBF_EVENT_DISABLE:
+		__usbf_endpoints_disable(func);
+		func->state = USBF_STATE_BOUND;
+		break;
+	case USBF_EVENT_UNBIND:
+		__usbf_endpoints_disable(func);
+		func->state = USBF_STATE_UNBOUND;
+		break;
+	case USBF_EVENT_ENABLE:
+		__usbf_endpoints_enable(func);
+		func->state = USBF_STATE_ENABLED;
+		if (!++func->enable_seq)
+			++func->enable_seq;
+		break;
+	case USBF_EVENT_SUSPEND:
+		if (func->state != USBF_STATE_SUSPENDED) {
+			func->suspended_state = func->state;
+			func->state = USBF_STATE_SUSPENDED;
+		}
+		break;
+	case USBF_EVENT_RESUME:
+		if (func->state == USBF_STATE_SUSPENDED)
+			func->state = func->suspended_state;
+		break;
+	default:
+		break;
+	}
+	__usbf_state_publish(func);
+	pthread_cond_broadcast(&func->state_cond);
+	pthread_mutex_unlock(&func->state_lock);
+}
+
+enum usbf_state usbf_get_state(struct usbf_function *func)
+{
+	enum usbf_state state;
+
+	pthread_mutex_lock(&func->state_lock);
+	state = func->state;
+	pthread_mutex_unlock(&func->state_lock);
+
+	return state;
+}
+
+void __usbf_state_shutdown(struct usbf_function *func, unsigned int seq)
+{
+	enum usbf_state *state;
+
+	pthread_mutex_lock(&func->state_lock);
+	state = func->state == USBF_STATE_SUSPENDED ?
+		&func->suspended_state : &func->state;
+	/*
+	 * Endpoint is disabled before DISABLE gets to ep0, don't let waiters
+	 * take stale state for new connection and resubmit right away.
+	 */
+	if (*state == USBF_STATE_ENABLED && func->enable_seq == seq) {
+		__usbf_endpoints_disable(func);
+		*state = USBF_STATE_BOUND;
+		__usbf_state_publish(func);
+		pthread_cond_broadcast(&func->state_cond);
+	}
+	pthread_mutex_unlock(&func->state_lock);
+}
+
+void __usbf_events_claim(struct usbf_function *func)
+{
+	pthread_t self = pthread_self();
+
+	pthread_mutex_lock(&func->state_lock);
+	if (!func->events_owned || !pthread_equal(func->events_thread, self)) {
+		func->events_thread = self;
+		func->events_owned = 1;
+	}
+	pthread_mutex_unlock(&func->state_lock);
+}
+
+/* Only thread which handles events anyway may do it while waiting */
+static int __usbf_events_owner(struct usbf_function *func)
+{
+	return func->runtime_shard < 0 && func->events_owned &&
+		pthread_equal(func->events_thread, pthread_self());
+}
+
+int __usbf_wait_enabled(struct usbf_function *func, int timeout_ms,
+	unsigned int *seq)
+{
+	struct timespec deadline, slice_end;
+	struct pollfd pfd;
+	unsigned int enabled;
+	long slice;
+	int ret = 0, handler_ret;
+
+	/* Real-time loops come by before every transfer, no lock for them */
+	enabled = __atomic_load_n(&func->enabled_seq, __ATOMIC_ACQUIRE);
+	if (enabled) {
+		if (seq)
+			*seq = enabled;
+		return 0;
+	}
+
+	if (timeout_ms >= 0)
+		__usbf_ms_from_now(&deadline, timeout_ms);
+
+	pthread_mutex_lock(&func->state_lock);
+	while (func->state != USBF_STATE_ENABLED) {
+		if (func->state == USBF_STATE_STOPPED) {
+			ret = -ESHUTDOWN;
+			break;
+		}
+
+		slice = STATE_WAIT_SLICE;
+		if (timeout_ms >= 0) {
+			slice = __usbf_ms_left(&deadline);
+			if (slice <= 0) {
+				ret = -ETIMEDOUT;
+				break;
+			}
+			if (slice > STATE_WAIT_SLICE)
+				slice = STATE_WAIT_SLICE;
+		}
+
+		/*
+		 * Waiting on ourselves would never end, handle events here.
+		 * Handler return codes are the application's business, they
+		 * don't end the wait.
+		 */
+		if (__usbf_events_owner(func) &&
+		    __usbf_setup_time_left(func) < 0 &&
+		    !pthread_mutex_trylock(&func->events_lock)) {
+			pthread_mutex_unlock(&func->state_lock);
+			pfd.fd = func->ep0_file;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, slice) > 0)
+				ret = __usbf_handle_events(func,
+					&handler_ret);
+			pthread_mutex_unlock(&func->events_lock);
+			pthread_mutex_lock(&func->state_lock);
+			if (ret < 0)
+				break;
+			continue;
+		}
+
+		/* Deferred setup blocks ep0, take care of its timeout */
+		if (__usbf_events_owner(func))
+			__usbf_setup_pending(func);
+
+		__usbf_ms_from_now(&slice_end, slice);
+		pthread_cond_timedwait(&func->state_cond, &func->state_lock,
+			&slice_end);
+	}
+	if (!ret && seq)
+		*seq = func->enable_seq;
+	pthread_mutex_unlock(&func->state_lock);
+
+	return ret;
+}
+
+int usbf_wait_enabled(struct usbf_function *func, int timeout_ms)
+{
+	return __usbf_wait_enabled(func, timeout_ms, NULL);
+}
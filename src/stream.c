@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "libusbf_private.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+enum __usbf_slot_state {
+	SLOT_FREE,
+	SLOT_INFLIGHT,
+	/* Handed out to application */
+	SLOT_ACQUIRED,
+};
+
+struct __usbf_stream_slot {
+	struct __usbf_aio_req req;
+	enum __usbf_slot_state state;
+	void *buf;
+	size_t length;
+	struct timespec start;
+};
+
+struct usbf_stream {
+	struct usbf_endpoint *ep;
+	size_t size;
+	size_t trailer;
+	int depth;
+	/* Oldest slot, handed out next */
+	int head;
+	/* Connection seen by last wait for ENABLE */
+	unsigned int seq;
+	struct __usbf_stream_slot *slots;
+};
+
+struct usbf_stream *usbf_stream_create(struct usbf_endpoint *ep,
+	size_t size, int depth)
+{
+	struct usbf_stream *st;
+	long page;
+	int i;
+
+	if (ep->nonblock || ep->desc.type == USBF_ISOCHRONOUS ||
+	    !size || depth < 1 || depth > AIO_NR_EVENTS) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return NULL;
+
+	st->slots = calloc(depth, sizeof(*st->slots));
+	if (!st->slots) {
+		free(st);
+		return NULL;
+	}
+
+	st->ep = ep;
+	st->size = size;
+	st->trailer = ep->integrity ? USBF_INTEGRITY_TRAILER : 0;
+	st->depth = depth;
+
+	/* Page aligned, so UDC can DMA straight from/to them */
+	page = sysconf(_SC_PAGESIZE);
+	for (i = 0; i < depth; ++i) {
+		if (posix_memalign(&st->slots[i].buf, page,
+				size + st->trailer)) {
+			usbf_stream_delete(st);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	return st;
+}
+
+/* Called with aio_lock held */
+static int __usbf_stream_wait(struct usbf_stream *st,
+	struct __usbf_stream_slot *slot, const struct timespec *deadline)
+{
+	struct usbf_endpoint *ep = st->ep;
+	int ret = 0;
+
+	/* Context is gone with usbf_stop(), request won't complete anymore */
+	if (!slot->req.done && ep->event_fd < 0) {
+		slot->req.done = 1;
+		slot->req.cancelled = ECANCELED;
+	}
+	if (!slot->req.done)
+		ret = __usbf_aio_wait(ep, &slot->req, deadline);
+	if (!ret)
+		__usbf_aio_unlink(ep, &slot->req);
+
+	return ret;
+}
+
+void usbf_stream_delete(struct usbf_stream *st)
+{
+	struct usbf_endpoint *ep = st->ep;
+	struct __usbf_stream_slot *slot;
+	int i;
+
+	usbf_endpoint_cancel(ep);
+	pthread_mutex_lock(&ep->aio_lock);
+	for (i = 0; i < st->depth; ++i) {
+		slot = &st->slots[i];
+		if (slot->state == SLOT_INFLIGHT)
+			__usbf_stream_wait(st, slot, NULL);
+	}
+	pthread_mutex_unlock(&ep->aio_lock);
+
+	for (i = 0; i < st->depth; ++i)
+		free(st->slots[i].buf);
+	free(st->slots);
+	free(st);
+}
+
+static int __usbf_stream_submit(struct usbf_stream *st,
+	struct __usbf_stream_slot *slot)
+{
+	struct usbf_endpoint *ep = st->ep;
+	struct iocb *iocbp = &slot->req.iocb;
+	int ret;
+
+	if (ep->event_fd < 0)
+		return -ENOTCONN;
+
+	__usbf_aio_prep(ep, &slot->req.iocb, slot->buf, slot->length,
+		&slot->req);
+	slot->req.iocb.aio_flags = 0;
+	slot->req.detached = 1;
+	__usbf_autotune_begin(ep, &slot->start);
+	slot->req.seq = st->seq;
+	__usbf_aio_link(ep, &slot->req);
+	ret = __usbf_aio_submit(ep, &iocbp, 1);
+	if (ret < 0) {
+		pthread_mutex_lock(&ep->aio_lock);
+		__usbf_aio_unlink(ep, &slot->req);
+		pthread_mutex_unlock(&ep->aio_lock);
+		return ret;
+	}
+
+	slot->state = SLOT_INFLIGHT;
+	return 0;
+}
+
+/* Keeps all free OUT buffers queued, in ring order */
+static int __usbf_stream_fill(struct usbf_stream *st,
+	const struct timespec *deadline)
+{
+	struct __usbf_stream_slot *slot;
+	int i, ret;
+
+	for (i = 0; i < st->depth; ++i)
+		if (st->slots[i].state == SLOT_FREE)
+			break;
+	if (i == st->depth)
+		return 0;
+
+	/* Submitting to disabled endpoint would block in io_submit() */
+	ret = __usbf_wait_enabled(st->ep->func,
+		deadline ? __usbf_ms_left(deadline) : -1, &st->seq);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < st->depth; ++i) {
+		slot = &st->slots[(st->head + i) % st->depth];
+		if (slot->state != SLOT_FREE)
+			continue;
+		slot->length = st->size + st->trailer;
+		ret = __usbf_stream_submit(st, slot);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Endpoint was disabled, all requests behind failed one fail as well.
+ * Wait for them and queue them again in original order once enabled.
+ */
+static int __usbf_stream_restart(struct usbf_stream *st,
+	const struct timespec *deadline)
+{
+	struct usbf_endpoint *ep = st->ep;
+	struct __usbf_stream_slot *slot;
+	int i, ret;
+
+	pthread_mutex_lock(&ep->aio_lock);
+	for (i = 0; i < st->depth; ++i) {
+		slot = &st->slots[i];
+		if (slot->state != SLOT_INFLIGHT)
+			continue;
+		__usbf_stream_wait(st, slot, NULL);
+		if (slot->req.result == -ESHUTDOWN && !slot->req.cancelled) {
+			__usbf_state_shutdown(ep->func, slot->req.seq);
+			slot->state = SLOT_FREE;
+		}
+	}
+	pthread_mutex_unlock(&ep->aio_lock);
+
+	if (ep->desc.direction == USBF_OUT)
+		return __usbf_stream_fill(st, deadline);
+
+	ret = __usbf_wait_enabled(ep->func,
+		deadline ? __usbf_ms_left(deadline) : -1, &st->seq);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < st->depth; ++i) {
+		slot = &st->slots[(st->head + i) % st->depth];
+		if (slot->state != SLOT_FREE || slot->req.result != -ESHUTDOWN)
+			continue;
+		ret = __usbf_stream_submit(st, slot);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Waits for head slot, returns its result */
+static int __usbf_stream_complete(struct usbf_stream *st,
+	const struct timespec *deadline)
+{
+	struct usbf_endpoint *ep = st->ep;
+	struct __usbf_stream_slot *slot = &st->slots[st->head];
+	uint8_t trailer[USBF_INTEGRITY_TRAILER];
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&ep->aio_lock);
+		ret = __usbf_stream_wait(st, slot, deadline);
+		pthread_mutex_unlock(&ep->aio_lock);
+		if (ret)
+			return ret;
+		if (slot->req.cancelled)
+			slot->req.result = -slot->req.cancelled;
+		if (slot->req.result != -ESHUTDOWN)
+			break;
+
+		ret = __usbf_stream_restart(st, deadline);
+		if (ret)
+			return ret;
+		if (slot->state != SLOT_INFLIGHT)
+			break;
+	}
+
+	slot->state = SLOT_FREE;
+	__usbf_autotune_end(ep, &slot->start, slot->length - st->trailer,
+		slot->req.result);
+	ret = slot->req.result;
+	if (ret >= 0 && st->trailer) {
+		if (ep->desc.direction == USBF_OUT)
+			ret = __usbf_integrity_check(slot->buf, ret, trailer, ret);
+		else
+			ret = ret < (int)st->trailer ? 0 : ret - (int)st->trailer;
+		if (ret < 0)
+			ret = -errno;
+	}
+	__usbf_capture_transfer(ep, slot->buf, ret);
+
+	return ret;
+}
+
+void *usbf_stream_acquire(struct usbf_stream *st, size_t *length,
+	int timeout_ms)
+{
+	struct usbf_endpoint *ep = st->ep;
+	struct __usbf_stream_slot *slot = &st->slots[st->head];
+	struct timespec deadline;
+	int ret;
+
+	if (slot->state == SLOT_ACQUIRED) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	if (timeout_ms > 0)
+		__usbf_ms_from_now(&deadline, timeout_ms);
+
+	if (ep->desc.direction == USBF_OUT) {
+		ret = __usbf_stream_fill(st, timeout_ms > 0 ? &deadline : NULL);
+		if (ret) {
+			errno = -ret;
+			return NULL;
+		}
+	}
+
+	if (slot->state == SLOT_INFLIGHT) {
+		ret = __usbf_stream_complete(st,
+			timeout_ms > 0 ? &deadline : NULL);
+		if (ret < 0) {
+			/* Failed OUT buffer is dropped and queued again */
+			if (ep->desc.direction == USBF_OUT && ret != -ETIMEDOUT)
+				st->head = (st->head + 1) % st->depth;
+			errno = -ret;
+			return NULL;
+		}
+		if (ep->desc.direction == USBF_OUT)
+			*length = ret;
+	}
+
+	if (ep->desc.direction == USBF_IN)
+		*length = st->size;
+	slot->state = SLOT_ACQUIRED;
+
+	return slot->buf;
+}
+
+int usbf_stream_commit(struct usbf_stream *st, size_t length)
+{
+	struct usbf_endpoint *ep = st->ep;
+	struct __usbf_stream_slot *slot = &st->slots[st->head];
+	int ret;
+
+	if (slot->state != SLOT_ACQUIRED)
+		return -EINVAL;
+
+	if (ep->desc.direction == USBF_OUT) {
+		slot->state = SLOT_FREE;
+		st->head = (st->head + 1) % st->depth;
+		return 0;
+	}
+
+	if (length > st->size)
+		return -EINVAL;
+
+	ret = __usbf_wait_enabled(ep->func, -1, &st->seq);
+	if (ret)
+		return ret;
+
+	slot->length = length;
+	if (st->trailer) {
+		__usbf_integrity_seal(slot->buf, length,
+			(uint8_t *)slot->buf + length);
+		slot->length += st->trailer;
+	}
+	ret = __usbf_stream_submit(st, slot);
+	if (ret)
+		return ret;
+	st->head = (st->head + 1) % st->depth;
+
+	return 0;
+}
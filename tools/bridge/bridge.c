@@ -0,0 +1,510 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Daemon bridging bulk IN/OUT endpoint pair to local Unix or TCP socket,
+ * so that protocols can be tunnelled over USB. Data moves with
+ * usbf_splice() where kernel can splice endpoint files, otherwise through
+ * usbf_stream buffers, filled from socket with as much as is available so
+ * that small writes are batched into bigger transfers. Each direction
+ * keeps at most limit bytes queued on endpoint, socket buffers of the
+ * same size come on top of that. One client is served at a time. Data
+ * itself is moved by relay core, this file plugs endpoints into it.
+ */
+
+#include <libusbf.h>
+#include "relay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define BRIDGE_DEFAULT_SIZE	16384
+#define BRIDGE_DEFAULT_LIMIT	65536
+/* Connect mode retries after this */
+#define BRIDGE_RETRY_MS		1000
+/* Interrupts blocking usbf_splice() */
+#define BRIDGE_KICK_SIGNAL	SIGUSR1
+/* Kicks before giving up on device on exit */
+#define BRIDGE_STOP_TRIES	10
+
+/* Relay port backed by endpoint */
+struct bridge_port {
+	struct relay_port port;
+	struct usbf_endpoint *ep;
+	/* Fallback buffers, created when needed and kept across clients */
+	struct usbf_stream *st;
+	size_t size;
+	int depth;
+};
+
+struct bridge {
+	struct usbf_function *func;
+	struct bridge_port in, out;
+	struct relay relay;
+	size_t limit;
+	/* Termination signals, delivered only to main thread */
+	sigset_t term;
+	int stopped;
+};
+
+struct bridge_conn {
+	struct bridge *br;
+	int sock;
+	int done;
+};
+
+static volatile sig_atomic_t bridge_stop;
+
+static void bridge_signal(int sig)
+{
+	if (sig != BRIDGE_KICK_SIGNAL)
+		bridge_stop = 1;
+}
+
+static struct bridge_port *bridge_port(struct relay_port *port)
+{
+	return (struct bridge_port *)((char *)port -
+		offsetof(struct bridge_port, port));
+}
+
+static int bridge_port_splice(struct relay_port *port, int fd, size_t length)
+{
+	return usbf_splice(bridge_port(port)->ep, fd, length);
+}
+
+static void *bridge_port_acquire(struct relay_port *port, size_t *length,
+	int timeout_ms)
+{
+	struct bridge_port *bp = bridge_port(port);
+
+	if (!bp->st) {
+		bp->st = usbf_stream_create(bp->ep, bp->size, bp->depth);
+		if (!bp->st)
+			return NULL;
+	}
+
+	return usbf_stream_acquire(bp->st, length, timeout_ms);
+}
+
+static int bridge_port_commit(struct relay_port *port, size_t length)
+{
+	return usbf_stream_commit(bridge_port(port)->st, length);
+}
+
+static uint16_t bridge_port_maxpacket(struct relay_port *port)
+{
+	struct usbf_endpoint_info info;
+
+	if (usbf_endpoint_get_info(bridge_port(port)->ep, &info))
+		return 0;
+
+	return info.maxpacketsize;
+}
+
+static void bridge_port_reset(struct relay_port *port)
+{
+	usbf_splice_reset(bridge_port(port)->ep);
+}
+
+static const struct relay_port_ops bridge_port_ops = {
+	.splice = bridge_port_splice,
+	.acquire = bridge_port_acquire,
+	.commit = bridge_port_commit,
+	.maxpacket = bridge_port_maxpacket,
+	.reset = bridge_port_reset,
+};
+
+static int bridge_done(struct bridge_conn *conn)
+{
+	return bridge_stop || __atomic_load_n(&conn->done, __ATOMIC_ACQUIRE);
+}
+
+/* First direction to finish closes connection for the other one */
+static void bridge_finish(struct bridge_conn *conn)
+{
+	__atomic_store_n(&conn->done, 1, __ATOMIC_RELEASE);
+	shutdown(conn->sock, SHUT_RDWR);
+}
+
+static void *bridge_in_thread(void *arg)
+{
+	struct bridge_conn *conn = arg;
+	int ret = 0;
+
+	while (!ret && !bridge_done(conn))
+		ret = relay_to_host(&conn->br->relay, conn->sock);
+
+	bridge_finish(conn);
+	return NULL;
+}
+
+static void *bridge_out_thread(void *arg)
+{
+	struct bridge_conn *conn = arg;
+	int ret = 0;
+
+	while (!ret && !bridge_done(conn))
+		ret = relay_from_host(&conn->br->relay, conn->sock);
+
+	bridge_finish(conn);
+	return NULL;
+}
+
+static int bridge_join(pthread_t thread, int timeout_ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += timeout_ms % 1000 * 1000000L;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_nsec -= 1000000000;
+		++ts.tv_sec;
+	}
+
+	return pthread_timedjoin_np(thread, NULL, &ts);
+}
+
+/* Thread might be blocked in usbf_splice() on endpoint, kick it out */
+static void bridge_reap(struct bridge_conn *conn, pthread_t thread)
+{
+	struct bridge *br = conn->br;
+	int tries = 0;
+
+	while (bridge_join(thread, RELAY_POLL_MS)) {
+		if (bridge_stop)
+			bridge_finish(conn);
+		if (bridge_done(conn))
+			pthread_kill(thread, BRIDGE_KICK_SIGNAL);
+		/* Waiting for ENABLE is woken up only by usbf_stop() */
+		if (bridge_stop && ++tries == BRIDGE_STOP_TRIES &&
+		    !br->stopped) {
+			usbf_stop(br->func);
+			br->stopped = 1;
+		}
+	}
+}
+
+static void bridge_serve(struct bridge *br, int sock)
+{
+	struct bridge_conn conn = { .br = br, .sock = sock, .done = 0 };
+	int size = br->limit, one = 1;
+	pthread_t in, out;
+	int ret;
+
+	/* Data held back for previous client isn't meant for this one */
+	relay_reset(&br->relay);
+
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	/* Debug protocols are mostly request-response, fails on Unix */
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (pthread_create(&in, NULL, bridge_in_thread, &conn))
+		return;
+	ret = pthread_create(&out, NULL, bridge_out_thread, &conn);
+	if (ret)
+		bridge_finish(&conn);
+
+	/* Threads inherited blocked mask, we have to notice termination */
+	pthread_sigmask(SIG_UNBLOCK, &br->term, NULL);
+	bridge_reap(&conn, in);
+	if (!ret)
+		bridge_reap(&conn, out);
+	pthread_sigmask(SIG_BLOCK, &br->term, NULL);
+}
+
+static int bridge_unix_socket(const char *path, int listening)
+{
+	struct sockaddr_un sun;
+	int fd, error;
+
+	if (strlen(path) >= sizeof(sun.sun_path))
+		return -ENAMETOOLONG;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (listening) {
+		unlink(path);
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+		    listen(fd, 1) < 0)
+			goto err;
+	} else if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		goto err;
+	}
+
+	return fd;
+
+err:
+	error = errno;
+	close(fd);
+	return -error;
+}
+
+/* Address is unix:<path>, tcp:<host>:<port> or <host>:<port> */
+static int bridge_socket(const char *addr, int listening)
+{
+	struct addrinfo hints, *res, *ai;
+	const char *port;
+	char host[256];
+	int fd = -1, one = 1;
+
+	if (!strncmp(addr, "unix:", 5))
+		return bridge_unix_socket(addr + 5, listening);
+	if (!strncmp(addr, "tcp:", 4))
+		addr += 4;
+
+	port = strrchr(addr, ':');
+	if (!port || port - addr >= (int)sizeof(host))
+		return -EINVAL;
+	snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = listening ? AI_PASSIVE : 0;
+	if (getaddrinfo(*host ? host : NULL, port + 1, &hints, &res))
+		return -EADDRNOTAVAIL;
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (listening) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one,
+				sizeof(one));
+			if (!bind(fd, ai->ai_addr, ai->ai_addrlen) &&
+			    !listen(fd, 1))
+				break;
+		} else if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	return fd < 0 ? -ECONNREFUSED : fd;
+}
+
+static void *bridge_events_thread(void *arg)
+{
+	struct bridge *br = arg;
+
+	while (!bridge_stop) {
+		if (usbf_wait_events(br->func, RELAY_POLL_MS) > 0)
+			usbf_handle_events(br->func);
+	}
+
+	return NULL;
+}
+
+static void bridge_print_stats(const char *name,
+	const struct relay_stats *stats)
+{
+	printf("%s: %llu bytes in %llu transfers\n", name,
+		(unsigned long long)stats->bytes,
+		(unsigned long long)stats->transfers);
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options] <ffs directory>\n"
+		"  -l <addr>  listen on address (default unix:/tmp/usbf.sock)\n"
+		"  -c <addr>  connect to address instead\n"
+		"  -s <size>  transfer size (default %d)\n"
+		"  -b <size>  bytes queued per direction (default %d)\n"
+		"  -n         don't use splice\n"
+		"addresses are unix:<path>, tcp:<host>:<port> or <host>:<port>\n",
+		name, BRIDGE_DEFAULT_SIZE, BRIDGE_DEFAULT_LIMIT);
+}
+
+int main(int argc, char *argv[])
+{
+	struct usbf_function_descriptor f_desc = {
+		.speed = USBF_SPEED_FS | USBF_SPEED_HS | USBF_SPEED_SS,
+		.interface_class = USBF_CLASS_VENDOR_SPEC,
+		.string = "SOCKET BRIDGE",
+	};
+	struct usbf_endpoint_descriptor ep_desc = {
+		.type = USBF_BULK,
+		.fs_maxpacketsize = 64,
+		.hs_maxpacketsize = 512,
+		.ss_maxpacketsize = 1024,
+	};
+	const char *addr = "unix:/tmp/usbf.sock";
+	size_t size = BRIDGE_DEFAULT_SIZE, limit = BRIDGE_DEFAULT_LIMIT;
+	struct bridge br;
+	struct sigaction sa;
+	sigset_t old;
+	pthread_t events;
+	int opt, listening = 1, fd = -1, sock;
+
+	memset(&br, 0, sizeof(br));
+	br.relay.splice_in = 1;
+	br.relay.splice_out = 1;
+
+	while ((opt = getopt(argc, argv, "l:c:s:b:nh")) != -1) {
+		switch (opt) {
+		case 'l':
+		case 'c':
+			addr = optarg;
+			listening = opt == 'l';
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			limit = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			br.relay.splice_in = 0;
+			br.relay.splice_out = 0;
+			break;
+		default:
+			usage(argv[0]);
+			return opt != 'h';
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (!size || !limit || limit > INT32_MAX) {
+		fprintf(stderr, "invalid sizes\n");
+		return 1;
+	}
+	if (size > limit)
+		size = limit;
+	br.limit = limit;
+	br.relay.size = size;
+	br.relay.in = &br.in.port;
+	br.relay.out = &br.out.port;
+	br.in.port.ops = &bridge_port_ops;
+	br.out.port.ops = &bridge_port_ops;
+	br.in.size = br.out.size = size;
+	/* Each direction keeps at most limit bytes in flight */
+	br.in.depth = br.out.depth = limit / size;
+	if (br.in.depth > USBF_MAX_DEPTH) {
+		br.in.depth = br.out.depth = USBF_MAX_DEPTH;
+		fprintf(stderr, "at most %d transfers can be queued, "
+			"limiting buffers to %zu bytes\n", USBF_MAX_DEPTH,
+			USBF_MAX_DEPTH * size);
+	}
+
+	br.func = usbf_create_function(&f_desc, argv[optind]);
+	if (!br.func) {
+		fprintf(stderr, "function registration failed\n");
+		return 1;
+	}
+
+	ep_desc.direction = USBF_IN;
+	br.in.ep = usbf_add_endpoint(br.func, &ep_desc);
+	ep_desc.direction = USBF_OUT;
+	br.out.ep = usbf_add_endpoint(br.func, &ep_desc);
+	if (!br.in.ep || !br.out.ep) {
+		fprintf(stderr, "can't add endpoints\n");
+		goto err_func;
+	}
+
+	if (usbf_start(br.func) < 0) {
+		fprintf(stderr, "function start failed\n");
+		goto err_func;
+	}
+
+	if (listening) {
+		fd = bridge_socket(addr, 1);
+		if (fd < 0) {
+			fprintf(stderr, "can't listen on %s: %s\n", addr,
+				strerror(-fd));
+			goto err_stop;
+		}
+	}
+
+	/* No SA_RESTART, signals have to interrupt blocking calls */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = bridge_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(BRIDGE_KICK_SIGNAL, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	/*
+	 * Termination signals go to main thread, waiting in accept() or for
+	 * connection threads
+	 */
+	sigemptyset(&br.term);
+	sigaddset(&br.term, SIGINT);
+	sigaddset(&br.term, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &br.term, &old);
+	if (pthread_create(&events, NULL, bridge_events_thread, &br)) {
+		fprintf(stderr, "can't create thread\n");
+		goto err_stop;
+	}
+
+	while (!bridge_stop) {
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (listening)
+			sock = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		else
+			sock = bridge_socket(addr, 0);
+		pthread_sigmask(SIG_BLOCK, &br.term, NULL);
+
+		if (sock < 0) {
+			if (!listening && !bridge_stop)
+				usleep(BRIDGE_RETRY_MS * 1000);
+			continue;
+		}
+		bridge_serve(&br, sock);
+		close(sock);
+	}
+
+	pthread_join(events, NULL);
+	bridge_print_stats("to host", &br.relay.to_host);
+	bridge_print_stats("from host", &br.relay.from_host);
+
+err_stop:
+	if (fd >= 0)
+		close(fd);
+	if (br.in.st)
+		usbf_stream_delete(br.in.st);
+	if (br.out.st)
+		usbf_stream_delete(br.out.st);
+	if (!br.stopped)
+		usbf_stop(br.func);
+err_func:
+	usbf_delete_function(br.func);
+
+	return bridge_stop ? 0 : 1;
+}
@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Drives relay core between socketpairs. Endpoints are stood in for by
+ * SOCK_SEQPACKET pairs, which keep message boundaries, so that each
+ * message is one USB transfer and empty message is zero length packet.
+ * Buffer ports move messages themselves, splice ports are endpoints of
+ * function run by replay harness against relay-test.replay.
+ */
+
+#include <libusbf.h>
+#include "relay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define TEST_SIZE	4096
+#define TEST_MAXPACKET	512
+#define TEST_SCRIPT	"relay-test.replay"
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n",		\
+			__FILE__, __LINE__, #cond);			\
+		exit(1);						\
+	}								\
+} while (0)
+
+struct test_port {
+	struct relay_port port;
+	int fd;
+	uint8_t buf[TEST_SIZE];
+};
+
+static struct test_port *test_port(struct relay_port *port)
+{
+	return (struct test_port *)port;
+}
+
+static void *test_acquire(struct relay_port *port, size_t *length,
+	int timeout_ms)
+{
+	struct test_port *tp = test_port(port);
+	struct pollfd pfd = { .fd = tp->fd, .events = POLLIN };
+	ssize_t ret;
+
+	/* IN buffer is always free, OUT one holds next message */
+	if (tp->fd < 0) {
+		*length = sizeof(tp->buf);
+		return tp->buf;
+	}
+	if (poll(&pfd, 1, timeout_ms) <= 0) {
+		errno = ETIMEDOUT;
+		return NULL;
+	}
+	ret = read(tp->fd, tp->buf, sizeof(tp->buf));
+	if (ret < 0)
+		return NULL;
+	*length = ret;
+
+	return tp->buf;
+}
+
+static int test_commit(struct relay_port *port, size_t length)
+{
+	return 0;
+}
+
+static uint16_t test_maxpacket(struct relay_port *port)
+{
+	return TEST_MAXPACKET;
+}
+
+static const struct relay_port_ops test_out_ops = {
+	.acquire = test_acquire,
+	.commit = test_commit,
+	.maxpacket = test_maxpacket,
+};
+
+/* IN port writes committed buffer to host side as one message */
+struct test_in_port {
+	struct test_port tp;
+	int host;
+};
+
+static int test_in_commit(struct relay_port *port, size_t length)
+{
+	struct test_in_port *in = (struct test_in_port *)port;
+	ssize_t ret;
+
+	ret = write(in->host, in->tp.buf, length);
+	return ret == (ssize_t)length ? 0 : -1;
+}
+
+static const struct relay_port_ops test_in_ops = {
+	.acquire = test_acquire,
+	.commit = test_in_commit,
+	.maxpacket = test_maxpacket,
+};
+
+/* Endpoint port, data moves with usbf_splice() only */
+struct test_splice_port {
+	struct relay_port port;
+	struct usbf_endpoint *ep;
+};
+
+static struct usbf_endpoint *test_splice_ep(struct relay_port *port)
+{
+	return ((struct test_splice_port *)port)->ep;
+}
+
+static int test_splice(struct relay_port *port, int fd, size_t length)
+{
+	return usbf_splice(test_splice_ep(port), fd, length);
+}
+
+static void *test_no_acquire(struct relay_port *port, size_t *length,
+	int timeout_ms)
+{
+	/* Falling back to buffers fails the test */
+	errno = ENOTSUP;
+	return NULL;
+}
+
+static uint16_t test_splice_maxpacket(struct relay_port *port)
+{
+	struct usbf_endpoint_info info;
+
+	if (usbf_endpoint_get_info(test_splice_ep(port), &info))
+		return 0;
+
+	return info.maxpacketsize;
+}
+
+static void test_splice_reset(struct relay_port *port)
+{
+	usbf_splice_reset(test_splice_ep(port));
+}
+
+static const struct relay_port_ops test_splice_ops = {
+	.splice = test_splice,
+	.acquire = test_no_acquire,
+	.commit = test_commit,
+	.maxpacket = test_splice_maxpacket,
+	.reset = test_splice_reset,
+};
+
+/* Length of next message host got, -1 if there is none */
+static int test_host_recv(int fd, uint8_t *buf, size_t size)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	if (poll(&pfd, 1, 0) <= 0)
+		return -1;
+
+	return read(fd, buf, size);
+}
+
+static void test_fill(uint8_t *buf, size_t length, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < length; ++i)
+		buf[i] = seed + i * 7;
+}
+
+static void test_write(int fd, const uint8_t *data, size_t length)
+{
+	CHECK(write(fd, data, length) == (ssize_t)length);
+}
+
+static void test_read(int fd, uint8_t *data, size_t length)
+{
+	ssize_t ret;
+
+	while (length) {
+		ret = read(fd, data, length);
+		CHECK(ret > 0);
+		data += ret;
+		length -= ret;
+	}
+}
+
+static void test_buffers(void)
+{
+	static uint8_t data[2 * TEST_SIZE], got[2 * TEST_SIZE];
+	struct test_in_port in;
+	struct test_port out;
+	struct relay relay;
+	int client[2], usb_in[2], usb_out[2];
+
+	CHECK(!socketpair(AF_UNIX, SOCK_STREAM, 0, client));
+	CHECK(!socketpair(AF_UNIX, SOCK_SEQPACKET, 0, usb_in));
+	CHECK(!socketpair(AF_UNIX, SOCK_SEQPACKET, 0, usb_out));
+
+	memset(&in, 0, sizeof(in));
+	in.tp.port.ops = &test_in_ops;
+	in.tp.fd = -1;
+	in.host = usb_in[0];
+	memset(&out, 0, sizeof(out));
+	out.port.ops = &test_out_ops;
+	out.fd = usb_out[1];
+
+	memset(&relay, 0, sizeof(relay));
+	relay.in = &in.tp.port;
+	relay.out = &out.port;
+	relay.size = TEST_SIZE;
+	/* Ports have no splice, relay has to fall back to buffers */
+	relay.splice_in = 1;
+	relay.splice_out = 1;
+
+	/* Short transfer ends by itself */
+	test_fill(data, 100, 1);
+	test_write(client[0], data, 100);
+	CHECK(!relay_to_host(&relay, client[1]));
+	CHECK(test_host_recv(usb_in[1], got, sizeof(got)) == 100);
+	CHECK(!memcmp(data, got, 100));
+	CHECK(test_host_recv(usb_in[1], got, sizeof(got)) < 0);
+
+	/* Packet aligned transfer with nothing behind it gets ZLP */
+	test_fill(data, 1024, 2);
+	test_write(client[0], data, 1024);
+	CHECK(!relay_to_host(&relay, client[1]));
+	CHECK(test_host_recv(usb_in[1], got, sizeof(got)) == 1024);
+	CHECK(!memcmp(data, got, 1024));
+	CHECK(test_host_recv(usb_in[1], got, sizeof(got)) == 0);
+	CHECK(test_host_recv(usb_in[1], got, sizeof(got)) < 0);
+
+	/* With more data queued last byte moves to next transfer instead */
+	test_fill(data, TEST_SIZE + 100, 3);
+	test_write(client[0], data, TEST_SIZE + 100);
+	CHECK(!relay_to_host(&relay, client[1]));
+	CHECK(test_host_recv(usb_in[1], got, sizeof(got)) == TEST_SIZE - 1);
+	CHECK(!relay_to_host(&relay, client[1]));
+	CHECK(test_host_recv(usb_in[1], got + TEST_SIZE - 1,
+		sizeof(got)) == 101);
+	CHECK(!memcmp(data, got, TEST_SIZE + 100));
+	CHECK(test_host_recv(usb_in[1], got, sizeof(got)) < 0);
+	CHECK(relay.to_host.bytes == 100 + 1024 + TEST_SIZE + 100);
+	CHECK(relay.to_host.transfers == 5);
+
+	/* Host transfers, ZLP included, come out as one byte stream */
+	test_fill(data, 1512, 4);
+	test_write(usb_out[0], data, 512);
+	test_write(usb_out[0], data, 0);
+	test_write(usb_out[0], data + 512, 1000);
+	CHECK(!relay_from_host(&relay, client[1]));
+	CHECK(!relay_from_host(&relay, client[1]));
+	CHECK(!relay_from_host(&relay, client[1]));
+	test_read(client[0], got, 1512);
+	CHECK(!memcmp(data, got, 1512));
+	CHECK(relay.from_host.bytes == 1512);
+
+	/* Nothing to move, step times out */
+	CHECK(!relay_from_host(&relay, client[1]));
+	CHECK(!relay_to_host(&relay, client[1]));
+
+	/* Client going away ends direction towards host */
+	close(client[0]);
+	CHECK(relay_to_host(&relay, client[1]) == -EPIPE);
+	CHECK(test_host_recv(usb_in[1], got, sizeof(got)) < 0);
+
+	/* And the other one on first write */
+	test_write(usb_out[0], data, 10);
+	CHECK(relay_from_host(&relay, client[1]) == -EPIPE);
+}
+
+static volatile int test_done;
+
+static void *test_events_thread(void *arg)
+{
+	struct usbf_function *func = arg;
+
+	while (!test_done)
+		if (usbf_wait_events(func, RELAY_POLL_MS) > 0)
+			usbf_handle_events(func);
+
+	return NULL;
+}
+
+static void test_splice_client(struct relay *relay, int client[2])
+{
+	CHECK(!socketpair(AF_UNIX, SOCK_STREAM, 0, client));
+	relay_reset(relay);
+}
+
+static void test_splices(const char *script)
+{
+	static uint8_t data[2 * TEST_SIZE], got[2 * TEST_SIZE];
+	struct usbf_function_descriptor f_desc = {
+		.speed = USBF_SPEED_FS | USBF_SPEED_HS,
+		.interface_class = USBF_CLASS_VENDOR_SPEC,
+		.string = "RELAY TEST",
+	};
+	struct usbf_endpoint_descriptor ep_desc = {
+		.type = USBF_BULK,
+		.fs_maxpacketsize = 64,
+		.hs_maxpacketsize = TEST_MAXPACKET,
+	};
+	struct test_splice_port in, out;
+	struct usbf_replay_stats stats;
+	struct usbf_function *func;
+	struct usbf_replay *rp;
+	struct relay relay;
+	pthread_t events;
+	int client[2];
+	size_t i;
+
+	func = usbf_create_function(&f_desc, "replay");
+	CHECK(func);
+	ep_desc.direction = USBF_IN;
+	in.ep = usbf_add_endpoint(func, &ep_desc);
+	ep_desc.direction = USBF_OUT;
+	out.ep = usbf_add_endpoint(func, &ep_desc);
+	CHECK(in.ep && out.ep);
+	in.port.ops = &test_splice_ops;
+	out.port.ops = &test_splice_ops;
+
+	memset(&relay, 0, sizeof(relay));
+	relay.in = &in.port;
+	relay.out = &out.port;
+	relay.size = TEST_SIZE;
+	relay.splice_in = 1;
+	relay.splice_out = 1;
+
+	rp = usbf_replay_start(func, script, 0);
+	CHECK(rp);
+	CHECK(!pthread_create(&events, NULL, test_events_thread, func));
+	test_splice_client(&relay, client);
+
+	/* Host transfers, ZLP included, come out as one byte stream */
+	CHECK(!relay_from_host(&relay, client[1]));
+	CHECK(!relay_from_host(&relay, client[1]));
+	CHECK(!relay_from_host(&relay, client[1]));
+	test_read(client[0], got, 1512);
+	for (i = 0; i < 1512; ++i)
+		CHECK(got[i] == (uint8_t)(i < 512 ? i : i - 512));
+
+	/* Script checks how client data was cut into transfers */
+	test_fill(data, 100, 1);
+	test_write(client[0], data, 100);
+	CHECK(!relay_to_host(&relay, client[1]));
+	test_fill(data, 1024, 2);
+	test_write(client[0], data, 1024);
+	CHECK(!relay_to_host(&relay, client[1]));
+	test_fill(data, TEST_SIZE + 100, 3);
+	test_write(client[0], data, TEST_SIZE + 100);
+	CHECK(!relay_to_host(&relay, client[1]));
+	CHECK(!relay_to_host(&relay, client[1]));
+
+	/* Client leaves with byte carried, next one mustn't get it */
+	test_write(client[0], data, TEST_SIZE + 100);
+	CHECK(!relay_to_host(&relay, client[1]));
+	close(client[0]);
+	close(client[1]);
+	test_splice_client(&relay, client);
+	test_write(client[0], data, 100);
+	CHECK(!relay_to_host(&relay, client[1]));
+
+	CHECK(relay.splice_in && relay.splice_out);
+	CHECK(!usbf_replay_wait(rp, &stats));
+	test_done = 1;
+	pthread_join(events, NULL);
+	CHECK(stats.in_transfers == 7);
+	CHECK(stats.in_bytes == 100 + 1024 + 2 * (TEST_SIZE - 1) + 101 + 100);
+
+	close(client[0]);
+	close(client[1]);
+	usbf_stop(func);
+	usbf_replay_delete(rp);
+	usbf_delete_function(func);
+}
+
+int main(int argc, char *argv[])
+{
+	char script[4096];
+	const char *srcdir;
+
+	signal(SIGPIPE, SIG_IGN);
+	test_buffers();
+
+	/* make check runs us from build tree */
+	srcdir = getenv("srcdir");
+	snprintf(script, sizeof(script), "%s/" TEST_SCRIPT, argc > 1 ?
+		argv[1] : srcdir ? srcdir : ".");
+	test_splices(script);
+
+	return 0;
+}
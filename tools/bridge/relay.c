@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "relay.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+static int relay_readable(int fd, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	return poll(&pfd, 1, timeout_ms) > 0;
+}
+
+static int relay_write_all(int fd, const uint8_t *data, size_t length)
+{
+	ssize_t ret;
+
+	while (length) {
+		ret = write(fd, data, length);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		data += ret;
+		length -= ret;
+	}
+
+	return 0;
+}
+
+/* Socket to host through port buffers */
+static int relay_copy_in(struct relay *relay, int sock)
+{
+	struct relay_port *port = relay->in;
+	uint16_t maxpacket;
+	uint8_t *buf;
+	size_t n = 0;
+	ssize_t ret;
+	int zlp = 0;
+
+	/* Carried byte goes out with whatever comes next, even EOF */
+	if (!relay->carry_len && !relay_readable(sock, RELAY_POLL_MS))
+		return 0;
+
+	if (!relay->in_buf) {
+		relay->in_buf = port->ops->acquire(port, &relay->in_size,
+			RELAY_POLL_MS);
+		if (!relay->in_buf)
+			return errno == ETIMEDOUT ? 0 : -errno;
+	}
+	buf = relay->in_buf;
+
+	if (relay->carry_len) {
+		buf[n++] = relay->carry;
+		relay->carry_len = 0;
+	}
+	ret = read(sock, buf + n, relay->in_size - n);
+	if (ret > 0)
+		n += ret;
+	if (!n)
+		return ret < 0 && errno == EINTR ? 0 : -EPIPE;
+
+	/* Packet aligned transfer is ended same way usbf_splice() does it */
+	maxpacket = port->ops->maxpacket(port);
+	if (ret > 0 && maxpacket > 1 && n % maxpacket == 0) {
+		if (n > 1 && relay_readable(sock, 0)) {
+			relay->carry = buf[--n];
+			relay->carry_len = 1;
+		} else {
+			zlp = 1;
+		}
+	}
+
+	relay->in_buf = NULL;
+	if (port->ops->commit(port, n))
+		return -EIO;
+	relay->to_host.transfers++;
+	relay->to_host.bytes += n;
+
+	if (zlp) {
+		buf = port->ops->acquire(port, &relay->in_size, -1);
+		if (!buf)
+			return -errno;
+		if (port->ops->commit(port, 0))
+			return -EIO;
+		relay->to_host.transfers++;
+	}
+
+	return 0;
+}
+
+/* Host to socket through port buffers */
+static int relay_copy_out(struct relay *relay, int sock)
+{
+	struct relay_port *port = relay->out;
+	size_t length;
+	void *buf;
+	int ret;
+
+	buf = port->ops->acquire(port, &length, RELAY_POLL_MS);
+	if (!buf)
+		return errno == ETIMEDOUT ? 0 : -errno;
+
+	ret = relay_write_all(sock, buf, length);
+	port->ops->commit(port, 0);
+	if (ret)
+		return -EPIPE;
+
+	relay->from_host.transfers++;
+	relay->from_host.bytes += length;
+	return 0;
+}
+
+int relay_to_host(struct relay *relay, int sock)
+{
+	struct relay_port *port = relay->in;
+	int ret;
+
+	if (!relay->splice_in || !port->ops->splice)
+		return relay_copy_in(relay, sock);
+
+	ret = port->ops->splice(port, sock, relay->size);
+	if (ret == -EINVAL) {
+		relay->splice_in = 0;
+		return 0;
+	}
+	if (ret > 0) {
+		relay->to_host.transfers++;
+		relay->to_host.bytes += ret;
+		return 0;
+	}
+	/* Interrupted, or client closed connection */
+	return ret == -EINTR ? 0 : ret < 0 ? ret : -EPIPE;
+}
+
+int relay_from_host(struct relay *relay, int sock)
+{
+	struct relay_port *port = relay->out;
+	int ret;
+
+	if (!relay->splice_out || !port->ops->splice)
+		return relay_copy_out(relay, sock);
+
+	ret = port->ops->splice(port, sock, relay->size);
+	if (ret == -EINVAL) {
+		relay->splice_out = 0;
+		return 0;
+	}
+	if (ret >= 0) {
+		relay->from_host.transfers++;
+		relay->from_host.bytes += ret;
+		return 0;
+	}
+
+	return ret == -EINTR ? 0 : ret;
+}
+
+void relay_reset(struct relay *relay)
+{
+	relay->carry_len = 0;
+	if (relay->in->ops->reset)
+		relay->in->ops->reset(relay->in);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Copy and splice core of the bridge, moving data between socket and USB
+ * side of one direction. USB side is reached through port operations, so
+ * relay doesn't depend on libusbf and runs between plain descriptors as
+ * well as between socket and endpoints.
+ */
+
+/* Relay steps return after this long without data */
+#define RELAY_POLL_MS		100
+
+struct relay_port;
+
+struct relay_port_ops {
+	/*
+	 * Single transfer between port and fd without copying, as
+	 * usbf_splice(). -EINVAL before anything is moved if port can't
+	 * splice, relay falls back to buffers then. Optional.
+	 */
+	int (*splice)(struct relay_port *port, int fd, size_t length);
+	/* Buffer to fill or filled one, as usbf_stream_acquire() */
+	void *(*acquire)(struct relay_port *port, size_t *length,
+		int timeout_ms);
+	/* Queues or gives back buffer, as usbf_stream_commit() */
+	int (*commit)(struct relay_port *port, size_t length);
+	/* Packet size of current connection, 0 if unknown */
+	uint16_t (*maxpacket)(struct relay_port *port);
+	/* Drops data splice held back, as usbf_splice_reset(). Optional. */
+	void (*reset)(struct relay_port *port);
+};
+
+struct relay_port {
+	const struct relay_port_ops *ops;
+};
+
+struct relay_stats {
+	uint64_t bytes;
+	uint64_t transfers;
+};
+
+struct relay {
+	/* Towards host and from host */
+	struct relay_port *in, *out;
+	size_t size;
+	/* Cleared for direction once port can't splice it */
+	int splice_in;
+	int splice_out;
+	/* IN buffer acquired but not filled yet, kept for next step */
+	uint8_t *in_buf;
+	size_t in_size;
+	/* Byte held back so that full transfer doesn't end on packet */
+	uint8_t carry;
+	int carry_len;
+	struct relay_stats to_host;
+	struct relay_stats from_host;
+};
+
+/*
+ * Each step moves one transfer, or returns after RELAY_POLL_MS without
+ * data. Returns 0 to go on, negative errno when direction is done, -EPIPE
+ * once socket is closed.
+ */
+int relay_to_host(struct relay *relay, int sock);
+
+int relay_from_host(struct relay *relay, int sock);
+
+/* Drops data held back for previous socket, before serving next one */
+void relay_reset(struct relay *relay);
+
+#endif /* RELAY_H */
@@ -0,0 +1,435 @@
+/*
+ * analyze.c
+ * Copyright(c) 2015 Samsung Electronics Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "analyze.h"
+#include "common.h"
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <linux/usb/ch9.h>
+
+/**
+ * @brief Bus limits of one speed
+ * @details Bytes are raw bus bytes without bit stuffing, overheads are
+ * 	protocol bytes added to each transaction (USB 2.0 5.6 - 5.8, USB 3
+ * 	header packet and data packet framing). Round trip is how long
+ * 	sender waits for acknowledgement once it has sent whole burst,
+ * 	0 where every transaction is handshaked on its own.
+ */
+struct ffs_speed_limits {
+	const char *name;
+	const char *frame;
+	int frame_us;
+	int frame_bytes;
+	int periodic_pct;
+	int bulk_overhead;
+	int int_overhead;
+	int iso_overhead;
+	int round_trip_ns;
+};
+
+static const struct ffs_speed_limits speed_limits[] = {
+	[FFS_USB_FULL_SPEED] = {
+		"full-speed", "frame", 1000, 1500, 90, 13, 13, 9, 0
+	},
+	[FFS_USB_HIGH_SPEED] = {
+		"high-speed", "microframe", 125, 7500, 80, 55, 55, 38, 0
+	},
+#ifdef HAS_FFS_DESC_V2
+	[FFS_USB_SUPER_SPEED] = {
+		"super-speed", "bus interval", 125, 62500, 90, 32, 32, 32,
+		2000
+	},
+#endif
+};
+
+static const char *ep_type_strs[] = {
+	[USB_ENDPOINT_XFER_CONTROL] = "control",
+	[USB_ENDPOINT_XFER_ISOC] = "isochronous",
+	[USB_ENDPOINT_XFER_BULK] = "bulk",
+	[USB_ENDPOINT_XFER_INT] = "interrupt",
+};
+
+/**
+ * @brief Endpoint descriptor decoded for given speed
+ */
+struct ffs_ep_info {
+	const struct usb_endpoint_descriptor_no_audio *desc;
+	const struct usb_ss_ep_comp_descriptor *comp;
+	int address;
+	int type;
+	int maxpacket;
+	/* Additional transactions per interval */
+	int mult;
+	int burst;
+	/* In (micro)frames */
+	int interval;
+	/* Payload and number of packets per interval */
+	int bytes;
+	int packets;
+};
+
+#ifdef HAS_FFS_DESC_V2
+#define IS_SUPER_SPEED(speed) ((speed) == FFS_USB_SUPER_SPEED)
+#else
+#define IS_SUPER_SPEED(speed) 0
+#endif
+
+#define IS_PERIODIC(ep) ((ep)->type == USB_ENDPOINT_XFER_ISOC ||\
+			 (ep)->type == USB_ENDPOINT_XFER_INT)
+
+#define EP_MESSAGE(speed, ep, kind, msg, ...)\
+	fprintf(stderr, "%s: endpoint 0x%02x: %s: "msg"\n",\
+			speed_limits[speed].name, (ep)->address, kind,\
+			##__VA_ARGS__)
+
+/**
+ * @brief Find next endpoint descriptor and its companion
+ * @param[in] desc Descriptors of one speed
+ * @param[in,out] offset Position in descriptors to continue from
+ * @param[out] ep Endpoint found
+ * @return 1 if endpoint was found, 0 at the end of descriptors
+ */
+static int ffs_next_ep(struct ffs_desc_per_speed *desc, int *offset,
+		struct ffs_ep_info *ep)
+{
+	struct usb_descriptor_header *hdr;
+
+	while (*offset < desc->desc_size) {
+		hdr = (struct usb_descriptor_header *)(desc->desc + *offset);
+		*offset += hdr->bLength;
+		if (hdr->bDescriptorType != USB_DT_ENDPOINT)
+			continue;
+
+		memset(ep, 0, sizeof(*ep));
+		ep->desc = (struct usb_endpoint_descriptor_no_audio *)hdr;
+
+		hdr = (struct usb_descriptor_header *)(desc->desc + *offset);
+		if (*offset < desc->desc_size &&
+		    hdr->bDescriptorType == USB_DT_SS_ENDPOINT_COMP) {
+			ep->comp = (struct usb_ss_ep_comp_descriptor *)hdr;
+			*offset += hdr->bLength;
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Decode endpoint parameters, invalid values are taken as worst case
+ */
+static void ffs_decode_ep(int speed, struct ffs_ep_info *ep)
+{
+	int mps = le16toh(ep->desc->wMaxPacketSize);
+	int interval = ep->desc->bInterval;
+	int bpi;
+
+	ep->address = ep->desc->bEndpointAddress;
+	ep->type = ep->desc->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK;
+	ep->maxpacket = mps & USB_ENDPOINT_MAXP_MASK;
+	ep->mult = speed == FFS_USB_HIGH_SPEED ? USB_EP_MAXP_MULT(mps) : 0;
+	ep->burst = 0;
+	if (ep->comp) {
+		ep->burst = ep->comp->bMaxBurst;
+		/* Mult is meaningful for isochronous endpoints only */
+		if (ep->type == USB_ENDPOINT_XFER_ISOC)
+			ep->mult = ep->comp->bmAttributes & 0x3;
+	}
+
+	/* Full-speed interrupt bInterval is in frames, others are exponent */
+	if (speed == FFS_USB_FULL_SPEED && ep->type == USB_ENDPOINT_XFER_INT)
+		ep->interval = interval ? interval : 1;
+	else
+		ep->interval = interval >= 1 && interval <= 16 ?
+			1 << (interval - 1) : 1;
+
+	ep->packets = (ep->burst + 1) * (ep->mult + 1);
+	ep->bytes = ep->packets * ep->maxpacket;
+
+	/* Host reserves only wBytesPerInterval when it's given */
+	bpi = ep->comp ? le16toh(ep->comp->wBytesPerInterval) : 0;
+	if (IS_PERIODIC(ep) && bpi && bpi < ep->bytes) {
+		ep->bytes = bpi;
+		ep->packets = (bpi + ep->maxpacket - 1) / ep->maxpacket;
+	}
+}
+
+static int ffs_check_fs_ep(struct ffs_ep_info *ep)
+{
+	int errors = 0;
+
+	if (ep->type == USB_ENDPOINT_XFER_BULK) {
+		if (ep->maxpacket != 8 && ep->maxpacket != 16 &&
+		    ep->maxpacket != 32 && ep->maxpacket != 64) {
+			EP_MESSAGE(FFS_USB_FULL_SPEED, ep, "error",
+				"bulk wMaxPacketSize must be 8, 16, 32 or 64");
+			errors++;
+		} else if (ep->maxpacket < 64) {
+			EP_MESSAGE(FFS_USB_FULL_SPEED, ep, "warning",
+				"wMaxPacketSize %d < 64 limits throughput",
+				ep->maxpacket);
+		}
+	} else if (ep->maxpacket >
+		   (ep->type == USB_ENDPOINT_XFER_INT ? 64 : 1023)) {
+		EP_MESSAGE(FFS_USB_FULL_SPEED, ep, "error",
+			"wMaxPacketSize %d too big", ep->maxpacket);
+		errors++;
+	}
+
+	if (ep->type == USB_ENDPOINT_XFER_INT && !ep->desc->bInterval) {
+		EP_MESSAGE(FFS_USB_FULL_SPEED, ep, "error",
+			"bInterval must be 1 - 255");
+		errors++;
+	}
+
+	return errors;
+}
+
+static int ffs_check_hs_ep(struct ffs_ep_info *ep)
+{
+	/* Smallest packet worth each number of additional transactions */
+	static const int mult_min[] = {0, 513, 683};
+	int errors = 0;
+
+	if (ep->type == USB_ENDPOINT_XFER_BULK) {
+		if (ep->mult) {
+			EP_MESSAGE(FFS_USB_HIGH_SPEED, ep, "error",
+				"additional transactions on bulk endpoint");
+			errors++;
+		}
+		if (ep->maxpacket > 512) {
+			EP_MESSAGE(FFS_USB_HIGH_SPEED, ep, "error",
+				"bulk wMaxPacketSize must be 512");
+			errors++;
+		} else if (ep->maxpacket < 512) {
+			EP_MESSAGE(FFS_USB_HIGH_SPEED, ep, "warning",
+				"wMaxPacketSize %d < 512 limits throughput",
+				ep->maxpacket);
+		}
+		return errors;
+	}
+
+	if (ep->maxpacket > 1024) {
+		EP_MESSAGE(FFS_USB_HIGH_SPEED, ep, "error",
+			"wMaxPacketSize %d too big", ep->maxpacket);
+		errors++;
+	}
+	if (ep->mult > 2) {
+		EP_MESSAGE(FFS_USB_HIGH_SPEED, ep, "error",
+			"reserved number of additional transactions");
+		errors++;
+	} else if (ep->maxpacket < mult_min[ep->mult]) {
+		EP_MESSAGE(FFS_USB_HIGH_SPEED, ep, "warning",
+			"%d transactions of %d bytes, fewer would do",
+			ep->mult + 1, ep->maxpacket);
+	}
+
+	return errors;
+}
+
+static int ffs_check_ss_ep(int speed, struct ffs_ep_info *ep)
+{
+	int max_burst;
+	int errors = 0;
+
+	if (!ep->comp) {
+		EP_MESSAGE(speed, ep, "error", "companion descriptor missing");
+		return 1;
+	}
+
+	if (ep->type == USB_ENDPOINT_XFER_BULK) {
+		if (ep->maxpacket != 1024) {
+			EP_MESSAGE(speed, ep, "error",
+				"bulk wMaxPacketSize must be 1024");
+			errors++;
+		}
+		if (!ep->burst)
+			EP_MESSAGE(speed, ep, "warning",
+				"bMaxBurst 0 limits throughput");
+	} else if (ep->maxpacket > 1024) {
+		EP_MESSAGE(speed, ep, "error",
+			"wMaxPacketSize %d too big", ep->maxpacket);
+		errors++;
+	} else if (ep->burst && ep->maxpacket != 1024) {
+		EP_MESSAGE(speed, ep, "error",
+			"bursts require wMaxPacketSize 1024");
+		errors++;
+	}
+
+	max_burst = ep->type == USB_ENDPOINT_XFER_INT ? 2 : 15;
+	if (ep->burst > max_burst) {
+		EP_MESSAGE(speed, ep, "error",
+			"bMaxBurst must be 0 - %d", max_burst);
+		errors++;
+	}
+	if (ep->type == USB_ENDPOINT_XFER_ISOC && ep->mult > 2) {
+		EP_MESSAGE(speed, ep, "error", "Mult must be 0 - 2");
+		errors++;
+	}
+	if (IS_PERIODIC(ep) && !ep->comp->wBytesPerInterval)
+		EP_MESSAGE(speed, ep, "warning",
+			"wBytesPerInterval not set, %d bytes reserved",
+			ep->bytes);
+	else if (IS_PERIODIC(ep) &&
+		 le16toh(ep->comp->wBytesPerInterval) > ep->bytes) {
+		EP_MESSAGE(speed, ep, "error",
+			"wBytesPerInterval exceeds %d bytes per interval",
+			ep->bytes);
+		errors++;
+	}
+
+	return errors;
+}
+
+/**
+ * @brief Validate endpoint descriptor for given speed
+ * @return Number of errors found
+ */
+static int ffs_check_ep(int speed, struct ffs_ep_info *ep)
+{
+	int interval = ep->desc->bInterval;
+	int errors = 0;
+
+	if (ep->type == USB_ENDPOINT_XFER_CONTROL) {
+		EP_MESSAGE(speed, ep, "error", "control endpoints not allowed");
+		return 1;
+	}
+
+	if (!ep->maxpacket) {
+		EP_MESSAGE(speed, ep, "error", "wMaxPacketSize not defined");
+		return 1;
+	}
+
+	if (speed != FFS_USB_HIGH_SPEED &&
+	    USB_EP_MAXP_MULT(le16toh(ep->desc->wMaxPacketSize))) {
+		EP_MESSAGE(speed, ep, "error",
+			"additional transactions are high-speed only");
+		errors++;
+	}
+
+	if (ep->comp && !IS_SUPER_SPEED(speed)) {
+		EP_MESSAGE(speed, ep, "error",
+			"companion descriptor is super-speed only");
+		errors++;
+	}
+
+	/* Full-speed interrupt is checked separately, bulk has no interval */
+	if (IS_PERIODIC(ep) && (interval < 1 || interval > 16) &&
+	    !(speed == FFS_USB_FULL_SPEED &&
+	      ep->type == USB_ENDPOINT_XFER_INT)) {
+		EP_MESSAGE(speed, ep, "error", "bInterval must be 1 - 16");
+		errors++;
+	}
+
+	if (speed == FFS_USB_FULL_SPEED)
+		errors += ffs_check_fs_ep(ep);
+	else if (speed == FFS_USB_HIGH_SPEED)
+		errors += ffs_check_hs_ep(ep);
+	else
+		errors += ffs_check_ss_ep(speed, ep);
+
+	return errors;
+}
+
+static int ffs_analyze_speed(int speed, struct ffs_desc_per_speed *desc)
+{
+	const struct ffs_speed_limits *lim = &speed_limits[speed];
+	struct ffs_ep_info ep;
+	unsigned long long rate, burst_rate, burst_ns;
+	int report = cmd_flags & OPT_REPORT;
+	int offset, limit, left, packets;
+	int reserved = 0, errors = 0;
+
+	if (report)
+		printf("%s:\n", lim->name);
+
+	offset = 0;
+	while (ffs_next_ep(desc, &offset, &ep)) {
+		ffs_decode_ep(speed, &ep);
+		errors += ffs_check_ep(speed, &ep);
+		if (!IS_PERIODIC(&ep))
+			continue;
+
+		/* Worst case, all periodic endpoints land in one frame */
+		reserved += ep.bytes + ep.packets *
+			(ep.type == USB_ENDPOINT_XFER_ISOC ?
+			 lim->iso_overhead : lim->int_overhead);
+
+		rate = (unsigned long long)ep.bytes * 1000000 /
+			(ep.interval * lim->frame_us);
+		if (report)
+			printf("  endpoint 0x%02x: %s, %d bytes every %d us, "
+				"%llu B/s\n", ep.address, ep_type_strs[ep.type],
+				ep.bytes, ep.interval * lim->frame_us, rate);
+	}
+
+	limit = lim->frame_bytes * lim->periodic_pct / 100;
+	if (reserved > limit) {
+		fprintf(stderr, "%s: error: periodic endpoints reserve %d of "
+			"%d bytes per %s\n", lim->name, reserved, limit,
+			lim->frame);
+		errors++;
+	}
+	if (report)
+		printf("  periodic: %d of %d bytes per %s\n",
+			reserved, limit, lim->frame);
+
+	/* Bulk gets what periodic transfers leave, shared by all of them */
+	left = lim->frame_bytes - (reserved < limit ? reserved : limit);
+	offset = 0;
+	while (report && ffs_next_ep(desc, &offset, &ep)) {
+		ffs_decode_ep(speed, &ep);
+		if (ep.type != USB_ENDPOINT_XFER_BULK || !ep.maxpacket)
+			continue;
+
+		packets = left / (ep.maxpacket + lim->bulk_overhead);
+		rate = (unsigned long long)packets * ep.maxpacket * 1000000 /
+			lim->frame_us;
+		printf("  endpoint 0x%02x: bulk, up to %llu B/s",
+			ep.address, rate);
+
+		/* Burst is sent at bus rate, then sender waits for ACK */
+		if (lim->round_trip_ns) {
+			burst_ns = (unsigned long long)ep.packets *
+				(ep.maxpacket + lim->bulk_overhead) *
+				lim->frame_us * 1000 / lim->frame_bytes +
+				lim->round_trip_ns;
+			burst_rate = (unsigned long long)ep.bytes *
+				1000000000 / burst_ns;
+			if (burst_rate < rate)
+				printf(", %llu B/s with bMaxBurst %d",
+					burst_rate, ep.burst);
+		}
+		printf("\n");
+	}
+
+	return errors;
+}
+
+int ffs_analyze_desc(struct ffs_desc_per_speed *desc, int mask)
+{
+	int i, j = 0;
+	int errors = 0;
+
+	for (i = FFS_USB_FULL_SPEED; i < FFS_USB_TERMINATOR; i = i << 1)
+		if (i & mask)
+			errors += ffs_analyze_speed(i, &desc[j++]);
+
+	return errors;
+}
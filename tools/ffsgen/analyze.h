@@ -0,0 +1,35 @@
+/*
+ * analyze.h
+ * Copyright(c) 2015 Samsung Electronics Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANALYZE_H
+#define ANALYZE_H
+
+#include "desc-parse.h"
+
+/**
+ * @brief Check endpoint descriptors against bus limits of each speed
+ * @details Validate wMaxPacketSize, bInterval and companion values, sum
+ * 	periodic bandwidth reserved per (micro)frame and estimate best-case
+ * 	bulk throughput. Errors and warnings are always printed, full report
+ * 	only when OPT_REPORT is set.
+ * @param[in] desc List of descriptors
+ * @param[in] mask Bit mask containing speeds present in given descriptor
+ * @return Number of errors found
+ */
+int ffs_analyze_desc(struct ffs_desc_per_speed *desc, int mask);
+
+#endif /* ANALYZE_H */
@@ -34,6 +34,7 @@ typedef enum  {
 
 enum {
 	OPT_FORCE = 0x01,
+	OPT_REPORT = 0x02,
 };
 
 /**
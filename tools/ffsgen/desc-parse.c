@@ -16,6 +16,7 @@
  */
 
 #include "desc-parse.h"
+#include "analyze.h"
 #include "common.h"
 #include <string.h>
 #include <stdlib.h>
@@ -227,6 +228,36 @@ static int ffs_lookup_desc_attributes(config_setting_t *root, __u8 *att)
 	return SUCCESS;
 }
 
+/**
+ * @brief Read optional integer field of descriptor
+ * @param[in] root Setting containing descriptor definition
+ * @param[in] name Name of field
+ * @param[in] max Maximum value of field
+ * @param[out] dst Pointer to integer to be filled with value of field
+ * @return ERROR_NOT_FOUND if field is not defined, other error code if failed
+ */
+static int ffs_lookup_desc_int(config_setting_t *root, const char *name,
+		int max, int *dst)
+{
+	config_setting_t *node;
+	int tmp;
+
+	node = config_setting_get_member(root, name);
+	if (node == NULL)
+		return ERROR_NOT_FOUND;
+
+	tmp = ffs_setting_get_int(node, dst);
+	if (tmp < 0)
+		return tmp;
+
+	if (*dst > max || *dst < 0) {
+		CONFIG_ERROR(node, "out of range");
+		return ERROR_BAD_VALUE;
+	}
+
+	return SUCCESS;
+}
+
 static int ffs_parse_ep_desc_no_audio(config_setting_t *root,
 	struct usb_endpoint_descriptor_no_audio *desc)
 {
@@ -279,6 +310,50 @@ static int ffs_parse_ep_desc_no_audio(config_setting_t *root,
 		return ERROR_BAD_VALUE;
 	}
 
+	/* Includes additional transactions bits for high-speed */
+	tmp = ffs_lookup_desc_int(root, "wMaxPacketSize", USHRT_MAX, &res);
+	if (tmp < 0 && tmp != ERROR_NOT_FOUND)
+		return tmp;
+	else if (tmp == SUCCESS)
+		desc->wMaxPacketSize = htole16(res);
+
+	tmp = ffs_lookup_desc_int(root, "bInterval", UCHAR_MAX, &res);
+	if (tmp < 0 && tmp != ERROR_NOT_FOUND)
+		return tmp;
+	else if (tmp == SUCCESS)
+		desc->bInterval = res;
+
+	return SUCCESS;
+}
+
+static int ffs_parse_ss_ep_comp_desc(config_setting_t *root,
+	struct usb_ss_ep_comp_descriptor *desc)
+{
+	int res;
+	int tmp;
+
+	desc->bLength = USB_DT_SS_EP_COMP_SIZE;
+	desc->bDescriptorType = USB_DT_SS_ENDPOINT_COMP;
+
+	tmp = ffs_lookup_desc_int(root, "bMaxBurst", UCHAR_MAX, &res);
+	if (tmp < 0 && tmp != ERROR_NOT_FOUND)
+		return tmp;
+	else if (tmp == SUCCESS)
+		desc->bMaxBurst = res;
+
+	/* Mult for isochronous, MaxStreams for bulk endpoints */
+	tmp = ffs_lookup_desc_int(root, "bmAttributes", UCHAR_MAX, &res);
+	if (tmp < 0 && tmp != ERROR_NOT_FOUND)
+		return tmp;
+	else if (tmp == SUCCESS)
+		desc->bmAttributes = res;
+
+	tmp = ffs_lookup_desc_int(root, "wBytesPerInterval", USHRT_MAX, &res);
+	if (tmp < 0 && tmp != ERROR_NOT_FOUND)
+		return tmp;
+	else if (tmp == SUCCESS)
+		desc->wBytesPerInterval = htole16(res);
+
 	return SUCCESS;
 }
 
@@ -433,7 +508,8 @@ static int ffs_fill_desc_list(config_setting_t *list, struct ffs_desc_per_speed
 	const char *buff;
 	config_setting_t *group;
 	struct usb_interface_descriptor *inter = NULL;
-	struct usb_endpoint_descriptor_no_audio *ep;
+	struct usb_endpoint_descriptor_no_audio *ep = NULL;
+	struct usb_ss_ep_comp_descriptor *comp;
 
 	len = config_setting_length(list);
 
@@ -457,6 +533,8 @@ static int ffs_fill_desc_list(config_setting_t *list, struct ffs_desc_per_speed
 			desc->desc_size += sizeof(*inter);
 		else if (strcmp(buff, "EP_NO_AUDIO_DESC") == 0)
 			desc->desc_size += sizeof(*ep);
+		else if (strcmp(buff, "SS_EP_COMP_DESC") == 0)
+			desc->desc_size += sizeof(*comp);
 		else {
 			CONFIG_ERROR(group, "%s descriptor type unsupported", buff);
 			return ERROR_NOT_SUPPORTED;
@@ -502,6 +580,19 @@ static int ffs_fill_desc_list(config_setting_t *list, struct ffs_desc_per_speed
 
 			inter->bNumEndpoints++;
 			pos += sizeof(*ep);
+		} else if (strcmp(buff, "SS_EP_COMP_DESC") == 0) {
+			if (ep == NULL || (char *)(ep + 1) != pos) {
+				CONFIG_ERROR(group,
+				"companion descriptor must follow endpoint descriptor");
+				tmp = ERROR_OTHER_ERROR;
+				goto out;
+			}
+			comp = (struct usb_ss_ep_comp_descriptor *)pos;
+			tmp = ffs_parse_ss_ep_comp_desc(group, comp);
+			if (tmp < 0)
+				goto out;
+
+			pos += sizeof(*comp);
 		}
 	}
 
@@ -571,9 +662,15 @@ int ffs_parse_desc_config(config_setting_t *root, void **data, int str_count)
 		return ERROR_OTHER_ERROR;
 	}
 
-	ret = desc_to_binary(data, desc, mask);
-	if (ret < 0)
-		CONFIG_ERROR(group, "error in descriptors serialization");
+	ret = ffs_analyze_desc(desc, mask);
+	if (ret > 0 && !(cmd_flags & OPT_FORCE)) {
+		CONFIG_ERROR(group, "%d errors in descriptors", ret);
+		ret = ERROR_BAD_VALUE;
+	} else {
+		ret = desc_to_binary(data, desc, mask);
+		if (ret < 0)
+			CONFIG_ERROR(group, "error in descriptors serialization");
+	}
 
 	j = 0;
 	for (i = 1; i < FFS_USB_TERMINATOR; i = i << 1)
@@ -34,6 +34,8 @@ static void usage()
 		"  -f --descriptors-format <version> Select format of descriptors"
 		"  (allow legacy format). Default is the newest one avaible.\n"
 		"  --list-desc-formats\tShow list of available descriptor formats\n"
+		"  -r --report\tPrint bandwidth and throughput of endpoints\n"
+		"  --force\tWrite descriptors despite errors found in them\n"
 		"  -h --help\tPrint this help\n");
 }
 
@@ -60,10 +62,12 @@ int main(int argc, char **argv)
 			{"strings-file", required_argument, 0, 's'},
 			{"descriptors-format", required_argument, 0, 'f'},
 			{"list-desc-formats", no_argument, 0, 1},
+			{"report", no_argument, 0, 'r'},
+			{"force", no_argument, 0, 2},
 			{0, 0, 0, 0}
 		};
 
-		c = getopt_long(argc, argv, "hd:s:f:", opts, &option_index);
+		c = getopt_long(argc, argv, "hd:s:f:r", opts, &option_index);
 
 		if (c == -1)
 			break;
@@ -89,6 +93,12 @@ int main(int argc, char **argv)
 			list_desc_formats();
 			goto out;
 			break;
+		case 'r':
+			cmd_flags |= OPT_REPORT;
+			break;
+		case 2:
+			cmd_flags |= OPT_FORCE;
+			break;
 		default:
 			usage();
 			ret = c == 'h' ? 0 : -EINVAL;
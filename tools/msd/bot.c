@@ -0,0 +1,763 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "bot.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MSD_CBW_SIGN		0x43425355	/* "USBC" */
+#define MSD_CSW_SIGN		0x53425355	/* "USBS" */
+#define MSD_CBW_LEN		31
+#define MSD_CBW_IN		0x80
+
+#define MSD_STATUS_PASSED	0
+#define MSD_STATUS_FAILED	1
+#define MSD_STATUS_PHASE	2
+
+/* Class requests, interface recipient */
+#define MSD_REQ_RESET		0xff
+#define MSD_REQ_GET_MAX_LUN	0xfe
+
+/* Waiting for CBW rechecks stop flag this often */
+#define MSD_POLL_MS		100
+
+#define SCSI_TEST_UNIT_READY	0x00
+#define SCSI_REQUEST_SENSE	0x03
+#define SCSI_READ_6		0x08
+#define SCSI_WRITE_6		0x0a
+#define SCSI_INQUIRY		0x12
+#define SCSI_MODE_SENSE_6	0x1a
+#define SCSI_START_STOP_UNIT	0x1b
+#define SCSI_PREVENT_ALLOW	0x1e
+#define SCSI_READ_FORMAT_CAPS	0x23
+#define SCSI_READ_CAPACITY_10	0x25
+#define SCSI_READ_10		0x28
+#define SCSI_WRITE_10		0x2a
+#define SCSI_VERIFY_10		0x2f
+#define SCSI_SYNCHRONIZE_CACHE	0x35
+#define SCSI_MODE_SENSE_10	0x5a
+#define SCSI_READ_16		0x88
+#define SCSI_WRITE_16		0x8a
+#define SCSI_SERVICE_ACTION_IN	0x9e
+#define SCSI_READ_CAPACITY_16	0x10
+
+/* Sense key, additional sense code and qualifier */
+#define SENSE_INVALID_OPCODE	0x05, 0x20, 0x00
+#define SENSE_LBA_OUT_OF_RANGE	0x05, 0x21, 0x00
+#define SENSE_INVALID_FIELD	0x05, 0x24, 0x00
+#define SENSE_LUN_NOT_SUPPORTED	0x05, 0x25, 0x00
+#define SENSE_WRITE_PROTECTED	0x07, 0x27, 0x00
+#define SENSE_READ_ERROR	0x03, 0x11, 0x00
+#define SENSE_WRITE_ERROR	0x03, 0x0c, 0x00
+
+enum msd_dir {
+	MSD_NONE,
+	MSD_IN,
+	MSD_OUT,
+};
+
+/* Setup handlers have no context */
+static struct msd *msd_instance;
+
+static inline uint16_t get_be16(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+	return (uint32_t)get_be16(p) << 16 | get_be16(p + 2);
+}
+
+static inline uint64_t get_be64(const uint8_t *p)
+{
+	return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static inline void put_be16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static inline void put_be32(uint8_t *p, uint32_t v)
+{
+	put_be16(p, v >> 16);
+	put_be16(p + 2, v);
+}
+
+static inline void put_be64(uint8_t *p, uint64_t v)
+{
+	put_be32(p, v >> 32);
+	put_be32(p + 4, v);
+}
+
+static inline int msd_flag(int *flag)
+{
+	return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+}
+
+static enum msd_dir msd_host_dir(struct msd *msd)
+{
+	if (!msd->cbw.dCBWDataTransferLength)
+		return MSD_NONE;
+
+	return msd->cbw.bmCBWFlags & MSD_CBW_IN ? MSD_IN : MSD_OUT;
+}
+
+static uint16_t msd_maxpacket(struct msd *msd)
+{
+	struct usbf_endpoint_info info;
+
+	if (usbf_endpoint_get_info(msd->in, &info) || !info.maxpacketsize)
+		return 512;
+
+	return info.maxpacketsize;
+}
+
+static int msd_fail(struct msd *msd, struct lun *lun,
+	uint8_t key, uint8_t asc, uint8_t ascq)
+{
+	lun_set_sense(lun, key, asc, ascq);
+	msd->status = MSD_STATUS_FAILED;
+
+	return 0;
+}
+
+/*
+ * Checks data phase command needs against one host announced in CBW.
+ * Mismatch in direction or host expecting less (BOT cases 2, 3, 7, 8,
+ * 10 and 13) is phase error, nothing is transferred then.
+ */
+static int msd_check_phase(struct msd *msd, enum msd_dir dir, uint64_t length)
+{
+	if (!length)
+		return 0;
+
+	if (msd_host_dir(msd) != dir ||
+	    length > msd->cbw.dCBWDataTransferLength) {
+		msd->status = MSD_STATUS_PHASE;
+		msd->stats.phase_errors++;
+		return -EPROTO;
+	}
+
+	return 0;
+}
+
+static int msd_interrupted(struct msd *msd)
+{
+	return msd_flag(&msd->reset) || msd_flag(&msd->stop);
+}
+
+/*
+ * Reset can come between the check and submission, when there is nothing
+ * to cancel yet. Transfer is checked again once it's done then and its
+ * result is dropped, it belongs to command host has given up on.
+ */
+static int msd_send(struct msd *msd, void *data, size_t length)
+{
+	int ret;
+
+	/* Don't start new transfer once host asked for reset */
+	if (msd_interrupted(msd))
+		return -ECANCELED;
+
+	ret = usbf_transfer(msd->in, data, length);
+	if (msd_interrupted(msd))
+		return -ECANCELED;
+	if (ret < 0)
+		return -errno;
+
+	msd->residue -= ret;
+	if (ret % msd_maxpacket(msd))
+		msd->short_packet = 1;
+
+	return ret;
+}
+
+static int msd_recv(struct msd *msd, void *data, size_t length)
+{
+	int ret;
+
+	if (msd_interrupted(msd))
+		return -ECANCELED;
+
+	ret = usbf_transfer(msd->out, data, length);
+	if (msd_interrupted(msd))
+		return -ECANCELED;
+	if (ret < 0)
+		return -errno;
+
+	msd->residue -= ret;
+
+	return ret;
+}
+
+/*
+ * Host expects more data than was transferred (BOT cases 4, 5, 9, 11),
+ * its data phase ends with STALL unless short packet did already.
+ */
+static void msd_end_data(struct msd *msd)
+{
+	enum msd_dir dir = msd_host_dir(msd);
+
+	if (!msd->residue || dir == MSD_NONE)
+		return;
+	if (dir == MSD_IN && msd->short_packet)
+		return;
+
+	usbf_endpoint_halt(dir == MSD_IN ? msd->in : msd->out);
+}
+
+static int msd_reply(struct msd *msd, void *data, size_t length)
+{
+	int ret;
+
+	if (msd_check_phase(msd, MSD_IN, length) || !length)
+		return 0;
+
+	ret = msd_send(msd, data, length);
+
+	return ret < 0 ? ret : 0;
+}
+
+static size_t msd_alloc(size_t length, size_t allocation)
+{
+	return length < allocation ? length : allocation;
+}
+
+static int msd_inquiry(struct msd *msd, struct lun *lun, int valid,
+	uint8_t *reply)
+{
+	uint8_t *cb = msd->cbw.CBWCB;
+
+	/* No vital product data pages */
+	if (cb[1] & 0x01 || cb[2])
+		return msd_fail(msd, lun, SENSE_INVALID_FIELD);
+
+	memset(reply, 0, 36);
+	reply[0] = valid ? 0x00 : 0x7f;
+	reply[1] = 0x80;	/* Removable */
+	reply[2] = 0x02;
+	reply[3] = 0x02;
+	reply[4] = 36 - 5;
+	memcpy(reply + 8, "libusbf ", 8);
+	memcpy(reply + 16, "Mass Storage    ", 16);
+	memcpy(reply + 32, "0001", 4);
+
+	return msd_reply(msd, reply, msd_alloc(36, get_be16(cb + 3)));
+}
+
+static int msd_request_sense(struct msd *msd, struct lun *lun, int valid,
+	uint8_t *reply)
+{
+	if (!valid)
+		lun_set_sense(lun, SENSE_LUN_NOT_SUPPORTED);
+
+	memset(reply, 0, 18);
+	reply[0] = 0x70;	/* Current error, fixed format */
+	reply[2] = lun->sense_key;
+	reply[7] = 18 - 8;
+	reply[12] = lun->asc;
+	reply[13] = lun->ascq;
+	lun_set_sense(lun, 0, 0, 0);
+
+	return msd_reply(msd, reply, msd_alloc(18, msd->cbw.CBWCB[4]));
+}
+
+static int msd_mode_sense(struct msd *msd, struct lun *lun, uint8_t *reply)
+{
+	uint8_t *cb = msd->cbw.CBWCB;
+	int ten = cb[0] == SCSI_MODE_SENSE_10;
+	int page = cb[2] & 0x3f;
+	size_t length, header = ten ? 8 : 4;
+
+	/* Saved values are not supported */
+	if (cb[2] >> 6 == 3 || (page && page != 0x08 && page != 0x3f))
+		return msd_fail(msd, lun, SENSE_INVALID_FIELD);
+
+	length = header;
+	memset(reply, 0, header + 20);
+	if (page) {
+		/* Caching page, write cache is on unless I/O is direct */
+		reply[length] = 0x08;
+		reply[length + 1] = 20 - 2;
+		reply[length + 2] = lun->direct ? 0x00 : 0x04;
+		length += 20;
+	}
+
+	if (ten) {
+		put_be16(reply, length - 2);
+		reply[3] = lun->readonly ? 0x80 : 0x00;
+	} else {
+		reply[0] = length - 1;
+		reply[2] = lun->readonly ? 0x80 : 0x00;
+	}
+
+	return msd_reply(msd, reply, msd_alloc(length,
+		ten ? get_be16(cb + 7) : cb[4]));
+}
+
+static int msd_read_format_capacities(struct msd *msd, struct lun *lun,
+	uint8_t *reply)
+{
+	uint64_t blocks = lun->blocks;
+
+	memset(reply, 0, 12);
+	reply[3] = 8;
+	put_be32(reply + 4, blocks > UINT32_MAX ? UINT32_MAX : blocks);
+	put_be32(reply + 8, lun->block_size);
+	reply[8] = 0x02;	/* Formatted media */
+
+	return msd_reply(msd, reply,
+		msd_alloc(12, get_be16(msd->cbw.CBWCB + 7)));
+}
+
+static int msd_read_capacity(struct msd *msd, struct lun *lun,
+	uint8_t *reply)
+{
+	uint64_t last = lun->blocks - 1;
+
+	put_be32(reply, last > UINT32_MAX ? UINT32_MAX : last);
+	put_be32(reply + 4, lun->block_size);
+
+	return msd_reply(msd, reply, 8);
+}
+
+static int msd_read_capacity_16(struct msd *msd, struct lun *lun,
+	uint8_t *reply)
+{
+	memset(reply, 0, 32);
+	put_be64(reply, lun->blocks - 1);
+	put_be32(reply + 8, lun->block_size);
+
+	return msd_reply(msd, reply,
+		msd_alloc(32, get_be32(msd->cbw.CBWCB + 10)));
+}
+
+static void msd_submit(struct msd *msd, struct msd_buffer *buf,
+	struct lun *lun, int write, uint64_t offset, size_t length)
+{
+	buf->length = length;
+	buf->pending = 1;
+	/* Failure is reported by msd_complete() */
+	lun_io_submit(msd->ctx, lun, &buf->io, write, buf->data, length,
+		offset);
+}
+
+static int msd_complete(struct msd *msd, struct msd_buffer *buf)
+{
+	if (!buf->pending)
+		return 0;
+	buf->pending = 0;
+
+	return lun_io_wait(msd->ctx, &buf->io) == (long)buf->length ?
+		0 : -EIO;
+}
+
+/* Waits for all backing file I/O, fails if any of it did */
+static int msd_drain(struct msd *msd)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < MSD_BUFFERS; ++i)
+		if (msd_complete(msd, &msd->buffers[i]))
+			ret = -EIO;
+
+	return ret;
+}
+
+static size_t msd_chunk(struct msd *msd, struct lun *lun, uint64_t left)
+{
+	size_t chunk = msd->buf_size - msd->buf_size % lun->block_size;
+
+	return left < chunk ? left : chunk;
+}
+
+/* Reading of next chunk from file overlaps with sending current one */
+static int msd_read(struct msd *msd, struct lun *lun, uint64_t lba,
+	uint32_t count)
+{
+	uint64_t offset, length, submitted = 0, sent = 0;
+	struct msd_buffer *buf;
+	size_t chunk;
+	int i, ret = 0;
+
+	if (lba > lun->blocks || count > lun->blocks - lba)
+		return msd_fail(msd, lun, SENSE_LBA_OUT_OF_RANGE);
+
+	length = (uint64_t)count * lun->block_size;
+	if (msd_check_phase(msd, MSD_IN, length))
+		return 0;
+	offset = lba * lun->block_size;
+
+	for (i = 0; i < MSD_BUFFERS && submitted < length; ++i) {
+		chunk = msd_chunk(msd, lun, length - submitted);
+		msd_submit(msd, &msd->buffers[i], lun, 0, offset + submitted,
+			chunk);
+		submitted += chunk;
+	}
+
+	for (i = 0; sent < length; i = (i + 1) % MSD_BUFFERS) {
+		buf = &msd->buffers[i];
+		if (msd_complete(msd, buf))
+			break;
+		ret = msd_send(msd, buf->data, buf->length);
+		if (ret < 0)
+			break;
+		sent += buf->length;
+
+		if (submitted < length) {
+			chunk = msd_chunk(msd, lun, length - submitted);
+			msd_submit(msd, buf, lun, 0, offset + submitted, chunk);
+			submitted += chunk;
+		}
+	}
+
+	msd_drain(msd);
+	msd->stats.read_bytes += sent;
+	if (ret < 0)
+		return ret;
+	if (sent < length)
+		return msd_fail(msd, lun, SENSE_READ_ERROR);
+
+	return 0;
+}
+
+/* Receiving of next chunk from host overlaps with writing current one */
+static int msd_write(struct msd *msd, struct lun *lun, uint64_t lba,
+	uint32_t count)
+{
+	uint64_t offset, length, received = 0;
+	struct msd_buffer *buf;
+	size_t chunk;
+	int i, error = 0, ret = 0;
+
+	if (lun->readonly)
+		return msd_fail(msd, lun, SENSE_WRITE_PROTECTED);
+	if (lba > lun->blocks || count > lun->blocks - lba)
+		return msd_fail(msd, lun, SENSE_LBA_OUT_OF_RANGE);
+
+	length = (uint64_t)count * lun->block_size;
+	if (msd_check_phase(msd, MSD_OUT, length))
+		return 0;
+	offset = lba * lun->block_size;
+
+	for (i = 0; received < length; i = (i + 1) % MSD_BUFFERS) {
+		buf = &msd->buffers[i];
+		if (msd_complete(msd, buf)) {
+			error = 1;
+			break;
+		}
+
+		chunk = msd_chunk(msd, lun, length - received);
+		ret = msd_recv(msd, buf->data, chunk);
+		if (ret < 0)
+			break;
+		if ((size_t)ret != chunk) {
+			error = 1;
+			break;
+		}
+		msd_submit(msd, buf, lun, 1, offset + received, chunk);
+		received += chunk;
+	}
+
+	if (msd_drain(msd))
+		error = 1;
+	if (ret < 0)
+		return ret;
+	if (error)
+		return msd_fail(msd, lun, SENSE_WRITE_ERROR);
+	msd->stats.written_bytes += received;
+
+	return 0;
+}
+
+static int msd_cdb_length(uint8_t opcode)
+{
+	switch (opcode >> 5) {
+	case 0:
+		return 6;
+	case 1:
+	case 2:
+		return 10;
+	case 4:
+		return 16;
+	case 5:
+		return 12;
+	default:
+		return 1;
+	}
+}
+
+/* Returns negative errno only when command was interrupted */
+static int msd_execute(struct msd *msd)
+{
+	uint8_t *cb = msd->cbw.CBWCB;
+	struct lun *lun = &msd->luns[msd->cbw.bCBWLUN];
+	uint8_t *reply = msd->buffers[0].data;
+	int valid = msd->cbw.bCBWLUN < msd->lun_count;
+
+	if (cb[0] == SCSI_INQUIRY)
+		return msd_inquiry(msd, lun, valid, reply);
+	if (cb[0] == SCSI_REQUEST_SENSE)
+		return msd_request_sense(msd, lun, valid, reply);
+
+	if (!valid)
+		return msd_fail(msd, lun, SENSE_LUN_NOT_SUPPORTED);
+	if (msd->cbw.bCBWCBLength < msd_cdb_length(cb[0]))
+		return msd_fail(msd, lun, SENSE_INVALID_FIELD);
+
+	switch (cb[0]) {
+	case SCSI_TEST_UNIT_READY:
+	case SCSI_START_STOP_UNIT:
+	case SCSI_PREVENT_ALLOW:
+	case SCSI_VERIFY_10:
+		return 0;
+	case SCSI_SYNCHRONIZE_CACHE:
+		if (fdatasync(lun->fd) < 0)
+			return msd_fail(msd, lun, SENSE_WRITE_ERROR);
+		return 0;
+	case SCSI_MODE_SENSE_6:
+	case SCSI_MODE_SENSE_10:
+		return msd_mode_sense(msd, lun, reply);
+	case SCSI_READ_FORMAT_CAPS:
+		return msd_read_format_capacities(msd, lun, reply);
+	case SCSI_READ_CAPACITY_10:
+		return msd_read_capacity(msd, lun, reply);
+	case SCSI_SERVICE_ACTION_IN:
+		if ((cb[1] & 0x1f) != SCSI_READ_CAPACITY_16)
+			break;
+		return msd_read_capacity_16(msd, lun, reply);
+	case SCSI_READ_6:
+		return msd_read(msd, lun, (cb[1] & 0x1f) << 16 |
+			get_be16(cb + 2), cb[4] ? cb[4] : 256);
+	case SCSI_READ_10:
+		return msd_read(msd, lun, get_be32(cb + 2), get_be16(cb + 7));
+	case SCSI_READ_16:
+		return msd_read(msd, lun, get_be64(cb + 2), get_be32(cb + 10));
+	case SCSI_WRITE_6:
+		return msd_write(msd, lun, (cb[1] & 0x1f) << 16 |
+			get_be16(cb + 2), cb[4] ? cb[4] : 256);
+	case SCSI_WRITE_10:
+		return msd_write(msd, lun, get_be32(cb + 2), get_be16(cb + 7));
+	case SCSI_WRITE_16:
+		return msd_write(msd, lun, get_be64(cb + 2), get_be32(cb + 10));
+	}
+
+	return msd_fail(msd, lun, SENSE_INVALID_OPCODE);
+}
+
+static int msd_read_cbw(struct msd *msd)
+{
+	struct msd_cbw *cbw = &msd->cbw;
+	uint8_t *buf = msd->buffers[0].data;
+	int ret;
+
+	/* Bigger buffer than CBW, so that oversized one is noticed */
+	ret = usbf_transfer_timeout(msd->out, buf, 512, MSD_POLL_MS);
+	if (ret < 0)
+		return -errno;
+
+	memcpy(cbw, buf, sizeof(*cbw));
+	if (ret != MSD_CBW_LEN || le32toh(cbw->dCBWSignature) != MSD_CBW_SIGN ||
+	    cbw->bCBWLUN >= MSD_MAX_LUNS || !cbw->bCBWCBLength ||
+	    cbw->bCBWCBLength > sizeof(cbw->CBWCB))
+		return -EBADMSG;
+
+	cbw->dCBWDataTransferLength = le32toh(cbw->dCBWDataTransferLength);
+	msd->residue = cbw->dCBWDataTransferLength;
+	msd->status = MSD_STATUS_PASSED;
+	msd->short_packet = 0;
+
+	return 0;
+}
+
+static int msd_send_csw(struct msd *msd)
+{
+	struct msd_csw csw;
+	int ret;
+
+	csw.dCSWSignature = htole32(MSD_CSW_SIGN);
+	csw.dCSWTag = msd->cbw.dCBWTag;
+	csw.dCSWDataResidue = htole32(msd->residue);
+	csw.bCSWStatus = msd->status;
+
+	/* CSW of command host has reset must not answer next one */
+	if (msd_interrupted(msd))
+		return -ECANCELED;
+	ret = usbf_transfer(msd->in, &csw, sizeof(csw));
+
+	return ret < 0 ? -errno : 0;
+}
+
+/* Invalid CBW, endpoints stay halted until Reset Recovery */
+static void msd_wait_reset(struct msd *msd)
+{
+	usbf_endpoint_halt(msd->in);
+	usbf_endpoint_halt(msd->out);
+
+	while (!msd_interrupted(msd))
+		usleep(MSD_POLL_MS * 1000);
+}
+
+int msd_run(struct msd *msd)
+{
+	int ret;
+
+	while (!msd_flag(&msd->stop)) {
+		if (msd_flag(&msd->reset)) {
+			/* Host clears halts itself as part of recovery */
+			__atomic_store_n(&msd->reset, 0, __ATOMIC_RELEASE);
+			msd->stats.resets++;
+		}
+
+		ret = msd_read_cbw(msd);
+		if (ret == -EBADMSG) {
+			msd_wait_reset(msd);
+			continue;
+		}
+		if (ret == -ESHUTDOWN)
+			return ret;
+		if (ret)
+			continue;
+
+		msd->stats.commands++;
+		/* Interrupted by reset or stop, no CSW then */
+		if (msd_execute(msd) < 0)
+			continue;
+		if (msd->status == MSD_STATUS_FAILED)
+			msd->stats.failed++;
+		msd_end_data(msd);
+		msd_send_csw(msd);
+	}
+
+	return 0;
+}
+
+static int msd_reset_handler(const struct usbf_setup_request *setup)
+{
+	struct msd *msd = msd_instance;
+
+	if (setup->wLength)
+		return usbf_setup_stall(setup) < 0;
+
+	__atomic_store_n(&msd->reset, 1, __ATOMIC_RELEASE);
+	usbf_endpoint_cancel(msd->in);
+	usbf_endpoint_cancel(msd->out);
+
+	return usbf_setup_ack(setup) < 0;
+}
+
+void msd_stop(struct msd *msd)
+{
+	__atomic_store_n(&msd->stop, 1, __ATOMIC_RELEASE);
+	usbf_endpoint_cancel(msd->in);
+	usbf_endpoint_cancel(msd->out);
+}
+
+int msd_register(struct msd *msd)
+{
+	uint8_t max_lun;
+	int ret;
+
+	if (!msd->lun_count)
+		return -EINVAL;
+
+	msd_instance = msd;
+	max_lun = msd->lun_count - 1;
+	ret = usbf_register_setup_response(msd->func, 0xa1,
+		MSD_REQ_GET_MAX_LUN, 0, 0, &max_lun, 1);
+	if (ret)
+		return ret;
+
+	return usbf_register_setup_handler(msd->func, 0x21, MSD_REQ_RESET,
+		0, 0, msd_reset_handler);
+}
+
+int msd_add_lun(struct msd *msd, const char *path, int readonly)
+{
+	struct lun *lun;
+	int ret;
+
+	if (msd->lun_count == MSD_MAX_LUNS)
+		return -ENOSPC;
+
+	lun = &msd->luns[msd->lun_count];
+	ret = lun_open(lun, path, readonly);
+	if (ret)
+		return ret;
+	if (lun->block_size > msd->buf_size) {
+		lun_close(lun);
+		return -EINVAL;
+	}
+	msd->lun_count++;
+
+	return 0;
+}
+
+int msd_init(struct msd *msd, struct usbf_function *func,
+	struct usbf_endpoint *in, struct usbf_endpoint *out, size_t buf_size)
+{
+	int i, ret;
+
+	if (!buf_size || buf_size % LUN_ALIGN)
+		return -EINVAL;
+
+	memset(msd, 0, sizeof(*msd));
+	msd->func = func;
+	msd->in = in;
+	msd->out = out;
+	msd->buf_size = buf_size;
+	for (i = 0; i < MSD_MAX_LUNS; ++i)
+		msd->luns[i].fd = -1;
+
+	for (i = 0; i < MSD_BUFFERS; ++i) {
+		if (posix_memalign((void **)&msd->buffers[i].data, LUN_ALIGN,
+				buf_size)) {
+			ret = -ENOMEM;
+			goto err;
+		}
+	}
+
+	ret = lun_io_setup(&msd->ctx, MSD_BUFFERS);
+	if (ret)
+		goto err;
+
+	return 0;
+
+err:
+	while (i--)
+		free(msd->buffers[i].data);
+	return ret;
+}
+
+void msd_cleanup(struct msd *msd)
+{
+	int i;
+
+	msd_drain(msd);
+	lun_io_destroy(msd->ctx);
+	for (i = 0; i < MSD_BUFFERS; ++i)
+		free(msd->buffers[i].data);
+	for (i = 0; i < msd->lun_count; ++i)
+		lun_close(&msd->luns[i]);
+	if (msd_instance == msd)
+		msd_instance = NULL;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef BOT_H
+#define BOT_H
+
+#include <libusbf.h>
+#include "lun.h"
+
+/*
+ * USB Mass Storage Bulk-Only Transport engine serving SCSI block commands
+ * from backing files. Data phase of READ and WRITE is pipelined over
+ * MSD_BUFFERS buffers, so USB transfer of one chunk overlaps with
+ * backing file I/O of next one.
+ */
+
+/* Get Max LUN reports at most 15 */
+#define MSD_MAX_LUNS		16
+#define MSD_BUFFERS		2
+#define MSD_DEFAULT_BUF_SIZE	65536
+
+struct msd_cbw {
+	uint32_t dCBWSignature;
+	uint32_t dCBWTag;
+	uint32_t dCBWDataTransferLength;
+	uint8_t bmCBWFlags;
+	uint8_t bCBWLUN;
+	uint8_t bCBWCBLength;
+	uint8_t CBWCB[16];
+} __attribute__((packed));
+
+struct msd_csw {
+	uint32_t dCSWSignature;
+	uint32_t dCSWTag;
+	uint32_t dCSWDataResidue;
+	uint8_t bCSWStatus;
+} __attribute__((packed));
+
+struct msd_buffer {
+	uint8_t *data;
+	size_t length;
+	struct lun_io io;
+	/* Backing I/O submitted and its result not checked yet */
+	int pending;
+};
+
+struct msd_stats {
+	uint64_t commands;
+	uint64_t failed;
+	uint64_t phase_errors;
+	uint64_t resets;
+	uint64_t read_bytes;
+	uint64_t written_bytes;
+};
+
+struct msd {
+	struct usbf_function *func;
+	struct usbf_endpoint *in, *out;
+	struct lun luns[MSD_MAX_LUNS];
+	int lun_count;
+	aio_context_t ctx;
+	struct msd_buffer buffers[MSD_BUFFERS];
+	size_t buf_size;
+	/* Set from other threads, accessed atomically */
+	int reset;
+	int stop;
+	/* Command in progress */
+	struct msd_cbw cbw;
+	uint32_t residue;
+	uint8_t status;
+	/* Data phase ended with short packet, no need to stall */
+	int short_packet;
+	struct msd_stats stats;
+};
+
+/* buf_size has to be multiple of LUN_ALIGN */
+int msd_init(struct msd *msd, struct usbf_function *func,
+	struct usbf_endpoint *in, struct usbf_endpoint *out, size_t buf_size);
+
+void msd_cleanup(struct msd *msd);
+
+int msd_add_lun(struct msd *msd, const char *path, int readonly);
+
+/*
+ * Registers class requests (Get Max LUN, Bulk-Only Mass Storage Reset)
+ * in setup table of function. Setup handlers carry no context, so there
+ * can be only one registered engine per process.
+ */
+int msd_register(struct msd *msd);
+
+/* Serves commands until msd_stop() */
+int msd_run(struct msd *msd);
+
+/* Safe to call from other thread, interrupts transfers in progress */
+void msd_stop(struct msd *msd);
+
+#endif /* BOT_H */
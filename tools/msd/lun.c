@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "lun.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+
+#define LUN_IO_EVENTS	8
+
+static inline int io_setup(unsigned int nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static inline int io_getevents(aio_context_t ctx, long min_nr, long nr,
+	struct io_event *events, struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+/*
+ * Some file systems accept O_DIRECT at open and fail only on first I/O,
+ * or need bigger alignment than block size. Probe offset which isn't
+ * aligned any better than block size.
+ */
+static int lun_probe_direct(struct lun *lun)
+{
+	void *buf;
+	int ret = 0;
+
+	if (posix_memalign(&buf, LUN_ALIGN, lun->block_size))
+		return -ENOMEM;
+	if (pread(lun->fd, buf, lun->block_size,
+			lun->blocks > 1 ? lun->block_size : 0) < 0)
+		ret = -errno;
+	free(buf);
+
+	return ret;
+}
+
+int lun_open(struct lun *lun, const char *path, int readonly)
+{
+	int flags = (readonly ? O_RDONLY : O_RDWR) | O_CLOEXEC;
+	uint64_t size;
+	struct stat st;
+	int block_size;
+
+	lun->readonly = readonly;
+	lun->direct = 1;
+	lun->fd = open(path, flags | O_DIRECT);
+	if (lun->fd < 0 && errno == EINVAL) {
+		lun->direct = 0;
+		lun->fd = open(path, flags);
+	}
+	if (lun->fd < 0)
+		return -errno;
+
+	if (fstat(lun->fd, &st) < 0)
+		goto err;
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(lun->fd, BLKGETSIZE64, &size) < 0 ||
+		    ioctl(lun->fd, BLKSSZGET, &block_size) < 0)
+			goto err;
+		lun->block_size = block_size;
+	} else if (S_ISREG(st.st_mode)) {
+		size = st.st_size;
+		lun->block_size = 512;
+	} else {
+		errno = ENODEV;
+		goto err;
+	}
+
+	lun->blocks = size / lun->block_size;
+	if (!lun->blocks) {
+		errno = EINVAL;
+		goto err;
+	}
+
+	if (lun->direct && lun_probe_direct(lun) == -EINVAL) {
+		close(lun->fd);
+		lun->direct = 0;
+		lun->fd = open(path, flags);
+		if (lun->fd < 0)
+			return -errno;
+	}
+
+	lun_set_sense(lun, 0, 0, 0);
+
+	return 0;
+
+err:
+	close(lun->fd);
+	lun->fd = -1;
+	return -errno;
+}
+
+void lun_close(struct lun *lun)
+{
+	if (lun->fd >= 0)
+		close(lun->fd);
+	lun->fd = -1;
+}
+
+void lun_set_sense(struct lun *lun, uint8_t key, uint8_t asc, uint8_t ascq)
+{
+	lun->sense_key = key;
+	lun->asc = asc;
+	lun->ascq = ascq;
+}
+
+int lun_io_setup(aio_context_t *ctx, int nr)
+{
+	*ctx = 0;
+	return io_setup(nr, ctx) < 0 ? -errno : 0;
+}
+
+void lun_io_destroy(aio_context_t ctx)
+{
+	io_destroy(ctx);
+}
+
+int lun_io_submit(aio_context_t ctx, struct lun *lun, struct lun_io *io,
+	int write, void *buf, size_t length, uint64_t offset)
+{
+	struct iocb *iocbp = &io->iocb;
+	int ret;
+
+	memset(&io->iocb, 0, sizeof(io->iocb));
+	io->iocb.aio_data = (uintptr_t)io;
+	io->iocb.aio_lio_opcode = write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+	io->iocb.aio_fildes = lun->fd;
+	io->iocb.aio_buf = (uintptr_t)buf;
+	io->iocb.aio_nbytes = length;
+	io->iocb.aio_offset = offset;
+
+	ret = io_submit(ctx, 1, &iocbp);
+	if (ret != 1) {
+		/* Failed request completes with error right away */
+		io->result = ret < 0 ? -errno : -EAGAIN;
+		return io->result;
+	}
+	io->busy = 1;
+
+	return 0;
+}
+
+long lun_io_wait(aio_context_t ctx, struct lun_io *io)
+{
+	struct io_event events[LUN_IO_EVENTS];
+	struct lun_io *done;
+	int i, n;
+
+	while (io->busy) {
+		n = io_getevents(ctx, 1, LUN_IO_EVENTS, events, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		for (i = 0; i < n; ++i) {
+			done = (struct lun_io *)(uintptr_t)events[i].data;
+			done->result = events[i].res;
+			done->busy = 0;
+		}
+	}
+
+	return io->result;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef LUN_H
+#define LUN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/aio_abi.h>
+
+/* Buffers used for O_DIRECT I/O have to be aligned to this */
+#define LUN_ALIGN	4096
+
+/* Logical unit backed by regular file or block device */
+struct lun {
+	int fd;
+	int readonly;
+	/* Opened with O_DIRECT, page cache is bypassed */
+	int direct;
+	uint32_t block_size;
+	uint64_t blocks;
+	/* Sense data of last failed command */
+	uint8_t sense_key;
+	uint8_t asc;
+	uint8_t ascq;
+};
+
+/*
+ * Opens backing file with O_DIRECT, falling back to buffered I/O when
+ * file system doesn't support it or needs bigger alignment than block
+ * size. Block devices keep their logical block size, files use 512.
+ */
+int lun_open(struct lun *lun, const char *path, int readonly);
+
+void lun_close(struct lun *lun);
+
+void lun_set_sense(struct lun *lun, uint8_t key, uint8_t asc, uint8_t ascq);
+
+/* Request on backing file, completed asynchronously by kernel AIO */
+struct lun_io {
+	struct iocb iocb;
+	int busy;
+	long result;
+};
+
+int lun_io_setup(aio_context_t *ctx, int nr);
+
+void lun_io_destroy(aio_context_t ctx);
+
+/* When submission fails, io is left completed with error */
+int lun_io_submit(aio_context_t ctx, struct lun *lun, struct lun_io *io,
+	int write, void *buf, size_t length, uint64_t offset);
+
+/*
+ * Waits for io to complete and returns its result, number of bytes or
+ * negative errno. Completions of other requests met on the way are
+ * stored in their lun_io.
+ */
+long lun_io_wait(aio_context_t ctx, struct lun_io *io);
+
+#endif /* LUN_H */
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Mass storage function serving backing files or block devices as LUNs
+ * over Bulk-Only Transport. Backing I/O is done with kernel AIO, with
+ * O_DIRECT where possible, see bot.h.
+ */
+
+#include "bot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+/* ep0 loop rechecks stop flag this often */
+#define MSD_EVENTS_MS		100
+/* Engine waiting for ENABLE is woken up by usbf_stop() after this */
+#define MSD_STOP_TRIES		10
+
+static volatile sig_atomic_t msd_signalled;
+
+static void msd_signal(int sig)
+{
+	(void)sig;
+	msd_signalled = 1;
+}
+
+static void *msd_thread(void *arg)
+{
+	msd_run(arg);
+
+	return NULL;
+}
+
+static int msd_join(pthread_t thread, int timeout_ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += timeout_ms % 1000 * 1000000L;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_nsec -= 1000000000;
+		++ts.tv_sec;
+	}
+
+	return pthread_timedjoin_np(thread, NULL, &ts);
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options] <ffs directory>\n"
+		"  -f <file>  add LUN backed by file or block device\n"
+		"  -r <file>  add read-only LUN\n"
+		"  -b <size>  buffer size, multiple of %d (default %d)\n",
+		name, LUN_ALIGN, MSD_DEFAULT_BUF_SIZE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct usbf_function_descriptor f_desc = {
+		.speed = USBF_SPEED_FS | USBF_SPEED_HS | USBF_SPEED_SS,
+		.interface_class = USBF_CLASS_MASS_STORAGE,
+		.interface_subclass = 0x06,	/* SCSI transparent */
+		.interface_protocol = 0x50,	/* Bulk-Only */
+		.string = "MASS STORAGE",
+	};
+	struct usbf_endpoint_descriptor ep_desc = {
+		.type = USBF_BULK,
+		.fs_maxpacketsize = 64,
+		.hs_maxpacketsize = 512,
+		.ss_maxpacketsize = 1024,
+	};
+	struct usbf_function *func;
+	struct usbf_endpoint *in, *out;
+	const char *paths[MSD_MAX_LUNS];
+	int readonly[MSD_MAX_LUNS];
+	size_t buf_size = MSD_DEFAULT_BUF_SIZE;
+	struct sigaction sa;
+	struct msd msd;
+	pthread_t thread;
+	int i, opt, ret, count = 0, tries = 0, stopped = 0;
+
+	while ((opt = getopt(argc, argv, "f:r:b:h")) != -1) {
+		switch (opt) {
+		case 'f':
+		case 'r':
+			if (count == MSD_MAX_LUNS) {
+				fprintf(stderr, "too many LUNs\n");
+				return 1;
+			}
+			paths[count] = optarg;
+			readonly[count++] = opt == 'r';
+			break;
+		case 'b':
+			buf_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt != 'h';
+		}
+	}
+
+	if (optind != argc - 1 || !count) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	func = usbf_create_function(&f_desc, argv[optind]);
+	if (!func) {
+		fprintf(stderr, "function registration failed\n");
+		return 1;
+	}
+
+	ep_desc.direction = USBF_IN;
+	in = usbf_add_endpoint(func, &ep_desc);
+	ep_desc.direction = USBF_OUT;
+	out = usbf_add_endpoint(func, &ep_desc);
+	if (!in || !out) {
+		fprintf(stderr, "can't add endpoints\n");
+		goto err_func;
+	}
+
+	ret = msd_init(&msd, func, in, out, buf_size);
+	if (ret) {
+		fprintf(stderr, "can't init engine: %s\n", strerror(-ret));
+		goto err_func;
+	}
+
+	for (i = 0; i < count; ++i) {
+		ret = msd_add_lun(&msd, paths[i], readonly[i]);
+		if (ret) {
+			fprintf(stderr, "can't open %s: %s\n", paths[i],
+				strerror(-ret));
+			goto err_msd;
+		}
+		printf("LUN %d: %s, %llu blocks of %u bytes%s%s\n", i,
+			paths[i], (unsigned long long)msd.luns[i].blocks,
+			msd.luns[i].block_size,
+			msd.luns[i].direct ? ", direct" : "",
+			msd.luns[i].readonly ? ", read-only" : "");
+		/* Buffered AIO completes in io_submit(), nothing overlaps */
+		if (!msd.luns[i].direct)
+			fprintf(stderr, "warning: %s: no O_DIRECT support, "
+				"falling back to buffered I/O, AIO becomes "
+				"synchronous\n", paths[i]);
+	}
+
+	ret = msd_register(&msd);
+	if (ret) {
+		fprintf(stderr, "can't register requests: %s\n",
+			strerror(-ret));
+		goto err_msd;
+	}
+
+	if (usbf_start(func) < 0) {
+		fprintf(stderr, "function start failed\n");
+		goto err_msd;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = msd_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (pthread_create(&thread, NULL, msd_thread, &msd)) {
+		usbf_stop(func);
+		goto err_msd;
+	}
+
+	while (!msd_signalled) {
+		if (usbf_wait_events(func, MSD_EVENTS_MS) > 0)
+			usbf_handle_events(func);
+	}
+
+	do {
+		msd_stop(&msd);
+		if (++tries == MSD_STOP_TRIES) {
+			usbf_stop(func);
+			stopped = 1;
+		}
+	} while (msd_join(thread, MSD_EVENTS_MS));
+	if (!stopped)
+		usbf_stop(func);
+
+	printf("%llu commands, %llu failed, %llu phase errors, %llu resets\n"
+		"%llu bytes read, %llu bytes written\n",
+		(unsigned long long)msd.stats.commands,
+		(unsigned long long)msd.stats.failed,
+		(unsigned long long)msd.stats.phase_errors,
+		(unsigned long long)msd.stats.resets,
+		(unsigned long long)msd.stats.read_bytes,
+		(unsigned long long)msd.stats.written_bytes);
+
+	msd_cleanup(&msd);
+	usbf_delete_function(func);
+
+	return 0;
+
+err_msd:
+	msd_cleanup(&msd);
+err_func:
+	usbf_delete_function(func);
+
+	return 1;
+}
@@ -0,0 +1,644 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Network function bridging TAP interface to bulk IN/OUT endpoint pair.
+ * Ethernet frames are aggregated into NCM Transfer Blocks (see ntb.h),
+ * block going to host is sent once it's full or flush timeout since its
+ * first frame passes. Function is vendor specific as libusbf doesn't
+ * emit CDC class descriptors, host side needs driver speaking NTB16 over
+ * plain bulk pipes; GET_NTB_PARAMETERS is answered for it.
+ *
+ * With -T codec runs over Ethernet pcap trace instead, blocks are
+ * encoded with trace timing, decoded back and compared with original
+ * frames. No device is needed for that.
+ */
+
+#include <libusbf.h>
+#include "ntb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+#define NCM_DEFAULT_NTB_SIZE	16384
+#define NCM_DEFAULT_FLUSH_US	400
+#define NCM_DEFAULT_DEPTH	4
+/* Largest frame read from TAP, VLAN tagged frame with jumbo slack */
+#define NCM_FRAME_SIZE		9216
+/* Threads recheck stop flag this often */
+#define NCM_POLL_MS		100
+
+/* Class specific GET_NTB_PARAMETERS, device to host, interface */
+#define NCM_REQ_TYPE		0xa1
+#define NCM_GET_NTB_PARAMETERS	0x80
+
+struct ncm_stats {
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t blocks;
+	uint64_t dropped;
+	uint64_t errors;
+};
+
+struct ncm {
+	struct usbf_function *func;
+	struct usbf_endpoint *in, *out;
+	struct usbf_stream *tx, *rx;
+	int tap;
+	size_t ntb_size;
+	long flush_us;
+	/* tx: TAP to host, rx: host to TAP, each owned by its thread */
+	struct ncm_stats tx_stats;
+	struct ncm_stats rx_stats;
+};
+
+static volatile sig_atomic_t ncm_stop;
+
+static void ncm_signal(int sig)
+{
+	(void)sig;
+	ncm_stop = 1;
+}
+
+static long ncm_us_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000L +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static int ncm_tap_open(char *name)
+{
+	struct ifreq ifr;
+	int fd;
+
+	fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+	if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+		close(fd);
+		return -errno;
+	}
+	/* Kernel might have expanded %d */
+	snprintf(name, IFNAMSIZ, "%s", ifr.ifr_name);
+
+	return fd;
+}
+
+/* Returns zero if there is no point in trying to send anything */
+static int ncm_tx_ready(struct ncm *ncm)
+{
+	while (!ncm_stop) {
+		switch (usbf_wait_enabled(ncm->func, NCM_POLL_MS)) {
+		case 0:
+			return 1;
+		case -ETIMEDOUT:
+			continue;
+		default:
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+static void ncm_tx_flush(struct ncm *ncm, struct ntb_encoder *enc)
+{
+	struct usbf_endpoint_info info;
+	size_t length;
+
+	if (usbf_endpoint_get_info(ncm->in, &info))
+		info.maxpacketsize = 0;
+	length = ntb_encoder_finish(enc, info.maxpacketsize);
+
+	if (!ncm_tx_ready(ncm) || usbf_stream_commit(ncm->tx, length)) {
+		ncm->tx_stats.dropped += enc->count;
+		/* Buffer stays acquired, reuse it for next block */
+		ntb_encoder_start(enc, enc->buf, enc->size);
+		return;
+	}
+
+	ncm->tx_stats.blocks++;
+	enc->buf = NULL;
+}
+
+/* Opens new block unless there is one already */
+static int ncm_tx_open(struct ncm *ncm, struct ntb_encoder *enc,
+	struct timespec *first)
+{
+	void *buf;
+	size_t size;
+
+	if (!enc->buf) {
+		do {
+			buf = usbf_stream_acquire(ncm->tx, &size, NCM_POLL_MS);
+		} while (!buf && errno == ETIMEDOUT && !ncm_stop);
+		if (!buf)
+			return -errno;
+		ntb_encoder_start(enc, buf, size);
+	}
+
+	if (!enc->count)
+		clock_gettime(CLOCK_MONOTONIC, first);
+
+	return 0;
+}
+
+static void *ncm_tx_thread(void *arg)
+{
+	struct ncm *ncm = arg;
+	struct ntb_encoder enc;
+	struct timespec first, timeout;
+	struct pollfd pfd;
+	uint8_t *frame;
+	long left;
+	ssize_t n;
+	int ret;
+
+	frame = malloc(NCM_FRAME_SIZE);
+	if (!frame)
+		return NULL;
+
+	memset(&enc, 0, sizeof(enc));
+	pfd.fd = ncm->tap;
+	pfd.events = POLLIN;
+
+	while (!ncm_stop) {
+		/* Wait for more frames only until open block is due */
+		left = NCM_POLL_MS * 1000L;
+		if (enc.count) {
+			left = ncm->flush_us - ncm_us_since(&first);
+			if (left <= 0) {
+				ncm_tx_flush(ncm, &enc);
+				continue;
+			}
+		}
+		timeout.tv_sec = left / 1000000;
+		timeout.tv_nsec = left % 1000000 * 1000;
+
+		ret = ppoll(&pfd, 1, &timeout, NULL);
+		if (ret < 0 && errno != EINTR)
+			break;
+		if (ret <= 0)
+			continue;
+
+		n = read(ncm->tap, frame, NCM_FRAME_SIZE);
+		if (n <= 0)
+			continue;
+
+		if (ncm_tx_open(ncm, &enc, &first)) {
+			ncm->tx_stats.dropped++;
+			continue;
+		}
+		ret = ntb_encoder_add(&enc, frame, n);
+		if (ret == -ENOSPC) {
+			ncm_tx_flush(ncm, &enc);
+			if (ncm_tx_open(ncm, &enc, &first)) {
+				ncm->tx_stats.dropped++;
+				continue;
+			}
+			ret = ntb_encoder_add(&enc, frame, n);
+		}
+		if (ret) {
+			ncm->tx_stats.dropped++;
+			continue;
+		}
+		ncm->tx_stats.frames++;
+		ncm->tx_stats.bytes += n;
+	}
+
+	free(frame);
+	return NULL;
+}
+
+static int ncm_rx_frame(const void *data, size_t length, void *arg)
+{
+	struct ncm *ncm = arg;
+
+	if (write(ncm->tap, data, length) != (ssize_t)length) {
+		ncm->rx_stats.dropped++;
+		return 0;
+	}
+	ncm->rx_stats.frames++;
+	ncm->rx_stats.bytes += length;
+
+	return 0;
+}
+
+static void *ncm_rx_thread(void *arg)
+{
+	struct ncm *ncm = arg;
+	size_t length;
+	void *ntb;
+
+	while (!ncm_stop) {
+		ntb = usbf_stream_acquire(ncm->rx, &length, NCM_POLL_MS);
+		if (!ntb) {
+			if (errno == ESHUTDOWN)
+				break;
+			if (errno != ETIMEDOUT)
+				ncm->rx_stats.errors++;
+			continue;
+		}
+
+		if (ntb_decode(ntb, length, ncm_rx_frame, ncm) < 0)
+			ncm->rx_stats.errors++;
+		else
+			ncm->rx_stats.blocks++;
+		usbf_stream_commit(ncm->rx, 0);
+	}
+
+	return NULL;
+}
+
+static void ncm_print_stats(const char *name, const struct ncm_stats *stats)
+{
+	printf("%s: %llu frames, %llu bytes, %llu blocks, "
+		"%llu dropped, %llu errors\n", name,
+		(unsigned long long)stats->frames,
+		(unsigned long long)stats->bytes,
+		(unsigned long long)stats->blocks,
+		(unsigned long long)stats->dropped,
+		(unsigned long long)stats->errors);
+}
+
+static int ncm_bridge(char *path, char *ifname, size_t ntb_size,
+	long flush_us, int depth)
+{
+	struct usbf_function_descriptor f_desc = {
+		.speed = USBF_SPEED_FS | USBF_SPEED_HS | USBF_SPEED_SS,
+		.interface_class = USBF_CLASS_VENDOR_SPEC,
+		.string = "NCM BRIDGE",
+	};
+	struct usbf_endpoint_descriptor ep_desc = {
+		.type = USBF_BULK,
+		.fs_maxpacketsize = 64,
+		.hs_maxpacketsize = 512,
+		.ss_maxpacketsize = 1024,
+	};
+	struct ntb_parameters params;
+	struct sigaction sa;
+	struct ncm ncm;
+	pthread_t tx, rx;
+	int ret = 1;
+
+	memset(&ncm, 0, sizeof(ncm));
+	ncm.ntb_size = ntb_size;
+	ncm.flush_us = flush_us;
+
+	ncm.tap = ncm_tap_open(ifname);
+	if (ncm.tap < 0) {
+		fprintf(stderr, "can't open tap: %s\n", strerror(-ncm.tap));
+		return 1;
+	}
+
+	ncm.func = usbf_create_function(&f_desc, path);
+	if (!ncm.func) {
+		fprintf(stderr, "function registration failed\n");
+		goto err_tap;
+	}
+
+	ep_desc.direction = USBF_IN;
+	ncm.in = usbf_add_endpoint(ncm.func, &ep_desc);
+	ep_desc.direction = USBF_OUT;
+	ncm.out = usbf_add_endpoint(ncm.func, &ep_desc);
+	if (!ncm.in || !ncm.out) {
+		fprintf(stderr, "can't add endpoints\n");
+		goto err_func;
+	}
+
+	ntb_parameters_init(&params, ntb_size, ntb_size);
+	usbf_register_setup_response(ncm.func, NCM_REQ_TYPE,
+		NCM_GET_NTB_PARAMETERS, 0, 0, &params, sizeof(params));
+
+	if (usbf_start(ncm.func) < 0) {
+		fprintf(stderr, "function start failed\n");
+		goto err_func;
+	}
+
+	ncm.tx = usbf_stream_create(ncm.in, ntb_size, depth);
+	ncm.rx = usbf_stream_create(ncm.out, ntb_size, depth);
+	if (!ncm.tx || !ncm.rx) {
+		fprintf(stderr, "can't create streams\n");
+		goto err_streams;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = ncm_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (pthread_create(&tx, NULL, ncm_tx_thread, &ncm))
+		goto err_streams;
+	if (pthread_create(&rx, NULL, ncm_rx_thread, &ncm)) {
+		ncm_stop = 1;
+		pthread_join(tx, NULL);
+		goto err_streams;
+	}
+
+	printf("bridging %s, NTB size %zu, flush timeout %ld us\n",
+		ifname, ntb_size, flush_us);
+
+	while (!ncm_stop) {
+		if (usbf_wait_events(ncm.func, NCM_POLL_MS) > 0)
+			usbf_handle_events(ncm.func);
+	}
+
+	pthread_join(tx, NULL);
+	pthread_join(rx, NULL);
+	ncm_print_stats("tx", &ncm.tx_stats);
+	ncm_print_stats("rx", &ncm.rx_stats);
+	ret = 0;
+
+err_streams:
+	if (ncm.tx)
+		usbf_stream_delete(ncm.tx);
+	if (ncm.rx)
+		usbf_stream_delete(ncm.rx);
+	usbf_stop(ncm.func);
+err_func:
+	usbf_delete_function(ncm.func);
+err_tap:
+	close(ncm.tap);
+
+	return ret;
+}
+
+/* pcap file format, only Ethernet link type is accepted */
+#define PCAP_MAGIC_US		0xa1b2c3d4
+#define PCAP_MAGIC_NS		0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET	1
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record_header {
+	uint32_t ts_sec;
+	uint32_t ts_frac;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+struct ncm_trace {
+	/* Frames in currently open block, for comparison after decoding */
+	uint8_t expect[NTB_MAX_SIZE];
+	size_t offset[NTB_MAX_DATAGRAMS + 1];
+	int count;
+	int checked;
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t block_bytes;
+	uint64_t blocks;
+	uint64_t timeouts;
+	uint64_t skipped;
+	uint64_t mismatches;
+	int max_frames;
+};
+
+static int ncm_trace_check(const void *data, size_t length, void *arg)
+{
+	struct ncm_trace *tr = arg;
+	int i = tr->checked++;
+
+	if (i >= tr->count || length != tr->offset[i + 1] - tr->offset[i] ||
+			memcmp(data, tr->expect + tr->offset[i], length))
+		tr->mismatches++;
+
+	return 0;
+}
+
+static void ncm_trace_flush(struct ncm_trace *tr, struct ntb_encoder *enc,
+	uint16_t maxpacket)
+{
+	size_t length;
+	int ret;
+
+	length = ntb_encoder_finish(enc, maxpacket);
+	if (!length)
+		return;
+
+	tr->checked = 0;
+	ret = ntb_decode(enc->buf, length, ncm_trace_check, tr);
+	if (ret != tr->count || tr->checked != tr->count)
+		tr->mismatches++;
+
+	tr->blocks++;
+	tr->block_bytes += length;
+	if (tr->count > tr->max_frames)
+		tr->max_frames = tr->count;
+	tr->count = 0;
+	ntb_encoder_start(enc, enc->buf, enc->size);
+}
+
+static uint32_t ncm_swap32(uint32_t v, int swap)
+{
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+static int ncm_trace(const char *path, size_t ntb_size, long flush_us,
+	uint16_t maxpacket)
+{
+	struct pcap_file_header fh;
+	struct pcap_record_header rh;
+	struct ntb_encoder enc;
+	struct ncm_trace *tr;
+	uint8_t *ntb, *frame;
+	uint64_t ts, first = 0;
+	uint32_t length;
+	int swap, ns, ret = 1;
+	FILE *file;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	tr = calloc(1, sizeof(*tr));
+	ntb = malloc(ntb_size);
+	frame = malloc(UINT16_MAX);
+	if (!tr || !ntb || !frame)
+		goto out;
+
+	if (fread(&fh, sizeof(fh), 1, file) != 1)
+		goto bad;
+	swap = fh.magic == __builtin_bswap32(PCAP_MAGIC_US) ||
+		fh.magic == __builtin_bswap32(PCAP_MAGIC_NS);
+	fh.magic = ncm_swap32(fh.magic, swap);
+	ns = fh.magic == PCAP_MAGIC_NS;
+	if ((fh.magic != PCAP_MAGIC_US && !ns) ||
+			ncm_swap32(fh.linktype, swap) != PCAP_LINKTYPE_ETHERNET)
+		goto bad;
+
+	memset(&enc, 0, sizeof(enc));
+	ntb_encoder_start(&enc, ntb, ntb_size);
+
+	while (fread(&rh, sizeof(rh), 1, file) == 1) {
+		length = ncm_swap32(rh.incl_len, swap);
+		if (length > UINT16_MAX || fread(frame, length, 1, file) != 1)
+			goto bad;
+		/* Truncated capture can't be compared */
+		if (length != ncm_swap32(rh.orig_len, swap)) {
+			tr->skipped++;
+			continue;
+		}
+
+		ts = ncm_swap32(rh.ts_sec, swap) * 1000000ULL +
+			ncm_swap32(rh.ts_frac, swap) / (ns ? 1000 : 1);
+		if (tr->count && ts >= first &&
+				ts - first >= (uint64_t)flush_us) {
+			tr->timeouts++;
+			ncm_trace_flush(tr, &enc, maxpacket);
+		}
+
+		ret = ntb_encoder_add(&enc, frame, length);
+		if (ret == -ENOSPC) {
+			ncm_trace_flush(tr, &enc, maxpacket);
+			ret = ntb_encoder_add(&enc, frame, length);
+		}
+		if (ret) {
+			tr->skipped++;
+			continue;
+		}
+
+		if (!tr->count)
+			first = ts;
+		memcpy(tr->expect + tr->offset[tr->count], frame, length);
+		tr->offset[tr->count + 1] = tr->offset[tr->count] + length;
+		tr->count++;
+		tr->frames++;
+		tr->bytes += length;
+	}
+	ncm_trace_flush(tr, &enc, maxpacket);
+
+	printf("%llu frames, %llu bytes, %llu skipped\n",
+		(unsigned long long)tr->frames, (unsigned long long)tr->bytes,
+		(unsigned long long)tr->skipped);
+	printf("%llu blocks (%llu by timeout), %.1f frames per block "
+		"(max %d), %.1f%% payload\n",
+		(unsigned long long)tr->blocks,
+		(unsigned long long)tr->timeouts,
+		tr->blocks ? (double)tr->frames / tr->blocks : 0.0,
+		tr->max_frames,
+		tr->block_bytes ? 100.0 * tr->bytes / tr->block_bytes : 0.0);
+	printf("%llu mismatches\n", (unsigned long long)tr->mismatches);
+
+	ret = tr->mismatches ? 1 : 0;
+	goto out;
+
+bad:
+	fprintf(stderr, "%s: not an Ethernet pcap file\n", path);
+	ret = 1;
+out:
+	free(frame);
+	free(ntb);
+	free(tr);
+	fclose(file);
+
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options] <ffs directory>\n"
+		"       %s -T <trace.pcap> [options]\n"
+		"  -i <name>  TAP interface name (default ncm%%d)\n"
+		"  -s <size>  NTB size in bytes (default %d)\n"
+		"  -t <usec>  flush timeout (default %d)\n"
+		"  -d <n>     transfers in flight per direction (default %d)\n"
+		"  -m <size>  maxpacket size assumed for trace (default 512)\n"
+		"  -T <file>  run NTB codec over pcap trace\n",
+		name, name, NCM_DEFAULT_NTB_SIZE, NCM_DEFAULT_FLUSH_US,
+		NCM_DEFAULT_DEPTH);
+}
+
+int main(int argc, char *argv[])
+{
+	char ifname[IFNAMSIZ] = "ncm%d";
+	const char *trace = NULL;
+	long ntb_size = NCM_DEFAULT_NTB_SIZE;
+	long flush_us = NCM_DEFAULT_FLUSH_US;
+	int depth = NCM_DEFAULT_DEPTH;
+	int maxpacket = 512;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:s:t:d:m:T:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			snprintf(ifname, sizeof(ifname), "%s", optarg);
+			break;
+		case 's':
+			ntb_size = atol(optarg);
+			break;
+		case 't':
+			flush_us = atol(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'm':
+			maxpacket = atoi(optarg);
+			break;
+		case 'T':
+			trace = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt != 'h';
+		}
+	}
+
+	if (ntb_size < NTB_MIN_SIZE || ntb_size > NTB_MAX_SIZE ||
+			flush_us < 0 || depth < 1 || maxpacket < 0 ||
+			maxpacket > UINT16_MAX) {
+		fprintf(stderr, "invalid parameters\n");
+		return 1;
+	}
+
+	if (trace)
+		return ncm_trace(trace, ntb_size, flush_us, maxpacket);
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	return ncm_bridge(argv[optind], ifname, ntb_size, flush_us, depth);
+}
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Drives NTB codec with synthetic frames: blocks encoded from them have
+ * to decode back to the same frames, and hand made broken blocks have to
+ * be rejected before any datagram reaches handler.
+ */
+
+#include "ntb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#define TEST_MAXPACKET	512
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n",		\
+			__FILE__, __LINE__, #cond);			\
+		exit(1);						\
+	}								\
+} while (0)
+
+/* Frames handler got, in order */
+struct test_frames {
+	int count;
+	const uint8_t *data[NTB_MAX_DATAGRAMS];
+	size_t length[NTB_MAX_DATAGRAMS];
+	/* Handler stops decoding after this many, 0 means never */
+	int stop;
+};
+
+static int test_handler(const void *data, size_t length, void *arg)
+{
+	struct test_frames *frames = arg;
+
+	CHECK(frames->count < NTB_MAX_DATAGRAMS);
+	frames->data[frames->count] = data;
+	frames->length[frames->count++] = length;
+
+	return frames->stop && frames->count == frames->stop;
+}
+
+static void test_fill(uint8_t *buf, size_t length, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < length; ++i)
+		buf[i] = seed + i * 7;
+}
+
+static uint16_t test_get16(const uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le16toh(v);
+}
+
+static void test_put16(uint8_t *p, uint16_t v)
+{
+	v = htole16(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+/* Decodes block which must be rejected, without calling handler */
+static void test_reject(const uint8_t *block, size_t length)
+{
+	struct test_frames frames = { 0 };
+
+	CHECK(ntb_decode(block, length, test_handler, &frames) == -EBADMSG);
+	CHECK(frames.count == 0);
+}
+
+static void test_round_trip(void)
+{
+	static const size_t lengths[] = { 60, 61, 1514, 1, 127 };
+	static uint8_t frame[5][1514], buf[NTB_MIN_SIZE * 2];
+	struct test_frames frames = { 0 };
+	struct ntb_encoder enc;
+	size_t block;
+	int i;
+
+	memset(&enc, 0, sizeof(enc));
+	ntb_encoder_start(&enc, buf, sizeof(buf));
+	CHECK(ntb_encoder_finish(&enc, TEST_MAXPACKET) == 0);
+	for (i = 0; i < 5; ++i) {
+		test_fill(frame[i], lengths[i], i);
+		CHECK(!ntb_encoder_add(&enc, frame[i], lengths[i]));
+	}
+	block = ntb_encoder_finish(&enc, TEST_MAXPACKET);
+	CHECK(block > 0 && block <= sizeof(buf));
+	CHECK(test_get16(buf + 8) == block);
+
+	CHECK(ntb_decode(buf, block, test_handler, &frames) == 5);
+	CHECK(frames.count == 5);
+	for (i = 0; i < 5; ++i) {
+		CHECK(frames.length[i] == lengths[i]);
+		CHECK(!memcmp(frames.data[i], frame[i], lengths[i]));
+		/* Datagrams are aligned as GET_NTB_PARAMETERS promised */
+		CHECK((frames.data[i] - buf) % NTB_ALIGN == 0);
+	}
+
+	/* Checking without handler counts datagrams as well */
+	CHECK(ntb_decode(buf, block, NULL, NULL) == 5);
+
+	/* Handler asking to stop gets no more */
+	memset(&frames, 0, sizeof(frames));
+	frames.stop = 2;
+	CHECK(ntb_decode(buf, block, test_handler, &frames) == 2);
+	CHECK(frames.count == 2);
+
+	/* Next block continues sequence */
+	ntb_encoder_start(&enc, buf, sizeof(buf));
+	CHECK(!ntb_encoder_add(&enc, frame[0], lengths[0]));
+	CHECK(ntb_encoder_finish(&enc, TEST_MAXPACKET) > 0);
+	CHECK(test_get16(buf + 6) == 1);
+}
+
+static void test_limits(void)
+{
+	static uint8_t frame[NTB_MIN_SIZE], buf[NTB_MIN_SIZE];
+	struct ntb_encoder enc;
+	int i;
+
+	memset(&enc, 0, sizeof(enc));
+	ntb_encoder_start(&enc, buf, sizeof(buf));
+	CHECK(ntb_encoder_add(&enc, frame, sizeof(frame)) == -EMSGSIZE);
+
+	/* Block filled up is finished and next one takes the frame */
+	for (i = 0; !ntb_encoder_add(&enc, frame, 600); ++i)
+		;
+	CHECK(i == 3);
+	CHECK(ntb_encoder_add(&enc, frame, 600) == -ENOSPC);
+	CHECK(ntb_decode(buf, ntb_encoder_finish(&enc, 0), NULL, NULL) == 3);
+
+	ntb_encoder_start(&enc, buf, sizeof(buf));
+	for (i = 0; i < NTB_MAX_DATAGRAMS; ++i)
+		CHECK(!ntb_encoder_add(&enc, frame, 1));
+	CHECK(ntb_encoder_add(&enc, frame, 1) == -ENOSPC);
+}
+
+/*
+ * Single datagram of 484 bytes puts NDP at 496 and ends block exactly at
+ * 512, on packet boundary.
+ */
+static void test_padding(void)
+{
+	static uint8_t frame[484], buf[NTB_MIN_SIZE];
+	struct test_frames frames = { 0 };
+	struct ntb_encoder enc;
+	size_t block;
+
+	test_fill(frame, sizeof(frame), 9);
+	memset(&enc, 0, sizeof(enc));
+
+	/* Without known packet size nothing is padded */
+	ntb_encoder_start(&enc, buf, sizeof(buf));
+	CHECK(!ntb_encoder_add(&enc, frame, sizeof(frame)));
+	CHECK(ntb_encoder_finish(&enc, 0) == TEST_MAXPACKET);
+
+	/* One zero byte makes short packet, host needs no ZLP */
+	ntb_encoder_start(&enc, buf, sizeof(buf));
+	memset(buf, 0xff, sizeof(buf));
+	CHECK(!ntb_encoder_add(&enc, frame, sizeof(frame)));
+	block = ntb_encoder_finish(&enc, TEST_MAXPACKET);
+	CHECK(block == TEST_MAXPACKET + 1);
+	CHECK(buf[TEST_MAXPACKET] == 0);
+	CHECK(test_get16(buf + 8) == block);
+	CHECK(ntb_decode(buf, block, test_handler, &frames) == 1);
+	CHECK(frames.length[0] == sizeof(frame));
+	CHECK(!memcmp(frames.data[0], frame, sizeof(frame)));
+
+	/* Block of maximal size can't grow, transfer ends there anyway */
+	ntb_encoder_start(&enc, buf, TEST_MAXPACKET);
+	CHECK(!ntb_encoder_add(&enc, frame, sizeof(frame)));
+	CHECK(ntb_encoder_finish(&enc, TEST_MAXPACKET) == TEST_MAXPACKET);
+}
+
+static void test_malformed(void)
+{
+	static uint8_t frame[100], buf[NTB_MIN_SIZE], bad[NTB_MIN_SIZE];
+	struct ntb_encoder enc;
+	size_t block, ndp;
+
+	test_fill(frame, sizeof(frame), 5);
+	memset(&enc, 0, sizeof(enc));
+	ntb_encoder_start(&enc, buf, sizeof(buf));
+	CHECK(!ntb_encoder_add(&enc, frame, sizeof(frame)));
+	CHECK(!ntb_encoder_add(&enc, frame, sizeof(frame)));
+	block = ntb_encoder_finish(&enc, 0);
+	ndp = test_get16(buf + 10);
+	CHECK(ntb_decode(buf, block, NULL, NULL) == 2);
+
+	/* NTH16: too short, signature, header length, block length */
+	test_reject(buf, NTB_NTH16_LEN - 1);
+	memcpy(bad, buf, block);
+	bad[0] ^= 1;
+	test_reject(bad, block);
+	memcpy(bad, buf, block);
+	test_put16(bad + 4, NTB_NTH16_LEN + 4);
+	test_reject(bad, block);
+	memcpy(bad, buf, block);
+	test_put16(bad + 8, block + 1);
+	test_reject(bad, block);
+	test_put16(bad + 8, NTB_NTH16_LEN - 1);
+	test_reject(bad, block);
+
+	/* NDP16: pointer out of block, unaligned, into NTH, signature */
+	memcpy(bad, buf, block);
+	test_put16(bad + 10, block);
+	test_reject(bad, block);
+	test_put16(bad + 10, ndp + 2);
+	test_reject(bad, block);
+	test_put16(bad + 10, 4);
+	test_reject(bad, block);
+	memcpy(bad, buf, block);
+	bad[ndp] ^= 1;
+	test_reject(bad, block);
+
+	/* NDP16 length: unaligned, beyond block */
+	memcpy(bad, buf, block);
+	test_put16(bad + ndp + 4, test_get16(bad + ndp + 4) + 2);
+	test_reject(bad, block);
+	test_put16(bad + ndp + 4, block);
+	test_reject(bad, block);
+
+	/* Second datagram beyond block, first one mustn't be passed on */
+	memcpy(bad, buf, block);
+	test_put16(bad + ndp + NTB_NDP16_LEN + 6, block);
+	test_reject(bad, block);
+	memcpy(bad, buf, block);
+	test_put16(bad + ndp + NTB_NDP16_LEN + 4, 2);
+	test_reject(bad, block);
+
+	/* NDP chained to itself */
+	memcpy(bad, buf, block);
+	test_put16(bad + ndp + 6, ndp);
+	test_reject(bad, block);
+}
+
+int main(void)
+{
+	test_round_trip();
+	test_limits();
+	test_padding();
+	test_malformed();
+
+	return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "ntb.h"
+
+#include <errno.h>
+#include <string.h>
+#include <endian.h>
+
+#define NTB_ALIGNED(x)	(((x) + NTB_ALIGN - 1) & ~(size_t)(NTB_ALIGN - 1))
+
+static inline void ntb_put16(uint8_t *p, uint16_t v)
+{
+	v = htole16(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline void ntb_put32(uint8_t *p, uint32_t v)
+{
+	v = htole32(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline uint16_t ntb_get16(const uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le16toh(v);
+}
+
+static inline uint32_t ntb_get32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+/* NDP16 with count datagram entries and terminating null entry */
+static inline size_t ntb_ndp_len(int count)
+{
+	return NTB_NDP16_LEN + 4 * (count + 1);
+}
+
+void ntb_encoder_start(struct ntb_encoder *enc, void *buf, size_t size)
+{
+	enc->buf = buf;
+	enc->size = size < NTB_MAX_SIZE ? size : NTB_MAX_SIZE;
+	enc->tail = NTB_NTH16_LEN;
+	enc->count = 0;
+}
+
+int ntb_encoder_add(struct ntb_encoder *enc, const void *data, size_t length)
+{
+	size_t pos = NTB_ALIGNED(enc->tail);
+
+	if (NTB_ALIGNED(NTB_NTH16_LEN) + NTB_ALIGNED(length) +
+			ntb_ndp_len(1) > enc->size)
+		return -EMSGSIZE;
+	if (enc->count == NTB_MAX_DATAGRAMS || NTB_ALIGNED(pos + length) +
+			ntb_ndp_len(enc->count + 1) > enc->size)
+		return -ENOSPC;
+
+	/* Don't send stale bytes in alignment gaps */
+	memset(enc->buf + enc->tail, 0, pos - enc->tail);
+	memcpy(enc->buf + pos, data, length);
+	enc->index[enc->count] = pos;
+	enc->length[enc->count] = length;
+	enc->count++;
+	enc->tail = pos + length;
+
+	return 0;
+}
+
+size_t ntb_encoder_finish(struct ntb_encoder *enc, uint16_t maxpacket)
+{
+	size_t ndp, block;
+	uint8_t *p;
+	int i;
+
+	if (!enc->count)
+		return 0;
+
+	ndp = NTB_ALIGNED(enc->tail);
+	memset(enc->buf + enc->tail, 0, ndp - enc->tail);
+
+	p = enc->buf + ndp;
+	ntb_put32(p, NTB_NDP16_SIGN);
+	ntb_put16(p + 4, ntb_ndp_len(enc->count));
+	ntb_put16(p + 6, 0);
+	p += NTB_NDP16_LEN;
+	for (i = 0; i < enc->count; ++i, p += 4) {
+		ntb_put16(p, enc->index[i]);
+		ntb_put16(p + 2, enc->length[i]);
+	}
+	ntb_put32(p, 0);
+
+	block = ndp + ntb_ndp_len(enc->count);
+	if (maxpacket && block % maxpacket == 0 && block < enc->size)
+		enc->buf[block++] = 0;
+
+	p = enc->buf;
+	ntb_put32(p, NTB_NTH16_SIGN);
+	ntb_put16(p + 4, NTB_NTH16_LEN);
+	ntb_put16(p + 6, enc->sequence++);
+	ntb_put16(p + 8, block);
+	ntb_put16(p + 10, ndp);
+
+	return block;
+}
+
+/*
+ * Walks all NDPs of block. Without handler only checks that every NDP
+ * and datagram lies within block.
+ */
+static int ntb_walk(const uint8_t *buf, size_t block,
+	int (*handler)(const void *data, size_t length, void *arg), void *arg)
+{
+	size_t ndp, ndp_len, index, length;
+	const uint8_t *p;
+	int n, count = 0;
+
+	ndp = ntb_get16(buf + 10);
+	for (n = 0; ndp; ++n) {
+		if (n == NTB_MAX_NDPS || ndp < NTB_NTH16_LEN || ndp % 4 ||
+				ndp + NTB_NDP16_LEN > block)
+			return -EBADMSG;
+		p = buf + ndp;
+		ndp_len = ntb_get16(p + 4);
+		if (ntb_get32(p) != NTB_NDP16_SIGN || ndp_len % 4 ||
+				ndp_len < ntb_ndp_len(0) || ndp + ndp_len > block)
+			return -EBADMSG;
+
+		for (p += NTB_NDP16_LEN; p < buf + ndp + ndp_len; p += 4) {
+			index = ntb_get16(p);
+			length = ntb_get16(p + 2);
+			if (!index || !length)
+				break;
+			if (index < NTB_NTH16_LEN || index + length > block)
+				return -EBADMSG;
+			count++;
+			if (handler && handler(buf + index, length, arg))
+				return count;
+		}
+		ndp = ntb_get16(buf + ndp + 6);
+	}
+
+	return count;
+}
+
+int ntb_decode(const void *buf, size_t length,
+	int (*handler)(const void *data, size_t length, void *arg), void *arg)
+{
+	const uint8_t *p = buf;
+	size_t block;
+	int ret;
+
+	if (length < NTB_NTH16_LEN || ntb_get32(p) != NTB_NTH16_SIGN ||
+			ntb_get16(p + 4) != NTB_NTH16_LEN)
+		return -EBADMSG;
+	block = ntb_get16(p + 8);
+	if (block < NTB_NTH16_LEN || block > length)
+		return -EBADMSG;
+
+	ret = ntb_walk(p, block, NULL, NULL);
+	if (ret <= 0 || !handler)
+		return ret;
+
+	return ntb_walk(p, block, handler, arg);
+}
+
+void ntb_parameters_init(struct ntb_parameters *params,
+	uint32_t in_size, uint32_t out_size)
+{
+	memset(params, 0, sizeof(*params));
+	params->wLength = htole16(sizeof(*params));
+	/* NTB16 only */
+	params->bmNtbFormatsSupported = htole16(1);
+	params->dwNtbInMaxSize = htole32(in_size);
+	params->wNdpInDivisor = htole16(NTB_ALIGN);
+	params->wNdpInAlignment = htole16(NTB_ALIGN);
+	params->dwNtbOutMaxSize = htole32(out_size);
+	params->wNdpOutDivisor = htole16(NTB_ALIGN);
+	params->wNdpOutAlignment = htole16(NTB_ALIGN);
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2014 Robert Baldyga
+ *
+ * Robert Baldyga <r.baldyga@hackerion.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef NTB_H
+#define NTB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CDC-NCM 16-bit NCM Transfer Block codec. Block starts with NTH16,
+ * datagrams follow aligned to NTB_ALIGN and single NDP16 pointing to them
+ * closes it. Codec doesn't depend on libusbf so it can be driven from
+ * packet traces as well as from endpoints.
+ */
+
+#define NTB_NTH16_SIGN		0x484d434e	/* "NCMH" */
+#define NTB_NDP16_SIGN		0x304d434e	/* "NCM0", no CRC */
+#define NTB_NTH16_LEN		12
+#define NTB_NDP16_LEN		8
+#define NTB_ALIGN		4
+#define NTB_MIN_SIZE		2048
+#define NTB_MAX_SIZE		65535
+#define NTB_MAX_DATAGRAMS	128
+/* Chained NDPs followed while decoding, guards against loops */
+#define NTB_MAX_NDPS		16
+
+/* GET_NTB_PARAMETERS response, little endian on the wire */
+struct ntb_parameters {
+	uint16_t wLength;
+	uint16_t bmNtbFormatsSupported;
+	uint32_t dwNtbInMaxSize;
+	uint16_t wNdpInDivisor;
+	uint16_t wNdpInPayloadRemainder;
+	uint16_t wNdpInAlignment;
+	uint16_t wReserved;
+	uint32_t dwNtbOutMaxSize;
+	uint16_t wNdpOutDivisor;
+	uint16_t wNdpOutPayloadRemainder;
+	uint16_t wNdpOutAlignment;
+	uint16_t wNtbOutMaxDatagrams;
+} __attribute__((packed));
+
+struct ntb_encoder {
+	uint8_t *buf;
+	size_t size;
+	uint16_t sequence;
+	/* End of last datagram */
+	size_t tail;
+	int count;
+	uint16_t index[NTB_MAX_DATAGRAMS];
+	uint16_t length[NTB_MAX_DATAGRAMS];
+};
+
+/* Starts new block in buf of size bytes */
+void ntb_encoder_start(struct ntb_encoder *enc, void *buf, size_t size);
+
+/*
+ * Appends datagram. Returns -ENOSPC when block is full and has to be
+ * finished first, -EMSGSIZE when datagram won't fit even into empty one.
+ */
+int ntb_encoder_add(struct ntb_encoder *enc, const void *data, size_t length);
+
+/*
+ * Writes headers and returns block length, 0 for empty block. Length
+ * which is multiple of maxpacket is padded by one byte, unless block has
+ * maximal size, so host sees short packet without need of ZLP.
+ */
+size_t ntb_encoder_finish(struct ntb_encoder *enc, uint16_t maxpacket);
+
+/*
+ * Calls handler for each datagram of block, handler returning nonzero
+ * stops decoding. Returns number of datagrams or -EBADMSG for malformed
+ * block, in which case nothing has been passed to handler.
+ */
+int ntb_decode(const void *buf, size_t length,
+	int (*handler)(const void *data, size_t length, void *arg), void *arg);
+
+void ntb_parameters_init(struct ntb_parameters *params,
+	uint32_t in_size, uint32_t out_size);
+
+#endif /* NTB_H */